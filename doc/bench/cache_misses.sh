@@ -0,0 +1,41 @@
+#!/bin/sh
+#
+# Cache misses per packet of two builds under the same load, to check a
+# change of the data structure layouts (ubond_tunnel_t, ubond_pkt_t). Build
+# the revision to compare with in another tree, then:
+#
+#   UBOND_BEFORE=../ubond-old/src/ubond UBOND=src/ubond \
+#       BENCH_USER=ubond sh doc/bench/cache_misses.sh
+#
+# perf has to count hardware events in the namespaces (perf_event_paranoid,
+# and not every VM exposes them). Every build runs BENCH_RUNS times, in turns
+# so that the host's noise hits both. A fixed BENCH_RATE keeps the work per
+# second the same whatever the build manages.
+
+. "$(dirname "$0")/netns.sh"
+
+[ -n "$UBOND_BEFORE" ] || bench_die "UBOND_BEFORE is the build to compare with"
+command -v perf > /dev/null || bench_die "perf not found"
+
+BENCH_RUNS=${BENCH_RUNS:-3}
+BENCH_EVENTS="raw_syscalls:sys_enter,cache-misses,cache-references"
+after=$UBOND
+
+bench_setup
+bench_header
+n=0
+while [ $n -lt "$BENCH_RUNS" ]; do
+    for build in before after; do
+        if [ $build = before ]; then UBOND=$UBOND_BEFORE; else UBOND=$after; fi
+        bench_start "" ""
+        bench_run "$build"
+        printf "%-24s cache-misses/pkt: client %s server %s, " "" \
+            "$(bench_perf cli cache-misses)" "$(bench_perf srv cache-misses)"
+        printf "references/pkt: client %s server %s\n" \
+            "$(bench_perf cli cache-references)" \
+            "$(bench_perf srv cache-references)"
+        bench_stop
+    done
+    n=$((n + 1))
+done
+bench_teardown
@@ -0,0 +1,41 @@
+#!/bin/sh
+#
+# Compare the I/O backends: the same load goes through the tunnel with the
+# libev loop (one packet per system call, then with sendmmsg/recvmmsg
+# batches) and with io_uring, and each run prints a line of throughput,
+# CPU time and system calls per packet.
+#
+#   UBOND=src/ubond BENCH_USER=ubond sh doc/bench/io_backend.sh
+#
+# See netns.sh for the other knobs (BENCH_DURATION, BENCH_PKTLEN, ...).
+
+. "$(dirname "$0")/netns.sh"
+
+BATCH=${BATCH:-32}
+
+bench_setup
+bench_header
+for run in libev libev-batch io_uring; do
+    case $run in
+    libev)
+        backend=libev tunnel="" ;;
+    libev-batch)
+        backend=libev tunnel="recv_batch = $BATCH\nsend_batch = $BATCH" ;;
+    io_uring)
+        backend=io_uring tunnel="send_batch = $BATCH" ;;
+    esac
+    bench_start "io_backend = \"$backend\"" "$tunnel"
+    # ubond falls back to libev when io_uring can't be set up
+    if [ "$(bench_status $NS_CLI io_backend)" != $backend ]; then
+        echo "$run: backend not available, skipped"
+        bench_stop
+        continue
+    fi
+    bench_run $run
+    [ $backend = io_uring ] &&
+        printf "%-24s io_ops_per_syscall: client %s server %s\n" "" \
+            "$(bench_status $NS_CLI io_ops_per_syscall)" \
+            "$(bench_status $NS_SRV io_ops_per_syscall)"
+    bench_stop
+done
+bench_teardown
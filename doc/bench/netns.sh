@@ -0,0 +1,235 @@
+#!/bin/sh
+#
+# Common part of the benchmark drivers: two network namespaces joined by
+# BENCH_LINKS veth pairs, an ubond server in one and a client in the other,
+# and counters read around a load of BENCH_DURATION seconds.
+#
+# Sourced by the drivers, needs root, iproute2, iperf3 and python3 (for the
+# control socket). UBOND points to the binary under test, BENCH_USER is the
+# user it runs as (a home to chroot to is needed, as usual).
+
+UBOND=${UBOND:-ubond}
+BENCH_USER=${BENCH_USER:-ubond}
+BENCH_DIR=${BENCH_DIR:-/tmp/ubond-bench}
+BENCH_LINKS=${BENCH_LINKS:-2}
+BENCH_DURATION=${BENCH_DURATION:-10}
+BENCH_BANDWIDTH=${BENCH_BANDWIDTH:-10000000}  # bandwidth_upload of every link
+BENCH_MTU=${BENCH_MTU:-1400}
+BENCH_PKTLEN=${BENCH_PKTLEN:-1300}            # UDP payload sent by iperf3
+BENCH_RATE=${BENCH_RATE:-0}                   # iperf3 -b, 0: as fast as it goes
+BENCH_PROTO=${BENCH_PROTO:-udp}               # udp or tcp
+BENCH_EVENTS=${BENCH_EVENTS:-raw_syscalls:sys_enter}  # counted by perf
+
+NS_SRV=ubond-bench-srv
+NS_CLI=ubond-bench-cli
+
+bench_die()
+{
+    echo "$*" >&2
+    bench_teardown
+    exit 1
+}
+
+bench_setup()
+{
+    i=0
+    for tool in ip iperf3 python3; do
+        command -v $tool > /dev/null || { echo "$tool not found" >&2; exit 1; }
+    done
+    bench_teardown
+    mkdir -p "$BENCH_DIR"
+    ip netns add $NS_SRV && ip netns add $NS_CLI || exit 1
+    while [ $i -lt "$BENCH_LINKS" ]; do
+        ip link add a$i netns $NS_CLI type veth peer name b$i netns $NS_SRV
+        ip -n $NS_CLI addr add 10.10.$i.2/24 dev a$i
+        ip -n $NS_SRV addr add 10.10.$i.1/24 dev b$i
+        ip -n $NS_CLI link set a$i up
+        ip -n $NS_SRV link set b$i up
+        i=$((i + 1))
+    done
+    ip -n $NS_CLI link set lo up
+    ip -n $NS_SRV link set lo up
+
+    cat > "$BENCH_DIR/updown.sh" <<EOF
+#!/bin/sh
+[ "\$2" = "tuntap_up" ] || exit 0
+ip link set dev "\$1" mtu "\$MTU" up
+ip addr add "\$IP4" dev "\$1" 2>/dev/null
+exit 0
+EOF
+    chmod 700 "$BENCH_DIR/updown.sh"
+}
+
+bench_teardown()
+{
+    bench_stop
+    ip netns del $NS_SRV 2>/dev/null
+    ip netns del $NS_CLI 2>/dev/null
+}
+
+# bench_config server|client "<[general] lines>" "<lines of every link>"
+bench_config()
+{
+    side=$1
+    i=0
+    if [ $side = server ]; then addr=10.0.0.1/24; else addr=10.0.0.2/24; fi
+    {
+        echo "[general]"
+        echo "mode = \"$side\""
+        echo "statuscommand = \"$BENCH_DIR/updown.sh\""
+        echo "interface_name = \"ubond0\""
+        echo "tuntap = \"tun\""
+        echo "ip4 = \"$addr\""
+        echo "mtu = $BENCH_MTU"
+        echo "timeout = 30"
+        echo "password = \"bench\""
+        echo "control_bind_host = \"127.0.0.1\""
+        echo "control_bind_port = \"5090\""
+        printf "%b\n" "$2"
+        while [ $i -lt "$BENCH_LINKS" ]; do
+            echo "[link$i]"
+            if [ $side = server ]; then
+                echo "bindhost = \"10.10.$i.1\""
+            else
+                echo "bindhost = \"10.10.$i.2\""
+                echo "remotehost = \"10.10.$i.1\""
+            fi
+            echo "bindport = $((5080 + i))"
+            echo "remoteport = $((5080 + i))"
+            echo "bandwidth_upload = $BENCH_BANDWIDTH"
+            printf "%b\n" "$3"
+            i=$((i + 1))
+        done
+    } > "$BENCH_DIR/$side.conf"
+    chmod 600 "$BENCH_DIR/$side.conf"
+}
+
+# bench_start "<[general] lines>" "<lines of every link>"
+bench_start()
+{
+    n=0
+    bench_config server "$1" "$2"
+    bench_config client "$1" "$2"
+    ip netns exec $NS_SRV "$UBOND" -c "$BENCH_DIR/server.conf" \
+        -u "$BENCH_USER" --debug > "$BENCH_DIR/server.log" 2>&1 &
+    STARTED="$!"
+    ip netns exec $NS_CLI "$UBOND" -c "$BENCH_DIR/client.conf" \
+        -u "$BENCH_USER" --debug > "$BENCH_DIR/client.log" 2>&1 &
+    STARTED="$STARTED $!"
+    until [ "$(bench_connected $NS_SRV)" = "$BENCH_LINKS" ] &&
+        [ "$(bench_connected $NS_CLI)" = "$BENCH_LINKS" ]; do
+        n=$((n + 1))
+        [ $n -lt 40 ] || bench_die "tunnel did not come up, see $BENCH_DIR/*.log"
+        sleep 0.5
+    done
+    # the processes doing the work are the children of the privileged ones
+    SRV_PID=$(pgrep -P ${STARTED% *})
+    CLI_PID=$(pgrep -P ${STARTED#* })
+}
+
+bench_stop()
+{
+    [ -n "$STARTED" ] || return
+    for pid in $STARTED; do
+        kill $(pgrep -P $pid) $pid 2>/dev/null
+    done
+    wait $STARTED
+    STARTED= SRV_PID= CLI_PID=
+}
+
+# bench_status namespace key: a field of the control status, summed over
+# the tunnels when it is a per tunnel one
+bench_status()
+{
+    ip netns exec $1 python3 -c '
+import json, sys, urllib.request
+j = json.load(urllib.request.urlopen("http://127.0.0.1:5090/status"))
+k = sys.argv[1]
+print(j[k] if k in j else sum(t.get(k, 0) for t in j["tunnels"]))' "$2"
+}
+
+# bench_connected namespace: how many links are up
+bench_connected()
+{
+    ip netns exec $1 python3 -c '
+import json, urllib.request
+j = json.load(urllib.request.urlopen("http://127.0.0.1:5090/status"))
+print(sum(t["status"] == "connected" for t in j["tunnels"]))' 2> /dev/null
+}
+
+# user + system time of pid, in clock ticks
+bench_cpu()
+{
+    awk '{ print $14 + $15 }' /proc/$1/stat
+}
+
+bench_counter()
+{
+    ip netns exec $1 cat /sys/class/net/ubond0/statistics/$2
+}
+
+bench_header()
+{
+    printf "%-24s %9s %8s %10s %10s %10s %10s\n" "" "Mbit/s" "kpps" \
+        "cli us/pkt" "srv us/pkt" "cli sc/pkt" "srv sc/pkt"
+}
+
+# Push load client to server for BENCH_DURATION seconds and print one line:
+# what the tunnel delivered in Mbit/s and kpps, CPU microseconds per packet
+# of each end and, when perf is there, system calls per packet. The perf
+# counts of BENCH_EVENTS stay around for bench_perf until the next run.
+bench_run()
+{
+    label=$1
+    hz=$(getconf CLK_TCK)
+    ip netns exec $NS_SRV iperf3 -s -1 -B 10.0.0.1 > /dev/null 2>&1 &
+    jobs=$!
+    sleep 0.5
+    bytes0=$(bench_counter $NS_SRV rx_bytes)
+    pkts0=$(bench_counter $NS_SRV rx_packets)
+    ccpu0=$(bench_cpu $CLI_PID)
+    scpu0=$(bench_cpu $SRV_PID)
+    rm -f "$BENCH_DIR/perf.cli" "$BENCH_DIR/perf.srv"
+    if command -v perf > /dev/null; then
+        perf stat -x, -e "$BENCH_EVENTS" -p $CLI_PID \
+            -o "$BENCH_DIR/perf.cli" -- sleep "$BENCH_DURATION" &
+        jobs="$jobs $!"
+        perf stat -x, -e "$BENCH_EVENTS" -p $SRV_PID \
+            -o "$BENCH_DIR/perf.srv" -- sleep "$BENCH_DURATION" &
+        jobs="$jobs $!"
+    fi
+    if [ "$BENCH_PROTO" = udp ]; then
+        opts="-u -b $BENCH_RATE -l $BENCH_PKTLEN"
+    else
+        opts=""
+    fi
+    ip netns exec $NS_CLI iperf3 -c 10.0.0.1 -t "$BENCH_DURATION" $opts \
+        > "$BENCH_DIR/iperf3.log" 2>&1
+    wait $jobs
+    bytes=$(($(bench_counter $NS_SRV rx_bytes) - bytes0))
+    pkts=$(($(bench_counter $NS_SRV rx_packets) - pkts0))
+    BENCH_PKTS=$pkts
+    ccpu=$(($(bench_cpu $CLI_PID) - ccpu0))
+    scpu=$(($(bench_cpu $SRV_PID) - scpu0))
+    [ $pkts -gt 0 ] || bench_die "nothing went through, see $BENCH_DIR/iperf3.log"
+    csys=$(bench_perf cli raw_syscalls:sys_enter)
+    ssys=$(bench_perf srv raw_syscalls:sys_enter)
+    awk -v l="$label" -v b=$bytes -v p=$pkts -v d="$BENCH_DURATION" \
+        -v c=$ccpu -v s=$scpu -v hz=$hz -v cs="$csys" -v ss="$ssys" 'BEGIN {
+        printf "%-24s %9.1f %8.1f %10.2f %10.2f %10s %10s\n", l,
+            b * 8 / d / 1e6, p / d / 1e3,
+            c * 1e6 / hz / p, s * 1e6 / hz / p, cs, ss
+    }'
+}
+
+# bench_perf cli|srv event: what perf counted of event during the last run,
+# per packet the tunnel delivered, - when it could not count it
+bench_perf()
+{
+    [ -f "$BENCH_DIR/perf.$1" ] || { echo -; return; }
+    awk -F, -v e="$2" -v p=$BENCH_PKTS '
+        ($3 == e || index($3, e ":") == 1) && $1 ~ /^[0-9]+$/ {
+            printf "%.2f", $1 / p; found = 1
+        }
+        END { if (!found) printf "-" }' "$BENCH_DIR/perf.$1"
+}
@@ -0,0 +1,251 @@
+#include "includes.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <netinet/in.h>
+
+#include "log.h"
+#include "classify.h"
+
+/*
+ * Inner packet classification. The headers of what is read from the tun
+ * device are parsed once, IPv6 extension headers included, and the first
+ * matching rule of the policy table tells whether the packet is reordered
+ * and resent, only resent, or sent best effort.
+ */
+
+struct ubond_policy_rule {
+    int proto;        /* -1: any */
+    uint16_t port;    /* source or destination, 0: any */
+    int dscp;         /* -1: any */
+    enum ubond_policy action;
+};
+
+static struct ubond_policy_rule policy_rules[UBOND_POLICY_RULES_MAX] = {
+    { IPPROTO_TCP, 0, -1, UBOND_POLICY_REORDER },
+};
+static int policy_count = 1;
+
+/* extension headers walked before giving up on finding the protocol */
+#define UBOND_IPV6_EXT_MAX 8
+
+static void
+ubond_classify_ports(const uint8_t *data, size_t len, size_t off,
+                     struct ubond_pkt_info *info)
+{
+    if (info->fragment || len < off + 4)
+        return;
+    switch (info->proto) {
+    case IPPROTO_TCP:
+    case IPPROTO_UDP:
+    case IPPROTO_SCTP:
+    case IPPROTO_UDPLITE:
+        info->sport = (data[off] << 8) | data[off + 1];
+        info->dport = (data[off + 2] << 8) | data[off + 3];
+        break;
+    }
+}
+
+int
+ubond_classify_parse(const uint8_t *data, size_t len,
+                     struct ubond_pkt_info *info)
+{
+    size_t off, hlen;
+    uint8_t next;
+    int i;
+
+    memset(info, 0, sizeof(*info));
+    if (len < 1)
+        return -1;
+    if ((data[0] >> 4) == 4) {
+        off = (data[0] & 0x0f) * 4;
+        if (len < 20 || off < 20 || len < off)
+            return -1;
+        info->version = 4;
+        info->dscp = data[1] >> 2;
+        info->proto = data[9];
+        /* more fragments, or an offset */
+        info->fragment = ((data[6] & 0x3f) | data[7]) != 0;
+        info->src = data + 12;
+        info->dst = data + 16;
+        info->addrlen = 4;
+        ubond_classify_ports(data, len, off, info);
+        return 0;
+    }
+    if ((data[0] >> 4) != 6 || len < 40)
+        return -1;
+    info->version = 6;
+    info->dscp = (((data[0] & 0x0f) << 4) | (data[1] >> 4)) >> 2;
+    info->src = data + 8;
+    info->dst = data + 24;
+    info->addrlen = 16;
+    next = data[6];
+    off = 40;
+    for (i = 0; i < UBOND_IPV6_EXT_MAX; i++) {
+        switch (next) {
+        case IPPROTO_HOPOPTS:
+        case IPPROTO_ROUTING:
+        case IPPROTO_DSTOPTS:
+        case 135: /* mobility */
+        case 139: /* host identity */
+        case 140: /* shim6 */
+            if (len < off + 8)
+                return -1;
+            hlen = (data[off + 1] + 1) * 8;
+            break;
+        case IPPROTO_AH:
+            if (len < off + 8)
+                return -1;
+            hlen = (data[off + 1] + 2) * 4;
+            break;
+        case IPPROTO_FRAGMENT:
+            if (len < off + 8)
+                return -1;
+            info->fragment = 1;
+            hlen = 8;
+            break;
+        default:
+            info->proto = next;
+            ubond_classify_ports(data, len, off, info);
+            return 0;
+        }
+        next = data[off];
+        off += hlen;
+        if (len < off)
+            return -1;
+    }
+    /* too many extension headers, the protocol is unknown */
+    info->proto = IPPROTO_NONE;
+    return 0;
+}
+
+enum ubond_policy
+ubond_classify_policy(const struct ubond_pkt_info *info)
+{
+    const struct ubond_policy_rule *r;
+    int i;
+
+    if (!info->version)
+        return UBOND_POLICY_BEST_EFFORT;
+    for (i = 0; i < policy_count; i++) {
+        r = &policy_rules[i];
+        if (r->dscp >= 0 && r->dscp != info->dscp)
+            continue;
+        if (r->proto >= 0 && r->proto != info->proto)
+            continue;
+        if (r->port && (info->fragment ||
+                (r->port != info->sport && r->port != info->dport)))
+            continue;
+        return r->action;
+    }
+    return UBOND_POLICY_BEST_EFFORT;
+}
+
+uint32_t
+ubond_classify_hash(const struct ubond_pkt_info *info)
+{
+    uint32_t h = info->proto, w;
+    int i;
+
+    for (i = 0; i < info->addrlen; i += 4) {
+        memcpy(&w, info->src + i, 4);
+        h = (h ^ w) * 0x9e3779b1;
+        memcpy(&w, info->dst + i, 4);
+        h = (h ^ w) * 0x9e3779b1;
+    }
+    h = (h ^ ((uint32_t)info->sport << 16 | info->dport)) * 0x9e3779b1;
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    return h;
+}
+
+static int
+ubond_classify_parse_rule(char *rule, struct ubond_policy_rule *r)
+{
+    char *action, *port, *end;
+    unsigned long v;
+
+    if (!(action = strchr(rule, '=')))
+        return -1;
+    *action++ = '\0';
+    if (strcasecmp(action, "reorder") == 0)
+        r->action = UBOND_POLICY_REORDER;
+    else if (strcasecmp(action, "resend") == 0)
+        r->action = UBOND_POLICY_RESEND;
+    else if (strcasecmp(action, "best-effort") == 0)
+        r->action = UBOND_POLICY_BEST_EFFORT;
+    else
+        return -1;
+
+    r->proto = -1;
+    r->port = 0;
+    r->dscp = -1;
+    if ((port = strchr(rule, '/')))
+        *port++ = '\0';
+    if (strcasecmp(rule, "dscp") == 0) {
+        if (!port)
+            return -1;
+        v = strtoul(port, &end, 10);
+        if (*end || v > 63)
+            return -1;
+        r->dscp = v;
+        return 0;
+    }
+    if (strcasecmp(rule, "tcp") == 0)
+        r->proto = IPPROTO_TCP;
+    else if (strcasecmp(rule, "udp") == 0)
+        r->proto = IPPROTO_UDP;
+    else if (strcasecmp(rule, "icmp") == 0)
+        r->proto = IPPROTO_ICMP;
+    else if (strcasecmp(rule, "icmp6") == 0)
+        r->proto = IPPROTO_ICMPV6;
+    else if (strcasecmp(rule, "any") != 0) {
+        v = strtoul(rule, &end, 10);
+        if (!*rule || *end || v > 255)
+            return -1;
+        r->proto = v;
+    }
+    if (port) {
+        v = strtoul(port, &end, 10);
+        if (!*port || *end || v == 0 || v > 65535)
+            return -1;
+        r->port = v;
+    }
+    return 0;
+}
+
+int
+ubond_classify_set_policy(const char *rules)
+{
+    struct ubond_policy_rule table[UBOND_POLICY_RULES_MAX];
+    char *copy, *rule, *save = NULL;
+    char orig[64];
+    int n = 0;
+
+    if (!(copy = strdup(rules))) {
+        log_warn("config", "strdup failed");
+        return -1;
+    }
+    for (rule = strtok_r(copy, " ,", &save); rule;
+            rule = strtok_r(NULL, " ,", &save)) {
+        if (n == UBOND_POLICY_RULES_MAX) {
+            log_warnx("config", "reorder_policy: more than %d rules",
+                UBOND_POLICY_RULES_MAX);
+            free(copy);
+            return -1;
+        }
+        strlcpy(orig, rule, sizeof(orig));
+        if (ubond_classify_parse_rule(rule, &table[n]) < 0) {
+            log_warnx("config", "reorder_policy: invalid rule %s", orig);
+            free(copy);
+            return -1;
+        }
+        n++;
+    }
+    free(copy);
+    memcpy(policy_rules, table, n * sizeof(table[0]));
+    policy_count = n;
+    return 0;
+}
@@ -0,0 +1,48 @@
+#ifndef UBOND_CLASSIFY_H
+#define UBOND_CLASSIFY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* What is done for a data packet, from the policy table */
+enum ubond_policy {
+    UBOND_POLICY_BEST_EFFORT, /* sent once, delivered as it comes */
+    UBOND_POLICY_RESEND,      /* resent when lost, delivered as it comes */
+    UBOND_POLICY_REORDER      /* resent when lost, delivered in order */
+};
+
+/* Inner headers of a packet read from the tun device */
+struct ubond_pkt_info {
+    uint8_t version;      /* 4 or 6, 0 if not IP */
+    uint8_t proto;        /* upper layer protocol, after IPv6 extensions */
+    uint8_t dscp;
+    uint8_t fragment;     /* part of a fragmented datagram: no ports */
+    uint16_t sport;       /* host order, 0 if unknown */
+    uint16_t dport;
+    const uint8_t *src;   /* addresses, addrlen bytes each */
+    const uint8_t *dst;
+    uint8_t addrlen;
+};
+
+#define UBOND_POLICY_RULES_MAX 32
+#define UBOND_POLICY_DEFAULT "tcp=reorder"
+
+/* Fill info from the IP packet in data. Returns -1 if it is not one. */
+int
+ubond_classify_parse(const uint8_t *data, size_t len,
+                     struct ubond_pkt_info *info);
+
+/* First rule of the policy table matching info */
+enum ubond_policy
+ubond_classify_policy(const struct ubond_pkt_info *info);
+
+/* Hash of the addresses and ports, the same for every packet of a flow */
+uint32_t
+ubond_classify_hash(const struct ubond_pkt_info *info);
+
+/* Replace the policy table, see reorder_policy in ubond.conf(5).
+ * The table is left untouched if rules can't be parsed. */
+int
+ubond_classify_set_policy(const char *rules);
+
+#endif
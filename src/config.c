@@ -30,6 +30,8 @@
 #include "tool.h"
 #include "crypto.h"
 #include "tuntap_generic.h"
+#include "classify.h"
+#include "linksched.h"
 
 extern char *status_command;
 extern struct ubond_options_s ubond_options;
@@ -57,6 +59,16 @@ ubond_config(int config_file_fd, int first_time)
     char *tundevname = NULL;
     char *password = NULL;
     uint32_t tun_mtu = 0;
+    uint32_t tun_queues = 1;
+    uint32_t tun_read_batch = 1;
+    uint32_t packet_pool = UBOND_PKT_POOL_SIZE;
+    uint32_t packet_pool_max = UBOND_PKT_POOL_MAX;
+    uint32_t packet_pool_hugepages = 0;
+    uint32_t packet_pool_mlock = 0;
+    uint32_t reorder_flows = 1;
+#ifdef HAVE_LINUX
+    uint32_t tun_offload = 0;
+#endif
 
     uint32_t default_timeout = 60;
     uint32_t default_server_mode = 0; /* 0 => client */
@@ -106,6 +118,71 @@ ubond_config(int config_file_fd, int first_time)
                             tuntap.type = UBOND_TUNTAPMODE_TAP;
                         free(tmp);
                     }
+                    _conf_set_uint_from_conf(
+                        config, lastSection, "tun_queues", &tun_queues, 1,
+                        NULL, 0);
+                    if (tun_queues < 1) {
+                        tun_queues = 1;
+                    } else if (tun_queues > UBOND_TUN_QUEUES_MAX) {
+                        log_warnx("config", "tun_queues capped to %d",
+                            UBOND_TUN_QUEUES_MAX);
+                        tun_queues = UBOND_TUN_QUEUES_MAX;
+                    }
+                    tuntap.queues = tun_queues;
+                    _conf_set_str_from_conf(
+                        config, lastSection, "io_backend", &tmp, "libev",
+                        NULL, 0);
+                    if (tmp) {
+                        if (mystr_eq(tmp, "io_uring"))
+                            ubond_options.io_backend = UBOND_IO_BACKEND_URING;
+                        else if (mystr_eq(tmp, "libev"))
+                            ubond_options.io_backend = UBOND_IO_BACKEND_LIBEV;
+                        else
+                            log_warnx("config", "unknown io_backend %s", tmp);
+                        free(tmp);
+                    }
+#ifdef HAVE_LINUX
+                    _conf_set_uint_from_conf(
+                        config, lastSection, "tun_offload", &tun_offload, 0,
+                        NULL, 0);
+                    if (tun_offload && tuntap.type != UBOND_TUNTAPMODE_TUN) {
+                        log_warnx("config", "tun_offload requires tuntap = tun");
+                        tun_offload = 0;
+                    }
+                    tuntap.offload = (tun_offload != 0);
+#endif
+                    _conf_set_uint_from_conf(
+                        config, lastSection, "packet_pool", &packet_pool,
+                        UBOND_PKT_POOL_SIZE, NULL, 0);
+                    _conf_set_uint_from_conf(
+                        config, lastSection, "packet_pool_max", &packet_pool_max,
+                        UBOND_PKT_POOL_MAX, NULL, 0);
+                    if (packet_pool > packet_pool_max) {
+                        log_warnx("config", "packet_pool capped to packet_pool_max");
+                        packet_pool = packet_pool_max;
+                    }
+                    ubond_options.pkt_pool_size = packet_pool;
+                    ubond_options.pkt_pool_max = packet_pool_max;
+                    _conf_set_uint_from_conf(
+                        config, lastSection, "packet_pool_hugepages",
+                        &packet_pool_hugepages, 0, NULL, 0);
+                    _conf_set_uint_from_conf(
+                        config, lastSection, "packet_pool_mlock",
+                        &packet_pool_mlock, 0, NULL, 0);
+                    ubond_options.pkt_pool_flags =
+                        (packet_pool_hugepages ? UBOND_PKT_POOL_HUGEPAGES : 0) |
+                        (packet_pool_mlock ? UBOND_PKT_POOL_MLOCK : 0);
+                    _conf_set_uint_from_conf(
+                        config, lastSection, "reorder_flows", &reorder_flows, 1,
+                        NULL, 0);
+                    if (reorder_flows < 1) {
+                        reorder_flows = 1;
+                    } else if (reorder_flows > UBOND_REORDER_FLOWS_MAX) {
+                        log_warnx("config", "reorder_flows capped to %d",
+                            UBOND_REORDER_FLOWS_MAX);
+                        reorder_flows = UBOND_REORDER_FLOWS_MAX;
+                    }
+                    ubond_options.reorder_flows = reorder_flows;
                     /* Control configuration */
                     _conf_set_str_from_conf(
                         config, lastSection, "control_unix_path", &tmp, NULL,
@@ -152,6 +229,18 @@ ubond_config(int config_file_fd, int first_time)
                     memset(password, 0, strlen(password));
                     free(password);
                 }
+                _conf_set_uint_from_conf(
+                    config, lastSection, "tun_read_batch", &tun_read_batch, 1,
+                    NULL, 0);
+                if (tun_read_batch < 1) {
+                    tun_read_batch = 1;
+                } else if (tun_read_batch > UBOND_TUN_READ_BATCH_MAX) {
+                    log_warnx("config", "tun_read_batch capped to %d",
+                        UBOND_TUN_READ_BATCH_MAX);
+                    tun_read_batch = UBOND_TUN_READ_BATCH_MAX;
+                }
+                tuntap.read_batch = tun_read_batch;
+
                 _conf_set_uint_from_conf(
                     config, lastSection, "cleartext_data", &cleartext_data, 0,
                     NULL, 0);
@@ -181,6 +270,27 @@ ubond_config(int config_file_fd, int first_time)
                   }
                 }
 
+                _conf_set_str_from_conf(
+                    config, lastSection, "reorder_policy", &tmp,
+                    UBOND_POLICY_DEFAULT, NULL, 0);
+                if (tmp) {
+                    if (ubond_classify_set_policy(tmp) < 0)
+                        log_warnx("config", "reorder_policy left unchanged");
+                    free(tmp);
+                }
+
+                _conf_set_str_from_conf(
+                    config, lastSection, "scheduler", &tmp, "weighted",
+                    NULL, 0);
+                if (tmp) {
+                    int sched = ubond_sched_lookup(tmp);
+                    if (sched >= 0)
+                        ubond_sched_set(sched);
+                    else
+                        log_warnx("config", "unknown scheduler %s", tmp);
+                    free(tmp);
+                }
+
                 /* Tunnel configuration */
                 _conf_set_str_from_conf(
                     config, lastSection, "ip4", &tmp, NULL, NULL, 0);
@@ -261,6 +371,14 @@ ubond_config(int config_file_fd, int first_time)
                 uint32_t bwlimit = 0;
                 uint32_t quota = 0;
                 uint32_t reorder_length = 1;
+                uint32_t recv_batch = 1;
+                uint32_t send_batch = 1;
+                uint32_t gso = 0;
+                uint32_t kernel_pacing = 0;
+                uint32_t gro = 0;
+                uint32_t link_mtu = DEFAULT_MTU;
+                char *xdp_interface;
+                uint32_t xdp_queue = 0;
                 uint32_t timeout = 30;
                 int create_tunnel = 1;
 
@@ -313,6 +431,53 @@ ubond_config(int config_file_fd, int first_time)
                 _conf_set_uint_from_conf(
                     config, lastSection, "reorder_length", &reorder_length, 1,
                     NULL, 0);
+                _conf_set_uint_from_conf(
+                    config, lastSection, "recv_batch", &recv_batch, 1,
+                    NULL, 0);
+                if (recv_batch < 1) {
+                    recv_batch = 1;
+                } else if (recv_batch > UBOND_BATCH_MAX) {
+                    log_warnx("config", "recv_batch capped to %d",
+                        UBOND_BATCH_MAX);
+                    recv_batch = UBOND_BATCH_MAX;
+                }
+                _conf_set_uint_from_conf(
+                    config, lastSection, "send_batch", &send_batch, 1,
+                    NULL, 0);
+                if (send_batch < 1) {
+                    send_batch = 1;
+                } else if (send_batch > UBOND_BATCH_MAX) {
+                    log_warnx("config", "send_batch capped to %d",
+                        UBOND_BATCH_MAX);
+                    send_batch = UBOND_BATCH_MAX;
+                }
+                _conf_set_uint_from_conf(
+                    config, lastSection, "gso", &gso, 0,
+                    NULL, 0);
+                _conf_set_uint_from_conf(
+                    config, lastSection, "kernel_pacing", &kernel_pacing, 0,
+                    NULL, 0);
+                _conf_set_uint_from_conf(
+                    config, lastSection, "gro", &gro, 0,
+                    NULL, 0);
+                _conf_set_uint_from_conf(
+                    config, lastSection, "link_mtu", &link_mtu, DEFAULT_MTU,
+                    NULL, 0);
+                if (link_mtu < UBOND_LINK_MTU_MIN) {
+                    log_warnx("config", "link_mtu raised to %d",
+                        UBOND_LINK_MTU_MIN);
+                    link_mtu = UBOND_LINK_MTU_MIN;
+                } else if (link_mtu > UBOND_LINK_MTU_MAX) {
+                    log_warnx("config", "link_mtu capped to %zu",
+                        UBOND_LINK_MTU_MAX);
+                    link_mtu = UBOND_LINK_MTU_MAX;
+                }
+                _conf_set_str_from_conf(
+                    config, lastSection, "xdp_interface", &xdp_interface, NULL,
+                    NULL, 0);
+                _conf_set_uint_from_conf(
+                    config, lastSection, "xdp_queue", &xdp_queue, 0,
+                    NULL, 0);
                 _conf_set_uint_from_conf(
                     config, lastSection, "timeout", &timeout, default_timeout,
                     NULL, 0);
@@ -388,6 +553,61 @@ ubond_config(int config_file_fd, int first_time)
                                 tmptun->name, tmptun->reorder_length_preset, reorder_length);
                             tmptun->reorder_length_preset = reorder_length;
                         }
+                        if (tmptun->recv_batch != recv_batch)
+                        {
+                          log_info("config", "%s recv batch changed from %u to %u",
+                                tmptun->name, tmptun->recv_batch, recv_batch);
+                            tmptun->recv_batch = recv_batch;
+                        }
+                        if (tmptun->send_batch != send_batch)
+                        {
+                          log_info("config", "%s send batch changed from %u to %u",
+                                tmptun->name, tmptun->send_batch, send_batch);
+                            tmptun->send_batch = send_batch;
+                        }
+                        if (tmptun->gso != (gso != 0))
+                        {
+                          log_info("config", "%s gso changed from %d to %d",
+                                tmptun->name, tmptun->gso, gso != 0);
+                            tmptun->gso = (gso != 0);
+                            if (tmptun->gso)
+                                ubond_rtun_set_gso(tmptun);
+                        }
+                        if (tmptun->kernel_pacing != (kernel_pacing != 0))
+                        {
+                          log_info("config", "%s kernel pacing changed from %d to %d",
+                                tmptun->name, tmptun->kernel_pacing, kernel_pacing != 0);
+                            tmptun->kernel_pacing = (kernel_pacing != 0);
+                            ubond_rtun_set_pacing(tmptun);
+                        }
+                        if (tmptun->gro != (gro != 0))
+                        {
+                          log_info("config", "%s gro changed from %d to %d",
+                                tmptun->name, tmptun->gro, gro != 0);
+                            /* the socket option is applied on (re)connect */
+                            tmptun->gro = (gro != 0);
+                            ubond_rtun_status_down(tmptun);
+                        }
+                        if (tmptun->link_mtu != link_mtu)
+                        {
+                          /* sizes the tun device, only read at startup */
+                          log_warnx("config", "%s link_mtu change to %u "
+                                "needs a restart", tmptun->name, link_mtu);
+                        }
+                        if (strcmp(tmptun->xdp_interface,
+                                    xdp_interface ? xdp_interface : "") != 0 ||
+                                tmptun->xdp_queue != xdp_queue)
+                        {
+                          log_info("config", "%s xdp changed from %s:%u to %s:%u",
+                                tmptun->name, tmptun->xdp_interface,
+                                tmptun->xdp_queue,
+                                xdp_interface ? xdp_interface : "", xdp_queue);
+                            strlcpy(tmptun->xdp_interface,
+                                xdp_interface ? xdp_interface : "",
+                                sizeof(tmptun->xdp_interface));
+                            tmptun->xdp_queue = xdp_queue;
+                            ubond_rtun_xdp_setup(tmptun);
+                        }
                         create_tunnel = 0;
                         break; /* Very important ! */
                     }
@@ -396,10 +616,22 @@ ubond_config(int config_file_fd, int first_time)
                 if (create_tunnel)
                 {
                     log_info("config", "%s tunnel added", lastSection);
-                    ubond_rtun_new(
+                    tmptun = ubond_rtun_new(
                         lastSection, bindaddr, bindport, binddev, bindfib, dstaddr, dstport,
                         default_server_mode, timeout, fallback_only,
                         bwlimit, quota, reorder_length);
+                    if (tmptun) {
+                        tmptun->recv_batch = recv_batch;
+                        tmptun->send_batch = send_batch;
+                        tmptun->gso = (gso != 0);
+                        tmptun->kernel_pacing = (kernel_pacing != 0);
+                        tmptun->gro = (gro != 0);
+                        tmptun->link_mtu = link_mtu;
+                        if (xdp_interface)
+                            strlcpy(tmptun->xdp_interface, xdp_interface,
+                                sizeof(tmptun->xdp_interface));
+                        tmptun->xdp_queue = xdp_queue;
+                    }
                 }
                 if (bindaddr)
                     free(bindaddr);
@@ -407,6 +639,8 @@ ubond_config(int config_file_fd, int first_time)
                     free(bindport);
                 if (binddev)
                     free(binddev);
+                if (xdp_interface)
+                    free(xdp_interface);
                 if (dstaddr)
                     free(dstaddr);
                 if (dstport)
@@ -26,16 +26,22 @@
 #include "ubond.h"
 #include "control.h"
 #include "tuntap_generic.h"
+#include "linksched.h"
+#ifdef HAVE_AF_XDP
+#include "xdp.h"
+#endif
 
 extern struct tuntap_s tuntap;
 extern char *_progname;
 extern struct ubond_status_s ubond_status;
 extern double bandwidth;
 void ubond_control_write_status(struct ubond_control *ctrl);
+static void ubond_control_scheduler(struct ubond_control *ctrl,
+    const char *name);
 extern int ubond_reorder_length();
 extern double ubond_total_loss();
-extern uint64_t pool_out;
 extern struct rtunhead rtuns;
+extern struct ubond_options_s ubond_options;
 
 #define HTTP_HEADERS "HTTP/1.1 200 OK\r\n" \
     "Connection: close\r\n" \
@@ -51,14 +57,40 @@ extern struct rtunhead rtuns;
     "\"uptime\": %u,\n" \
     "\"last_reload\": %u,\n" \
     "\"pid\": %d,\n" \
+    "\"io_backend\": \"%s\",\n" \
+    "\"io_ops_per_syscall\": %.2f,\n" \
     "\"tuntap\": {\n" \
     "   \"type\": \"%s\",\n" \
-    "   \"name\": \"%s\"\n" \
+    "   \"name\": \"%s\",\n" \
+    "   \"queues\": %d,\n" \
+    "   \"workers\": %d,\n" \
+    "   \"offload\": %d,\n" \
+    "   \"tso_avg\": %.2f,\n" \
+    "   \"gro_avg\": %.2f,\n" \
+    "   \"read_batch\": %d,\n" \
+    "   \"reads_per_wakeup\": %.2f\n" \
     "},\n" \
     "\"bandwidth_out\": %f,\n" \
     "\"reorder_length\": %d,\n"   \
     "\"total_loss\": %f,\n"     \
+    "\"reorder_hold\": %.3f,\n" \
+    "\"reorder_hold_histogram\": [%s],\n" \
+    "\"scheduler\": \"%s\",\n" \
+    "\"scheduler_decisions\": {\n%s\n},\n" \
     "\"memory_packets\": %lu,\n"       \
+    "\"queue_overflows\": %"PRIu64",\n" \
+    "\"packet_pool\": {\n" \
+    "   \"capacity\": %"PRIu64",\n" \
+    "   \"max\": %"PRIu64",\n" \
+    "   \"high_water\": %"PRIu64",\n" \
+    "   \"in_use_small\": %"PRIu64",\n" \
+    "   \"in_use_mtu\": %"PRIu64",\n" \
+    "   \"in_use_jumbo\": %"PRIu64",\n" \
+    "   \"alloc_failures\": %"PRIu64",\n" \
+    "   \"reclaims\": %"PRIu64",\n" \
+    "   \"hugepage_slabs\": %"PRIu64",\n" \
+    "   \"locked_slabs\": %"PRIu64"\n" \
+    "},\n" \
     "\"tunnels\": [\n"
 
 #define JSON_STATUS_RTUN "{\n" \
@@ -75,6 +107,7 @@ extern struct rtunhead rtuns;
     "   \"recvbytes\": %" PRIu64 ",\n" \
     "   \"bandwidth\": %lu,\n" \
     "   \"srtt\": %.3f,\n" \
+    "   \"delay_skew\": %.3f,\n" \
     "   \"lossin\": %.3f,\n" \
     "   \"lossout\": %.3f,\n" \
     "   \"reorder_length\": %u,\n"     \
@@ -82,9 +115,22 @@ extern struct rtunhead rtuns;
     "   \"disconnects\": %u,\n" \
     "   \"last_packet\": %u,\n" \
     "   \"timeout\": %u,\n" \
+    "   \"rx_batch_avg\": %.2f,\n" \
+    "   \"tx_batch_avg\": %.2f,\n" \
+    "   \"gso_avg\": %.2f,\n" \
+    "   \"gro_avg\": %.2f,\n" \
+    "   \"pacing_rate\": %u,\n" \
+    "   \"xdp_rx\": %" PRIu64 ",\n" \
+    "   \"xdp_tx\": %" PRIu64 ",\n" \
+    "   \"queue_overflows\": %" PRIu64 ",\n" \
     "   \"weight\": %.3f\n" \
     "}%s\n"
 #define JSON_STATUS_ERROR_UNKNOWN_COMMAND "{\"error\": 'unknown command'}\n"
+#define JSON_SCHEDULER "{\"scheduler\": \"%s\"}\n"
+#define JSON_SCHED_DECISIONS \
+    "   \"%s\": {\"taken\": %"PRIu64", \"passed\": %"PRIu64", " \
+    "\"copies\": %"PRIu64"}%s"
+#define JSON_STATUS_ERROR_UNKNOWN_SCHEDULER "{\"error\": 'unknown scheduler'}\n"
 
 static void
 ubond_control_client_io_event(struct ev_loop *loop, ev_io *w, int revents)
@@ -354,6 +400,7 @@ ubond_control_timeout(struct ubond_control *ctrl)
  * START tunX
  * STOP tunX
  * RESTART tunX
+ * SCHEDULER [name]
  */
 void
 ubond_control_parse(struct ubond_control *ctrl, char *line)
@@ -381,6 +428,10 @@ ubond_control_parse(struct ubond_control *ctrl, char *line)
     if (strcasecmp(cmd, "status") == 0 || strcasecmp(cmd, "/status") == 0)
     {
         ubond_control_write_status(ctrl);
+    } else if (strcasecmp(cmd, "scheduler") == 0 ||
+               strncasecmp(cmd, "/scheduler", 10) == 0) {
+        ubond_control_scheduler(ctrl, ctrl->http ?
+            (cmd[10] == '/' ? cmd + 11 : NULL) : strtok(NULL, " "));
     } else if (strcasecmp(cmd, "quit") == 0) {
         ubond_control_write(ctrl, "bye.", 4);
         ubond_control_close_client(ctrl);
@@ -393,33 +444,94 @@ ubond_control_parse(struct ubond_control *ctrl, char *line)
         ctrl->close_after_write = 1;
 }
 
-extern ubond_pkt_list_t send_buffer;    /* send buffer */
+extern ubond_pkt_ring_t send_buffer;    /* send buffer */
+extern ubond_pkt_ring_t hpsend_buffer;
 
 void ubond_control_write_status(struct ubond_control *ctrl)
 {
-    char buf[1024];
+    char buf[4096];
     size_t ret;
     ubond_tunnel_t *t;
-
-    ret = snprintf(buf, 1024, JSON_STATUS_BASE,
+    const char *io_backend;
+    double io_ops;
+    uint64_t hold_histogram[UBOND_REORDER_HOLD_BUCKETS];
+    char hold_buckets[UBOND_REORDER_HOLD_BUCKETS * 21];
+    char decisions[UBOND_SCHED_COUNT * 128];
+    double hold;
+    uint64_t tso_reads = 0, tso_segments = 0;
+    uint64_t read_wakeups = 0, read_packets = 0;
+    int i;
+    size_t len = 0;
+
+    io_backend = ubond_io_backend(&io_ops);
+    for (i = 0; i < tuntap.queues; i++) {
+        tso_reads += tuntap.q[i].tso_reads;
+        tso_segments += tuntap.q[i].tso_segments;
+        read_wakeups += tuntap.q[i].read_wakeups;
+        read_packets += tuntap.q[i].read_packets;
+    }
+    hold = ubond_reorder_hold(hold_histogram);
+    for (i = 0; i < UBOND_REORDER_HOLD_BUCKETS; i++)
+        len += snprintf(hold_buckets + len, sizeof(hold_buckets) - len,
+            "%s%"PRIu64, i ? ", " : "", hold_histogram[i]);
+    for (i = 0, len = 0; i < UBOND_SCHED_COUNT; i++)
+        len += snprintf(decisions + len, sizeof(decisions) - len,
+            JSON_SCHED_DECISIONS, ubond_sched_name(i),
+            ubond_sched_stats[i].taken, ubond_sched_stats[i].passed,
+            ubond_sched_stats[i].copies,
+            i + 1 < UBOND_SCHED_COUNT ? ",\n" : "");
+    ret = snprintf(buf, sizeof(buf), JSON_STATUS_BASE,
         _progname,
         1, 1, /* TODO */
         (uint32_t) ubond_status.start_time,
         (uint32_t) ubond_status.last_reload,
         0,
+        io_backend,
+        io_ops,
         tuntap.type == UBOND_TUNTAPMODE_TUN ? "tun" : "tap",
         tuntap.devname,
+        tuntap.queues,
+        tuntap.workers,
+        tuntap.offload,
+        tso_reads ? (double)tso_segments / (double)tso_reads : 0.0,
+        tuntap.gro_writes ?
+          (double)tuntap.gro_segments / (double)tuntap.gro_writes : 0.0,
+        tuntap.read_batch,
+        read_wakeups ? (double)read_packets / (double)read_wakeups : 0.0,
         bandwidth,
 //                   (double) UBOND_TAILQ_LENGTH(&send_buffer),
         ubond_reorder_length(),
         ubond_total_loss(),
-        pool_out
+        hold * 1000.0,
+        hold_buckets,
+        ubond_sched_name(ubond_options.scheduler),
+        decisions,
+        pool_out,
+        send_buffer.overflows + hpsend_buffer.overflows + tuntap.sbuf.overflows,
+        pkt_pool_stats.capacity,
+        pkt_pool_stats.max,
+        pkt_pool_stats.high_water,
+        pkt_pool_stats.in_use[UBOND_PKT_CLASS_SMALL],
+        pkt_pool_stats.in_use[UBOND_PKT_CLASS_MTU],
+        pkt_pool_stats.in_use[UBOND_PKT_CLASS_JUMBO],
+        pkt_pool_stats.failures,
+        pkt_pool_stats.reclaims,
+        pkt_pool_stats.hugepage_slabs,
+        pkt_pool_stats.locked_slabs
     );
     ubond_control_write(ctrl, buf, ret);
     LIST_FOREACH(t, &rtuns, entries)
     {
         char *mode = t->server_mode ? "server" : "client";
         char *status;
+        uint64_t xdp_rx = 0, xdp_tx = 0;
+
+#ifdef HAVE_AF_XDP
+        if (t->xsk) {
+            xdp_rx = t->xsk->rx_frames;
+            xdp_tx = t->xsk->tx_frames;
+        }
+#endif
 
         if (t->status == UBOND_DISCONNECTED)
             status = "disconnected";
@@ -432,7 +544,7 @@ void ubond_control_write_status(struct ubond_control *ctrl)
         else
             status = "unknown";
 
-        ret = snprintf(buf, 1024, JSON_STATUS_RTUN,
+        ret = snprintf(buf, sizeof(buf), JSON_STATUS_RTUN,
                        t->name,
                        mode,
                        t->bindaddr ? t->bindaddr : "any",
@@ -446,6 +558,7 @@ void ubond_control_write_status(struct ubond_control *ctrl)
                        t->recvbytes,
                        t->bandwidth_max,
                        t->srtt_av,
+                       t->owd_skew,
 //                       (float)t->loss_av,
                        ((t->loss_cnt*100.0/(64.0-(float)t->reorder_length)) + t->loss_av)/2.0,
                        t->sent_loss,
@@ -454,6 +567,18 @@ void ubond_control_write_status(struct ubond_control *ctrl)
                        t->disconnects,
                        (uint32_t)t->last_activity,
                        (uint32_t)t->timeout,
+                       t->rx_batches ?
+                         (double)t->rx_batch_pkts / (double)t->rx_batches : 0.0,
+                       t->tx_batches ?
+                         (double)t->tx_batch_pkts / (double)t->tx_batches : 0.0,
+                       t->gso_sends ?
+                         (double)t->gso_segments / (double)t->gso_sends : 0.0,
+                       t->gro_recvs ?
+                         (double)t->gro_segments / (double)t->gro_recvs : 0.0,
+                       t->kernel_pacing ? t->pacing_rate : 0,
+                       xdp_rx,
+                       xdp_tx,
+                       t->sbuf.overflows + t->hpsbuf.overflows,
                        t->bytes_per_sec/128.0,//git it in kbps
                        //t->weight,
                        (LIST_NEXT(t, entries) ? "," : "")
@@ -464,6 +589,27 @@ void ubond_control_write_status(struct ubond_control *ctrl)
     ubond_control_write(ctrl, "]}\n", 3);
 }
 
+/* Switch to the scheduler called name, then tell which one is in use */
+static void
+ubond_control_scheduler(struct ubond_control *ctrl, const char *name)
+{
+    char buf[64];
+    size_t ret;
+    int sched;
+
+    if (name && *name) {
+        if ((sched = ubond_sched_lookup(name)) < 0) {
+            ubond_control_write(ctrl, JSON_STATUS_ERROR_UNKNOWN_SCHEDULER,
+                strlen(JSON_STATUS_ERROR_UNKNOWN_SCHEDULER));
+            return;
+        }
+        ubond_sched_set(sched);
+    }
+    ret = snprintf(buf, sizeof(buf), JSON_SCHEDULER,
+        ubond_sched_name(ubond_options.scheduler));
+    ubond_control_write(ctrl, buf, ret);
+}
+
 /* Returns 1 if a valid line is found. 0 otherwise. */
 int
 ubond_control_read_check(struct ubond_control *ctrl)
@@ -6,6 +6,13 @@
 #define crypto_NONCEBYTES crypto_secretbox_NONCEBYTES
 #define ENABLE_CRYPTO
 
+/* A payload left in clear, to be encrypted in place before it is sent */
+struct crypto_seal
+{
+    unsigned long long len;     /* bytes to encrypt, 0: sent in clear */
+    unsigned char nonce[crypto_NONCEBYTES];
+};
+
 int crypto_init();
 int crypto_set_password(const char *password,
                         unsigned long long password_len);
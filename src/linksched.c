@@ -0,0 +1,227 @@
+#include "includes.h"
+
+#include <string.h>
+#include <strings.h>
+
+#include "linksched.h"
+
+/*
+ * Link selection. Every link paces itself at the rate
+ * ubond_rtun_recalc_weight() gives it and, when it may send, asks for the
+ * next packet of the send buffer. The scheduler decides whether it gets
+ * it or leaves it for another link.
+ */
+
+extern struct rtunhead rtuns;
+extern struct ubond_options_s ubond_options;
+extern struct ubond_status_s ubond_status;
+
+/* Bytes the fastest link is given a deficit round robin round, the others
+ * get a share of it in proportion to their rate */
+#define UBOND_SCHED_DRR_QUANTUM DEFAULT_MTU
+/* Copies a link keeps queued for the redundant scheduler, those behind
+ * them would arrive long after the original */
+#define UBOND_SCHED_COPIES_MAX 64
+
+struct ubond_sched_ops {
+    const char *name;
+    int (*take)(ubond_tunnel_t *rtun, size_t len, ev_tstamp now);
+};
+
+struct ubond_sched_stats ubond_sched_stats[UBOND_SCHED_COUNT];
+
+static int
+ubond_sched_usable(ubond_tunnel_t *t)
+{
+    return t->status == UBOND_AUTHOK && t->bytes_per_sec > 0 &&
+        t->fallback_only == ubond_status.fallback_mode &&
+        !(t->quota && t->permitted < DEFAULT_MTU*2);
+}
+
+/* t has budget left in its token bucket */
+static int
+ubond_sched_ready(ubond_tunnel_t *t, ev_tstamp now)
+{
+    return t->bytes_since_adjust < t->bytes_per_sec * (now - t->last_adjust);
+}
+
+static int
+ubond_sched_weighted(ubond_tunnel_t *rtun, size_t len, ev_tstamp now)
+{
+    return 1;
+}
+
+/* Deficit round robin: rtun sends once its deficit covers the packet. When
+ * no link with budget left has enough, rounds are added until one has. */
+static int
+ubond_sched_drr(ubond_tunnel_t *rtun, size_t len, ev_tstamp now)
+{
+    ubond_tunnel_t *t;
+    double fastest = 0, rounds = -1, q, r;
+
+    if (rtun->sched_deficit >= len)
+        goto take;
+    LIST_FOREACH(t, &rtuns, entries) {
+        if (!ubond_sched_usable(t))
+            continue;
+        if (t != rtun && t->sched_deficit >= len && ubond_sched_ready(t, now))
+            return 0;
+        if (t->bytes_per_sec > fastest)
+            fastest = t->bytes_per_sec;
+    }
+    LIST_FOREACH(t, &rtuns, entries) {
+        if (!ubond_sched_usable(t) || (t != rtun && !ubond_sched_ready(t, now)))
+            continue;
+        q = UBOND_SCHED_DRR_QUANTUM * t->bytes_per_sec / fastest;
+        r = ceil((len - t->sched_deficit) / q);
+        if (rounds < 0 || r < rounds)
+            rounds = r;
+    }
+    LIST_FOREACH(t, &rtuns, entries) {
+        if (!ubond_sched_usable(t))
+            continue;
+        q = UBOND_SCHED_DRR_QUANTUM * t->bytes_per_sec / fastest;
+        t->sched_deficit += rounds * q;
+        /* a link waiting for its budget doesn't bank rounds */
+        if (t->sched_deficit > q + len)
+            t->sched_deficit = q + len;
+    }
+    if (rtun->sched_deficit < len)
+        return 0;
+take:
+    rtun->sched_deficit -= len;
+    return 1;
+}
+
+/* Lowest smoothed round trip first, the slower links only get what the
+ * faster ones have no budget for */
+static int
+ubond_sched_min_rtt(ubond_tunnel_t *rtun, size_t len, ev_tstamp now)
+{
+    ubond_tunnel_t *t;
+
+    LIST_FOREACH(t, &rtuns, entries) {
+        if (t != rtun && ubond_sched_usable(t) &&
+            t->srtt_av < rtun->srtt_av && ubond_sched_ready(t, now))
+            return 0;
+    }
+    return 1;
+}
+
+/* Seconds until len more bytes handed to t now reach the far end: what t
+ * already owes its token bucket and holds in sbuf, then the packet itself,
+ * then half the round trip. */
+static double
+ubond_sched_arrival(ubond_tunnel_t *t, size_t len, ev_tstamp now)
+{
+    double owed = (double)t->bytes_since_adjust
+        - t->bytes_per_sec * (now - t->last_adjust);
+    if (owed < 0)
+        owed = 0;
+    owed += (double)ubond_pkt_ring_length(&t->sbuf) * len;
+    return (owed + len) / t->bytes_per_sec + t->srtt_av / 2000.0;
+}
+
+/* Earliest arrival first: rtun only takes the next packet if no other link
+ * would deliver it sooner, so that the far end gets the data in order
+ * rather than holding it for the slower link. A link passing its turn
+ * looks again shortly, see ubond_rtun_pace(). */
+static int
+ubond_sched_earliest(ubond_tunnel_t *rtun, size_t len, ev_tstamp now)
+{
+    ubond_tunnel_t *t;
+    double mine = ubond_sched_arrival(rtun, len, now);
+
+    LIST_FOREACH(t, &rtuns, entries) {
+        if (t != rtun && ubond_sched_usable(t) &&
+            ubond_sched_arrival(t, len, now) < mine)
+            return 0;
+    }
+    return 1;
+}
+
+/* Every link sends everything: a link only takes a new packet once the
+ * copies queued by ubond_sched_numbered() are out */
+static int
+ubond_sched_redundant(ubond_tunnel_t *rtun, size_t len, ev_tstamp now)
+{
+    return ubond_pkt_ring_empty(&rtun->sbuf);
+}
+
+static const struct ubond_sched_ops scheds[UBOND_SCHED_COUNT] = {
+    [UBOND_SCHED_WEIGHTED] = { "weighted", ubond_sched_weighted },
+    [UBOND_SCHED_DRR] = { "drr", ubond_sched_drr },
+    [UBOND_SCHED_MIN_RTT] = { "min_rtt", ubond_sched_min_rtt },
+    [UBOND_SCHED_EARLIEST] = { "earliest", ubond_sched_earliest },
+    [UBOND_SCHED_REDUNDANT] = { "redundant", ubond_sched_redundant },
+};
+
+int
+ubond_sched_lookup(const char *name)
+{
+    int i;
+    for (i = 0; i < UBOND_SCHED_COUNT; i++)
+        if (strcasecmp(name, scheds[i].name) == 0)
+            return i;
+    return -1;
+}
+
+const char *
+ubond_sched_name(enum ubond_scheduler sched)
+{
+    return scheds[sched].name;
+}
+
+void
+ubond_sched_set(enum ubond_scheduler sched)
+{
+    ubond_tunnel_t *t;
+
+    if (sched == ubond_options.scheduler)
+        return;
+    log_info("sched", "%s scheduler", scheds[sched].name);
+    LIST_FOREACH(t, &rtuns, entries)
+        t->sched_deficit = 0;
+    ubond_options.scheduler = sched;
+}
+
+int
+ubond_sched_take(ubond_tunnel_t *rtun, size_t len)
+{
+    enum ubond_scheduler s = ubond_options.scheduler;
+
+    if (rtun->bytes_per_sec <= 0 ||
+        scheds[s].take(rtun, len, ev_now(EV_DEFAULT_UC))) {
+        ubond_sched_stats[s].taken++;
+        return 1;
+    }
+    ubond_sched_stats[s].passed++;
+    return 0;
+}
+
+/* The redundant scheduler queues a copy on every other link. The far end's
+ * reorder buffer drops whichever of a packet and its copies comes second,
+ * so only packets it reorders are copied. */
+void
+ubond_sched_numbered(ubond_tunnel_t *tun, ubond_pkt_t *pkt)
+{
+    ubond_tunnel_t *t;
+    ubond_pkt_t *copy;
+
+    if (ubond_options.scheduler != UBOND_SCHED_REDUNDANT || !pkt->p.reorder)
+        return;
+    LIST_FOREACH(t, &rtuns, entries) {
+        if (t == tun || !ubond_sched_usable(t) ||
+            ubond_pkt_ring_length(&t->sbuf) >= UBOND_SCHED_COPIES_MAX)
+            continue;
+        if (!(copy = ubond_pkt_get_size(pkt->p.len)))
+            return;
+        memcpy(&copy->p, &pkt->p, UBOND_PROTO_HDRSIZ + pkt->p.len);
+        copy->p.type = UBOND_PKT_DATA_COPY;
+        copy->policy = pkt->policy;
+        copy->timestamp = pkt->timestamp;
+        ubond_pkt_ring_put(&t->sbuf, copy);
+        ubond_rtun_wake(t);
+        ubond_sched_stats[UBOND_SCHED_REDUNDANT].copies++;
+    }
+}
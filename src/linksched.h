@@ -0,0 +1,35 @@
+#ifndef UBOND_LINKSCHED_H
+#define UBOND_LINKSCHED_H
+
+#include "ubond.h"
+
+/* What each scheduler decided, since start */
+struct ubond_sched_stats {
+    uint64_t taken;   /* packets handed to the link asking for one */
+    uint64_t passed;  /* turns a link left to another one */
+    uint64_t copies;  /* extra copies queued on the other links */
+};
+
+extern struct ubond_sched_stats ubond_sched_stats[UBOND_SCHED_COUNT];
+
+/* Scheduler called name, -1 if there is none */
+int
+ubond_sched_lookup(const char *name);
+
+const char *
+ubond_sched_name(enum ubond_scheduler sched);
+
+/* Switch to sched, from the configuration or the control socket */
+void
+ubond_sched_set(enum ubond_scheduler sched);
+
+/* Whether rtun, ready to send, takes the next data packet of len bytes
+ * from the send buffer or leaves it to another link */
+int
+ubond_sched_take(ubond_tunnel_t *rtun, size_t len);
+
+/* pkt, a data packet, got its data_seq to go out on tun */
+void
+ubond_sched_numbered(ubond_tunnel_t *tun, ubond_pkt_t *pkt);
+
+#endif
@@ -92,11 +92,13 @@ logit(int pri, const char *token, const char *fmt, ...)
 static char *
 date()
 {
-    /* Return the current date as incomplete ISO 8601 (2012-12-12T16:13:30) */
-    static char date[] = "2012-12-12T16:13:30";
+    /* Return the current date as incomplete ISO 8601 (2012-12-12T16:13:30),
+     * per thread as the tun queue workers log too */
+    static __thread char date[] = "2012-12-12T16:13:30";
     time_t t = time(NULL);
-    struct tm *tmp = localtime(&t);
-    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", tmp);
+    struct tm tm;
+    localtime_r(&t, &tm);
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", &tm);
     return date;
 }
 
@@ -0,0 +1,370 @@
+#include "includes.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/queue.h>
+#include <sys/mman.h>
+
+#include "log.h"
+#include "pkt.h"
+#ifdef HAVE_AF_XDP
+#include "xdp.h"
+#endif
+
+/*
+ * Packet allocator. Packets come in three size classes (small, MTU and
+ * jumbo payloads) carved out of UBOND_PKT_SLAB_SIZE slabs, each one cache
+ * line aligned, and never given back to the system: the memory of all the
+ * classes together is bounded by the configured maximum instead.
+ * Released packets go through a small per-thread cache before the global
+ * free list of their class: the tun queue workers allocate and release too,
+ * so the free lists and the slabs are under pool_lock and the counters are
+ * updated atomically. Only the thread which registered the reclaim
+ * callback runs it, the others leave it a note.
+ */
+#define UBOND_PKT_SLAB_SIZE (2 * 1024 * 1024)
+#define UBOND_PKT_ALIGN 64
+#define UBOND_PKT_CACHE_SIZE 64
+
+struct ubond_pkt_class
+{
+    uint16_t room;
+    size_t stride;
+    ubond_pkt_list_t pool;
+};
+
+struct ubond_pkt_cache
+{
+    unsigned n;
+    ubond_pkt_t *pkts[UBOND_PKT_CACHE_SIZE];
+};
+
+#define PKT_CLASS(c, r) [c] = { .room = r, \
+    .pool = { .list = TAILQ_HEAD_INITIALIZER(classes[c].pool.list) } }
+static struct ubond_pkt_class classes[UBOND_PKT_CLASSES] = {
+    PKT_CLASS(UBOND_PKT_CLASS_SMALL, UBOND_PKT_SMALL),
+    PKT_CLASS(UBOND_PKT_CLASS_MTU, DEFAULT_MTU),
+    PKT_CLASS(UBOND_PKT_CLASS_JUMBO, UBOND_PKT_JUMBO),
+};
+static __thread struct ubond_pkt_cache cache[UBOND_PKT_CLASSES];
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static int pool_flags = 0;
+static size_t pool_bytes = 0;
+static void (*pool_reclaim)(void) = NULL;
+static pthread_t pool_reclaim_thread;
+static int pool_reclaim_wanted = 0;
+struct ubond_pkt_pool_stats pkt_pool_stats = {
+    .max = UBOND_PKT_POOL_MAX,
+};
+uint64_t pool_out = 0;
+
+static size_t
+pkt_stride(int c)
+{
+    if (! classes[c].stride)
+        classes[c].stride = (offsetof(ubond_pkt_t, p) + UBOND_PROTO_HDRSIZ +
+            classes[c].room + UBOND_PKT_ALIGN - 1) & ~(size_t)(UBOND_PKT_ALIGN - 1);
+    return classes[c].stride;
+}
+
+/* smallest class with room bytes of payload */
+static int
+pkt_class(size_t room)
+{
+    int c;
+    for (c = 0; c < UBOND_PKT_CLASS_JUMBO; c++)
+        if (room <= classes[c].room)
+            break;
+    return c;
+}
+
+/* Carve one more slab into the free list of class c, pool_lock held.
+ * Returns the number of packets. */
+static unsigned
+pkt_slab_grow(int c)
+{
+    char *slab = MAP_FAILED;
+    size_t stride = pkt_stride(c);
+    size_t limit = pkt_pool_stats.max * pkt_stride(UBOND_PKT_CLASS_MTU);
+    unsigned i, n = UBOND_PKT_SLAB_SIZE / stride;
+    ubond_pkt_t *pkt;
+
+    if (pool_bytes + stride > limit)
+        return 0;
+    if (n > (limit - pool_bytes) / stride)
+        n = (limit - pool_bytes) / stride;
+#ifdef MAP_HUGETLB
+    if (pool_flags & UBOND_PKT_POOL_HUGEPAGES) {
+        slab = mmap(NULL, UBOND_PKT_SLAB_SIZE, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (slab == MAP_FAILED) {
+            log_warn("pkt", "no hugepage left for the packet pool");
+            pool_flags &= ~UBOND_PKT_POOL_HUGEPAGES;
+        } else {
+            pkt_pool_stats.hugepage_slabs++;
+        }
+    }
+#endif
+    if (slab == MAP_FAILED)
+        slab = mmap(NULL, UBOND_PKT_SLAB_SIZE, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (slab == MAP_FAILED) {
+        log_warn("pkt", "packet slab allocation failed");
+        return 0;
+    }
+    if (pool_flags & UBOND_PKT_POOL_MLOCK) {
+        if (mlock(slab, UBOND_PKT_SLAB_SIZE) < 0) {
+            log_warn("pkt", "unable to lock the packet pool in memory");
+            pool_flags &= ~UBOND_PKT_POOL_MLOCK;
+        } else {
+            pkt_pool_stats.locked_slabs++;
+        }
+    }
+    /* lowest addresses end up first in the LIFO */
+    for (i = n; i > 0; i--) {
+        pkt = (ubond_pkt_t *)(slab + (size_t)(i - 1) * stride);
+        pkt->room = classes[c].room;
+        pkt->size_class = c;
+        UBOND_TAILQ_INSERT_HEAD(&classes[c].pool, pkt);
+    }
+    pool_bytes += (size_t)n * stride;
+    pkt_pool_stats.capacity += n;
+    pkt_pool_stats.slabs++;
+    return n;
+}
+
+/* Move up to half a cache worth of packets from the free list */
+static void
+pkt_cache_refill(int c)
+{
+    struct ubond_pkt_cache *pc = &cache[c];
+    ubond_pkt_list_t *pool = &classes[c].pool;
+
+    pthread_mutex_lock(&pool_lock);
+    while (pc->n < UBOND_PKT_CACHE_SIZE / 2) {
+        if (UBOND_TAILQ_EMPTY(pool) && ! pkt_slab_grow(c))
+            break;
+        pc->pkts[pc->n] = UBOND_TAILQ_FIRST(pool);
+        UBOND_TAILQ_REMOVE(pool, pc->pkts[pc->n]);
+        pc->n++;
+    }
+    pthread_mutex_unlock(&pool_lock);
+}
+
+static void
+pkt_cache_flush(int c)
+{
+    struct ubond_pkt_cache *pc = &cache[c];
+
+    pthread_mutex_lock(&pool_lock);
+    while (pc->n > UBOND_PKT_CACHE_SIZE / 2) {
+        pc->n--;
+        UBOND_TAILQ_INSERT_HEAD(&classes[c].pool, pc->pkts[pc->n]);
+    }
+    pthread_mutex_unlock(&pool_lock);
+}
+
+void
+ubond_pkt_pool_init(uint64_t prealloc, uint64_t max, int flags)
+{
+    uint64_t per_slab = UBOND_PKT_SLAB_SIZE / pkt_stride(UBOND_PKT_CLASS_MTU);
+
+    /* at least a slab for every class */
+    if (max < UBOND_PKT_CLASSES * per_slab)
+        max = UBOND_PKT_CLASSES * per_slab;
+    if (prealloc > max)
+        prealloc = max;
+    pthread_mutex_lock(&pool_lock);
+    pool_flags = flags;
+    pkt_pool_stats.max = max;
+    while (pkt_pool_stats.capacity < prealloc)
+        if (! pkt_slab_grow(UBOND_PKT_CLASS_MTU))
+            break;
+    pthread_mutex_unlock(&pool_lock);
+    log_info("pkt", "packet pool: %"PRIu64" packets preallocated, "
+             "%"PRIu64" at most (%zu/%zu/%zu bytes each)",
+             pkt_pool_stats.capacity, max,
+             pkt_stride(UBOND_PKT_CLASS_SMALL), pkt_stride(UBOND_PKT_CLASS_MTU),
+             pkt_stride(UBOND_PKT_CLASS_JUMBO));
+}
+
+/* Called when the pool is exhausted, to give back packets that are only
+ * kept in case they are needed again. Runs on the calling thread only. */
+void
+ubond_pkt_pool_set_reclaim(void (*reclaim)(void))
+{
+    pool_reclaim_thread = pthread_self();
+    pool_reclaim = reclaim;
+}
+
+/* Run the reclaim callback if another thread ran out of packets since */
+void
+ubond_pkt_pool_reclaim_pending()
+{
+    if (pool_reclaim &&
+            __atomic_exchange_n(&pool_reclaim_wanted, 0, __ATOMIC_RELAXED)) {
+        __atomic_add_fetch(&pkt_pool_stats.reclaims, 1, __ATOMIC_RELAXED);
+        pool_reclaim();
+    }
+}
+
+/* A packet with at least room bytes of payload.
+ * NULL once the pool reached its maximum size. */
+ubond_pkt_t *
+ubond_pkt_get_size(size_t room)
+{
+    int c = pkt_class(room);
+    uint64_t out;
+
+    if (room > UBOND_PKT_JUMBO)
+        return NULL;
+    if (cache[c].n == 0) {
+        pkt_cache_refill(c);
+        if (cache[c].n == 0 && pool_reclaim) {
+            if (pthread_equal(pthread_self(), pool_reclaim_thread)) {
+                __atomic_store_n(&pool_reclaim_wanted, 0, __ATOMIC_RELAXED);
+                __atomic_add_fetch(&pkt_pool_stats.reclaims, 1,
+                                   __ATOMIC_RELAXED);
+                pool_reclaim();
+                pkt_cache_refill(c);
+            } else {
+                __atomic_store_n(&pool_reclaim_wanted, 1, __ATOMIC_RELAXED);
+            }
+        }
+        if (cache[c].n == 0) {
+            __atomic_add_fetch(&pkt_pool_stats.failures, 1, __ATOMIC_RELAXED);
+            return NULL;
+        }
+    }
+    out = __atomic_add_fetch(&pool_out, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&pkt_pool_stats.in_use[c], 1, __ATOMIC_RELAXED);
+    if (out > __atomic_load_n(&pkt_pool_stats.high_water, __ATOMIC_RELAXED))
+        __atomic_store_n(&pkt_pool_stats.high_water, out, __ATOMIC_RELAXED);
+    return cache[c].pkts[--cache[c].n];
+}
+
+/* NULL once the pool reached its maximum size */
+ubond_pkt_t *
+ubond_pkt_get()
+{
+    return ubond_pkt_get_size(DEFAULT_MTU);
+}
+
+/* Move pkt to the smallest class its payload fits in: packets kept for
+ * resends then hold no more memory than they need.
+ * Returns pkt itself when it is already the right size. */
+ubond_pkt_t *
+ubond_pkt_shrink(ubond_pkt_t *pkt)
+{
+    ubond_pkt_t *s;
+    int c = pkt_class(pkt->p.len);
+
+    if (pkt->size_class >= UBOND_PKT_CLASSES || c >= pkt->size_class)
+        return pkt;
+    /* never reclaim for a shrink */
+    if (cache[c].n == 0) {
+        pthread_mutex_lock(&pool_lock);
+        if (UBOND_TAILQ_EMPTY(&classes[c].pool) && ! pkt_slab_grow(c)) {
+            pthread_mutex_unlock(&pool_lock);
+            return pkt;
+        }
+        pthread_mutex_unlock(&pool_lock);
+    }
+    if (! (s = ubond_pkt_get_size(pkt->p.len)))
+        return pkt;
+    s->timestamp = pkt->timestamp;
+    s->len = pkt->len;
+    memcpy(&s->p, &pkt->p, UBOND_PROTO_HDRSIZ + pkt->p.len);
+    ubond_pkt_release(pkt);
+    return s;
+}
+
+void
+ubond_pkt_release(ubond_pkt_t *p)
+{
+    int c;
+#ifdef HAVE_AF_XDP
+    /* received through AF_XDP: the buffer goes back to its UMEM */
+    if (p->size_class == UBOND_PKT_CLASS_FOREIGN && ubond_xsk_release(p))
+        return;
+#endif
+    c = p->size_class;
+    __atomic_sub_fetch(&pool_out, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&pkt_pool_stats.in_use[c], 1, __ATOMIC_RELAXED);
+    if (cache[c].n == UBOND_PKT_CACHE_SIZE)
+        pkt_cache_flush(c);
+    cache[c].pkts[cache[c].n++] = p;
+}
+
+/* The ring holds twice size packets: producers that queue regardless of
+ * ubond_pkt_ring_is_full() (control packets, resends) still find room. */
+void
+ubond_pkt_ring_init(ubond_pkt_ring_t *ring, uint32_t size)
+{
+    uint32_t cap = 1;
+
+    while (cap < 2 * size)
+        cap <<= 1;
+    memset(ring, 0, sizeof(*ring));
+    if (! (ring->pkts = calloc(cap, sizeof(ubond_pkt_t *))))
+        fatal("pkt", "calloc failed");
+    ring->mask = cap - 1;
+    ring->max_size = size;
+}
+
+void
+ubond_pkt_ring_free(ubond_pkt_ring_t *ring)
+{
+    ubond_pkt_ring_flush(ring);
+    free(ring->pkts);
+    ring->pkts = NULL;
+}
+
+/* release every queued packet */
+void
+ubond_pkt_ring_flush(ubond_pkt_ring_t *ring)
+{
+    while (ring->head != ring->tail)
+        ubond_pkt_release(ring->pkts[ring->head++ & ring->mask]);
+}
+
+/* Queue up to n packets, the ones past the capacity are dropped.
+ * Returns the number queued. */
+int
+ubond_pkt_ring_put_n(ubond_pkt_ring_t *ring, ubond_pkt_t **pkts, int n)
+{
+    uint32_t room = ring->mask + 1 - (ring->tail - ring->head);
+    uint32_t idx = ring->tail & ring->mask;
+    uint32_t first;
+    int i;
+
+    for (i = room; i < n; i++) {
+        ring->overflows++;
+        ubond_pkt_release(pkts[i]);
+    }
+    if ((uint32_t)n > room)
+        n = room;
+    /* up to the end of the array, then from its start */
+    first = MIN((uint32_t)n, ring->mask + 1 - idx);
+    memcpy(&ring->pkts[idx], pkts, first * sizeof(ubond_pkt_t *));
+    memcpy(ring->pkts, pkts + first, (n - first) * sizeof(ubond_pkt_t *));
+    ring->tail += n;
+    return n;
+}
+
+/* Dequeue up to n packets, oldest first. Returns the number dequeued. */
+int
+ubond_pkt_ring_get_n(ubond_pkt_ring_t *ring, ubond_pkt_t **pkts, int n)
+{
+    uint32_t idx = ring->head & ring->mask;
+    uint32_t first;
+
+    if ((uint32_t)n > ring->tail - ring->head)
+        n = ring->tail - ring->head;
+    first = MIN((uint32_t)n, ring->mask + 1 - idx);
+    memcpy(pkts, &ring->pkts[idx], first * sizeof(ubond_pkt_t *));
+    memcpy(pkts + first, ring->pkts, (n - first) * sizeof(ubond_pkt_t *));
+    ring->head += n;
+    return n;
+}
@@ -1,11 +1,23 @@
 #ifndef _UBOND_PKT_H
 #define _UBOND_PKT_H
 
+#include <stddef.h>
 #include <stdint.h>
 #include <ev.h>
 #include "crypto.h"
 
 #define DEFAULT_MTU 1500
+/* payload room of the small and jumbo packet size classes */
+#define UBOND_PKT_SMALL 256
+#define UBOND_PKT_JUMBO 9000
+
+enum {
+    UBOND_PKT_CLASS_SMALL,
+    UBOND_PKT_CLASS_MTU,
+    UBOND_PKT_CLASS_JUMBO,
+    UBOND_PKT_CLASSES,
+    UBOND_PKT_CLASS_FOREIGN = UBOND_PKT_CLASSES /* not from the pool */
+};
 
 enum {
     UBOND_PKT_AUTH,
@@ -14,7 +26,8 @@ enum {
     UBOND_PKT_DATA,
     UBOND_PKT_DATA_RESEND,
     UBOND_PKT_DISCONNECT,
-    UBOND_PKT_RESEND
+    UBOND_PKT_RESEND,
+    UBOND_PKT_DATA_COPY     /* extra copy of a DATA, redundant scheduler */
 };
 
 
@@ -29,18 +42,43 @@ typedef struct {
     uint16_t timestamp_reply;
     uint32_t flow_id;
     uint64_t tun_seq;     /* Stream sequence per flow (for crypto) */
-    uint64_t data_seq;    /* data packets global sequence */
-    char data[DEFAULT_MTU];
+    uint64_t data_seq;    /* data packets sequence, per flow group */
+    char data[UBOND_PKT_JUMBO];
 } __attribute__((packed)) ubond_proto_t;
 
+#define UBOND_PROTO_HDRSIZ offsetof(ubond_proto_t, data)
+
+/* The sender can number groups of flows separately, so that a hole in one
+ * does not hold back the others: the group is carried in the top bits of
+ * data_seq, each group has its own sequence and reorder queue. */
+#define UBOND_REORDER_FLOW_SHIFT 56
+#define UBOND_REORDER_FLOW_SEQ_MASK ((UINT64_C(1) << UBOND_REORDER_FLOW_SHIFT) - 1)
+#define UBOND_REORDER_FLOW(seq) ((seq) >> UBOND_REORDER_FLOW_SHIFT)
+#define UBOND_REORDER_FLOWS_MAX 64
+
+/* multishot recvmsg writes its io_uring_recvmsg_out header (16 bytes) and
+ * the source address right before the datagram, which lands in p */
+#define UBOND_PKT_HEADROOM 48
+
+/* Packets are allocated by size class: only room bytes of p.data exist,
+ * which is why p comes last. */
 typedef struct ubond_pkt_t
 {
-  ubond_proto_t p;
   ev_tstamp timestamp;
-  uint16_t len; // wire read length
   TAILQ_ENTRY(ubond_pkt_t) entry;
+  uint16_t len; // wire read length
+  uint16_t room; // bytes available in p.data
+  uint8_t size_class;
+  uint8_t policy; // enum ubond_policy of a data packet, sender side
+#ifdef HAVE_IO_URING
+  char headroom[UBOND_PKT_HEADROOM]; // filled by the io_uring receive ring
+#endif
+  ubond_proto_t p __attribute__((aligned(8)));
 } ubond_pkt_t;
 
+/* largest datagram pkt can hold */
+#define UBOND_PKT_WIRE_ROOM(pkt) (UBOND_PROTO_HDRSIZ + (pkt)->room)
+
 typedef struct ubond_pkt_list_t 
 {
   TAILQ_HEAD(list_t, ubond_pkt_t) list;
@@ -68,9 +106,93 @@ static inline ubond_pkt_t *UBOND_TAILQ_POP_LAST(ubond_pkt_list_t *lst)
 }
 
 
+/* packet pool, see pkt.c */
+#define UBOND_PKT_POOL_SIZE 4096        /* preallocated packets */
+#define UBOND_PKT_POOL_MAX 131072       /* hard limit */
+#define UBOND_PKT_POOL_HUGEPAGES 0x01
+#define UBOND_PKT_POOL_MLOCK 0x02
+
+struct ubond_pkt_pool_stats
+{
+  uint64_t capacity;       /* packets carved out of the slabs */
+  uint64_t max;            /* in MTU sized packets */
+  uint64_t in_use[UBOND_PKT_CLASSES];
+  uint64_t high_water;     /* most packets in use at once */
+  uint64_t failures;       /* ubond_pkt_get() calls that found no packet */
+  uint64_t reclaims;       /* times the reclaim callback ran */
+  uint64_t slabs;
+  uint64_t hugepage_slabs;
+  uint64_t locked_slabs;
+};
+extern struct ubond_pkt_pool_stats pkt_pool_stats;
+extern uint64_t pool_out;
+
+void ubond_pkt_pool_init(uint64_t prealloc, uint64_t max, int flags);
+void ubond_pkt_pool_set_reclaim(void (*reclaim)(void));
+void ubond_pkt_pool_reclaim_pending();
 ubond_pkt_t *ubond_pkt_get();
+ubond_pkt_t *ubond_pkt_get_size(size_t room);
+ubond_pkt_t *ubond_pkt_shrink(ubond_pkt_t *pkt);
 void ubond_pkt_release(ubond_pkt_t *p);
 
+/* Fixed capacity FIFO of packet pointers, for the send queues. The
+ * capacity is a power of two, head and tail run freely and are masked
+ * on access. */
+typedef struct ubond_pkt_ring_t
+{
+  ubond_pkt_t **pkts;
+  uint32_t mask;
+  uint32_t head;        /* next packet out */
+  uint32_t tail;        /* next free slot */
+  uint32_t max_size;    /* soft limit, see ubond_pkt_ring_is_full() */
+  uint64_t overflows;   /* packets dropped on a full ring */
+} ubond_pkt_ring_t;
+
+void ubond_pkt_ring_init(ubond_pkt_ring_t *ring, uint32_t size);
+void ubond_pkt_ring_free(ubond_pkt_ring_t *ring);
+void ubond_pkt_ring_flush(ubond_pkt_ring_t *ring);
+int ubond_pkt_ring_put_n(ubond_pkt_ring_t *ring, ubond_pkt_t **pkts, int n);
+int ubond_pkt_ring_get_n(ubond_pkt_ring_t *ring, ubond_pkt_t **pkts, int n);
+
+static inline uint32_t ubond_pkt_ring_length(const ubond_pkt_ring_t *ring)
+{
+  return ring->tail - ring->head;
+}
+static inline int ubond_pkt_ring_empty(const ubond_pkt_ring_t *ring)
+{
+  return ring->tail == ring->head;
+}
+/* Past the soft limit: producers should pause. The ring still takes
+ * packets up to its capacity. */
+static inline int ubond_pkt_ring_is_full(const ubond_pkt_ring_t *ring)
+{
+  return ring->tail - ring->head >= ring->max_size;
+}
+/* Queue p, or drop it when the ring is at capacity.
+ * Returns -1 when p was dropped. */
+static inline int ubond_pkt_ring_put(ubond_pkt_ring_t *ring, ubond_pkt_t *p)
+{
+  if (ring->tail - ring->head > ring->mask) {
+    ring->overflows++;
+    ubond_pkt_release(p);
+    return -1;
+  }
+  ring->pkts[ring->tail++ & ring->mask] = p;
+  return 0;
+}
+static inline ubond_pkt_t *ubond_pkt_ring_peek(const ubond_pkt_ring_t *ring)
+{
+  if (ring->tail == ring->head)
+    return NULL;
+  return ring->pkts[ring->head & ring->mask];
+}
+static inline ubond_pkt_t *ubond_pkt_ring_get(ubond_pkt_ring_t *ring)
+{
+  if (ring->tail == ring->head)
+    return NULL;
+  return ring->pkts[ring->head++ & ring->mask];
+}
+
                                         
 #define PKTHDRSIZ(pkt) (sizeof(pkt)-sizeof(pkt.data))
 #define ETH_OVERHEAD 24
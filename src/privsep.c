@@ -48,6 +48,10 @@
 #include "privsep.h"
 #include "ubond.h"
 #include "tuntap_generic.h"
+#ifdef HAVE_AF_XDP
+ #include <sys/resource.h>
+ #include "xdp.h"
+#endif
 
 /*
  * ubond can only go forward in these states; each state should represent
@@ -77,7 +81,9 @@ enum cmd_types {
     PRIV_RUN_SCRIPT,    /* run status script */
     PRIV_RELOAD_RESOLVER,
     PRIV_GETADDRINFO,
-    PRIV_SET_RUNNING_STATE /* ready for maximum security */
+    PRIV_SET_RUNNING_STATE, /* ready for maximum security */
+    PRIV_OPEN_XDP,      /* attach the XDP program, open an AF_XDP socket */
+    PRIV_XDP_REDIRECT   /* steer a tunnel port into its AF_XDP socket */
 };
 
 /* Error message for some communication between processes */
@@ -91,8 +97,11 @@ static volatile sig_atomic_t cur_state = STATE_INIT;
 static char allowed_configfile[MAXPATHLEN] = {0};
 
 static int root_open_file(char *, int);
-int root_tuntap_open(int tuntapmode, char *devname, int mtu);
+int root_tuntap_open(int tuntapmode, char *devname, int mtu, int flags);
 static int root_launch_script(char *, int, char **, char **);
+#ifdef HAVE_AF_XDP
+static void root_xdp_memlock(void);
+#endif
 static void increase_state(int);
 static void sig_got_chld(int);
 static void sig_pass_to_chld(int);
@@ -108,7 +117,12 @@ priv_init(char *argv[], char *username)
     int nullfd;
     int mtu;
     int tuntapmode;
+    int tunflags;
     int env_len;
+#ifdef HAVE_AF_XDP
+    int xdp_ifindex, xdp_queue, udp_fd;
+    char xdp_ifname[UBOND_IFNAMSIZ];
+#endif
     size_t len;
     size_t hostname_len, servname_len, addrinfo_len;
     char path[MAXPATHLEN];
@@ -272,12 +286,13 @@ priv_init(char *argv[], char *username)
                 tuntapname[0] = '\0';
             }
             must_read(socks[0], &mtu, sizeof(mtu));
-            if (mtu < 0 || mtu > 1500) {
+            if (mtu < 0 || mtu > UBOND_PKT_JUMBO) {
                 fatalx("priv_open_tun: wrong mtu.");
             }
+            must_read(socks[0], &tunflags, sizeof(tunflags));
 
             /* see tuntap_*.c . That's where this is defined. */
-            fd = root_tuntap_open(tuntapmode, tuntapname, mtu);
+            fd = root_tuntap_open(tuntapmode, tuntapname, mtu, tunflags);
             if (fd < 0)
             {
                 len = 0;
@@ -450,6 +465,42 @@ priv_init(char *argv[], char *username)
 #endif
             break;
 
+#ifdef HAVE_AF_XDP
+        case PRIV_OPEN_XDP:
+            must_read(socks[0], &len, sizeof(len));
+            if (len == 0 || len > sizeof(xdp_ifname))
+                _exit(0);
+            must_read(socks[0], &xdp_ifname, len);
+            xdp_ifname[len - 1] = '\0';
+
+            fd = root_xdp_open(xdp_ifname, &xdp_ifindex);
+            if (fd < 0)
+                xdp_ifindex = -1;
+            else
+                root_xdp_memlock();
+            must_write(socks[0], &xdp_ifindex, sizeof(xdp_ifindex));
+            if (fd >= 0) {
+                send_fd(socks[0], fd);
+                close(fd);
+            }
+            break;
+
+        case PRIV_XDP_REDIRECT:
+            must_read(socks[0], &xdp_ifindex, sizeof(xdp_ifindex));
+            must_read(socks[0], &xdp_queue, sizeof(xdp_queue));
+            fd = receive_fd(socks[0]);
+            udp_fd = receive_fd(socks[0]);
+            i = -1;
+            if (fd >= 0 && udp_fd >= 0)
+                i = root_xdp_redirect(xdp_ifindex, xdp_queue, fd, udp_fd);
+            if (fd >= 0)
+                close(fd);
+            if (udp_fd >= 0)
+                close(udp_fd);
+            must_write(socks[0], &i, sizeof(i));
+            break;
+#endif
+
         default:
             errx(1, "unknown command %d", cmd);
             break;
@@ -460,6 +511,25 @@ priv_init(char *argv[], char *username)
     _exit(1);
 }
 
+#ifdef HAVE_AF_XDP
+/* The UMEM registered by the unprivileged process is locked memory */
+static void
+root_xdp_memlock(void)
+{
+    struct rlimit rl;
+    rlim_t umem = (rlim_t)UBOND_XDP_FRAMES * UBOND_XDP_FRAME_SIZE;
+
+    if (prlimit(child_pid, RLIMIT_MEMLOCK, NULL, &rl) < 0 ||
+            rl.rlim_cur == RLIM_INFINITY)
+        return;
+    rl.rlim_cur += umem;
+    if (rl.rlim_max != RLIM_INFINITY && rl.rlim_max < rl.rlim_cur)
+        rl.rlim_max = rl.rlim_cur;
+    if (prlimit(child_pid, RLIMIT_MEMLOCK, &rl, NULL) < 0)
+        log_warn("privsep", "unable to raise the locked memory limit");
+}
+#endif
+
 static int
 root_open_file(char *path, int flags)
 {
@@ -565,9 +635,11 @@ priv_open_config(char *config_path)
 }
 
 /* Open tun from unpriviled code
+ * flags: UBOND_TUN_F_* (see tuntap_generic.h). With UBOND_TUN_F_MULTIQUEUE
+ * every call attaches one more queue, the first one creating the device.
  * Scope: public
  */
-int priv_open_tun(int tuntapmode, char *devname, int mtu)
+int priv_open_tun(int tuntapmode, char *devname, int mtu, int flags)
 {
     int cmd, fd;
     size_t len;
@@ -588,6 +660,7 @@ int priv_open_tun(int tuntapmode, char *devname, int mtu)
     if (len > 0 && devname != NULL)
         must_write(priv_fd, devname, len);
     must_write(priv_fd, &mtu, sizeof(mtu));
+    must_write(priv_fd, &flags, sizeof(flags));
 
     must_read(priv_fd, &len, sizeof(len));
     if (len > 0 && len < UBOND_IFNAMSIZ && devname != NULL)
@@ -607,6 +680,49 @@ int priv_open_tun(int tuntapmode, char *devname, int mtu)
 }
 
 
+#ifdef HAVE_AF_XDP
+/* AF_XDP socket for ifname, the XDP program gets attached on first use.
+ * Returns the socket, *ifindex is set. */
+int
+priv_open_xdp(char *ifname, int *ifindex)
+{
+    int cmd, fd = -1;
+    size_t len;
+
+    if (priv_fd < 0)
+        errx(1, "%s: called from privileged portion", "priv_open_xdp");
+
+    len = strlen(ifname) + 1;
+    cmd = PRIV_OPEN_XDP;
+    must_write(priv_fd, &cmd, sizeof(cmd));
+    must_write(priv_fd, &len, sizeof(len));
+    must_write(priv_fd, ifname, len);
+    must_read(priv_fd, ifindex, sizeof(*ifindex));
+    if (*ifindex >= 0)
+        fd = receive_fd(priv_fd);
+    return fd;
+}
+
+/* Redirect the frames of the port udp_fd is bound to into xsk_fd */
+int
+priv_xdp_redirect(int ifindex, int queue, int xsk_fd, int udp_fd)
+{
+    int cmd, ret;
+
+    if (priv_fd < 0)
+        errx(1, "%s: called from privileged portion", "priv_xdp_redirect");
+
+    cmd = PRIV_XDP_REDIRECT;
+    must_write(priv_fd, &cmd, sizeof(cmd));
+    must_write(priv_fd, &ifindex, sizeof(ifindex));
+    must_write(priv_fd, &queue, sizeof(queue));
+    send_fd(priv_fd, xsk_fd);
+    send_fd(priv_fd, udp_fd);
+    must_read(priv_fd, &ret, sizeof(ret));
+    return ret;
+}
+#endif
+
 /* Name/service to address translation.  Response is placed into addr, and
  * the length is returned (zero on error) */
 int
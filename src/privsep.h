@@ -15,9 +15,13 @@ int priv_init(char *argv[], char *username);
 int priv_init_script(char *);
 int priv_open_config(char *);
 void priv_reload_resolver();
-int priv_open_tun(int tuntapmode, char *devname, int mtu);
+int priv_open_tun(int tuntapmode, char *devname, int mtu, int flags);
 int priv_run_script(int argc, char **argv, int env_len, char **env);
 void priv_set_running_state(void);
+#ifdef HAVE_AF_XDP
+int priv_open_xdp(char *ifname, int *ifindex);
+int priv_xdp_redirect(int ifindex, int queue, int xsk_fd, int udp_fd);
+#endif
 int
 priv_getaddrinfo(char *host, char *serv, struct addrinfo **addrinfo,
                  struct addrinfo *hints);
@@ -35,6 +35,7 @@
 
 
 #include <inttypes.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/queue.h>
 #include <ev.h>
@@ -43,12 +44,33 @@
 #include "ubond.h"
 #include "pkt.h"
 
-/* The reorder buffer data structure itself */
-struct ubond_reorder_buffer {
+/* Packets are held in a slot array indexed by data_seq, with a bitmap of
+ * the occupied slots. Everything held is in [min_seqn, min_seqn + SLOTS),
+ * so a slot is never shared. */
+#define UBOND_REORDER_SLOTS 16384   /* power of two, above RESENDBUFSIZE */
+#define UBOND_REORDER_MASK (UBOND_REORDER_SLOTS - 1)
+#define UBOND_REORDER_WORDS (UBOND_REORDER_SLOTS / 64)
+
+/* One sequence space, as numbered by the sender for a group of flows */
+struct ubond_reorder_flow {
   uint64_t min_seqn;  /**< Lowest seq. number that can be in the buffer */
   int is_initialized;
-  int enabled;
   int list_size;
+
+  ev_timer reorder_release_timer;  /* fires at the earliest hold deadline */
+  ev_tstamp release_at;
+  uint64_t hole_seqn;       /* hole found lost on every link, */
+  ev_tstamp hole_lost_at;   /* and when */
+
+  uint64_t present[UBOND_REORDER_WORDS];
+  uint64_t copied[UBOND_REORDER_WORDS];  /* the slot was filled by a copy */
+  ubond_pkt_t *slots[UBOND_REORDER_SLOTS];
+};
+
+/* The reorder buffer data structure itself */
+struct ubond_reorder_buffer {
+  int enabled;
+  int list_size;      // held in all flows
   int list_size_max;  // used to report only
   uint64_t loss;
   uint64_t delivered;
@@ -56,30 +78,28 @@ struct ubond_reorder_buffer {
   ev_tstamp last_tick;
   uint64_t pkts_arrived;
   double pkts_per_sec;
-  uint64_t pkts_sent;
 
-  double max_srtt;
+  double hold;        /* seconds a hole is waited for, from the link skew */
+  uint64_t hold_histogram[UBOND_REORDER_HOLD_BUCKETS];
 
   int target_len;
 
-  ubond_pkt_list_t list;
-
-  ev_check reorder_drain_check;
-
+  /* allocated when the sender first uses them */
+  struct ubond_reorder_flow *flows[UBOND_REORDER_FLOWS_MAX];
 };
 static struct ubond_reorder_buffer *reorder_buffer;
-//static ev_timer reorder_drain_check;
 extern void ubond_rtun_inject_tuntap(ubond_pkt_t *pkt);
 extern struct ev_loop *loop;
 static ev_timer reorder_timeout_tick;
 extern uint64_t out_resends;
-extern ev_tstamp resend_at;
-extern ubond_pkt_list_t send_buffer; /* send buffer */
+extern ubond_pkt_ring_t send_buffer; /* send buffer */
 extern struct rtunhead rtuns;
 
 void ubond_reorder_reset();
 
-void ubond_reorder_drain();
+void ubond_reorder_drain(struct ubond_reorder_flow *f);
+
+extern double srtt_min;
 
 int aolderb(uint64_t a, uint64_t b)
 {
@@ -111,60 +131,85 @@ double ubond_total_loss()
   return r;
 }
   
-void ubond_reorder_drain_check(EV_P_ ev_check *w, int revents)
+double ubond_reorder_hold(uint64_t *histogram)
 {
-  struct ubond_reorder_buffer *b=reorder_buffer;
-  ev_tstamp now=ev_now(EV_DEFAULT_UC);
-  ev_tstamp diff=now - b->last_tick;
-  
-  if (b->pkts_sent < b->pkts_per_sec * diff) {
-    b->pkts_sent++;
-    ubond_reorder_drain();
-  }
+  memcpy(histogram, reorder_buffer->hold_histogram,
+         sizeof(reorder_buffer->hold_histogram));
+  return reorder_buffer->hold;
+}
+
+void ubond_reorder_release_timeout(EV_P_ ev_timer *w, int revents)
+{
+  ubond_reorder_drain(w->data);
 }
 
 void ubond_reorder_tick(EV_P_ ev_timer *w, int revents)
 {
   struct ubond_reorder_buffer *b=reorder_buffer;
   ubond_tunnel_t *t;
-  double max_srtt = 0.0;
+  double ref=0, rel, fastest=0, hold=0;
+  int links=0;
 
   ev_tstamp now=ev_now(EV_DEFAULT_UC);
   ev_tstamp diff=now - b->last_tick;
   b->last_tick = now;
 
+  /* A packet sent after a hole can arrive ahead of it by as much as the
+   * one way delay of its link is shorter than the one of the hole: hold
+   * for the worst skew against the fastest link, plus its variation.
+   * The one way delays all carry the same clock offset, which cancels
+   * out; they are kept modulo 2^16 ms like the timestamps. */
   int up=0;
   LIST_FOREACH(t, &rtuns, entries)
   {
-
-//    worst 'reorder time' for any tunnel  /  fastest tunnel
-//                                   +
-//                                   process/wait time
-//                                   + srtt
-
-                                   
     if (t->status >= UBOND_AUTHOK) up++;
-    if (t->status == UBOND_AUTHOK && !t->fallback_only) {
-      /* We don't want to monitor fallback only links inside the
-       * reorder timeout algorithm
-       */
-      if (t->srtt_av > max_srtt) {
-        max_srtt = t->srtt_av;
+    t->owd_skew = 0;
+    /* We don't want to monitor fallback only links inside the
+     * reorder timeout algorithm
+     */
+    if (t->status != UBOND_AUTHOK || t->fallback_only || !t->owd_c)
+      continue;
+    if (!links++)
+      ref = t->owd_av;
+    rel = t->owd_av - ref;
+    if (rel > 32768) rel -= 65536;
+    if (rel < -32768) rel += 65536;
+    t->owd_skew = rel;
+    if (rel < fastest)
+      fastest = rel;
+  }
+  LIST_FOREACH(t, &rtuns, entries)
+  {
+    if (t->status != UBOND_AUTHOK || t->fallback_only || !t->owd_c)
+      continue;
+    t->owd_skew -= fastest;
+    if (t->owd_skew + 4 * t->owd_var > hold)
+      hold = t->owd_skew + 4 * t->owd_var;
+  }
+  if (links) {
+    b->hold = (hold + UBOND_REORDER_HOLD_MARGIN) / 1000.0;
+  } else {
+    b->hold = srtt_min*3/1000.0*2.2; // nothing measured yet
+  }
+  /* what is held already goes by the new hold, not the one it came in with */
+  int i;
+  for (i = 0; i < UBOND_REORDER_FLOWS_MAX; i++) {
+    if (b->flows[i] && b->flows[i]->is_initialized && b->flows[i]->list_size)
+      ubond_reorder_drain(b->flows[i]);
+  }
+  if (up==0) {
+    int reset=0;
+    for (i = 0; i < UBOND_REORDER_FLOWS_MAX; i++) {
+      if (b->flows[i] && b->flows[i]->is_initialized) {
+        b->flows[i]->is_initialized=0;
+        reset=1;
       }
-        
     }
-  }
-  if (up==0 && b->is_initialized) {
-    log_warnx("reorder", "No Tunnels hence resetting\n");
-    b->is_initialized=0;
+    if (reset)
+      log_warnx("reorder", "No Tunnels hence resetting\n");
   }
   
-  if (max_srtt <= 0) {
-    max_srtt=800;
-  }
 
-  b->max_srtt=  (b->max_srtt*9 + max_srtt)/10;
-  
   if (diff) {
 //    9/10 is too long, but 0 is too short?
 //      shorter tick, and 4/5 seems to be about right
@@ -178,7 +223,6 @@ void ubond_reorder_tick(EV_P_ ev_timer *w, int revents)
   } else {
     b->pkts_per_sec=(float)b->pkts_arrived;
   }
-  b->pkts_sent=0;
   b->pkts_arrived=0;
   if (b->pkts_per_sec < 1000) b->pkts_per_sec=1000;
   // this seems to be critical for video?
@@ -187,16 +231,118 @@ void ubond_reorder_tick(EV_P_ ev_timer *w, int revents)
 //  log_debug("reorder", "adjusting reordering drain timeout to %.0fms", reorder_drain_timeout.repeat*1000 );
 }
 
+/* Slot of the packet with the lowest data_seq. list_size must not be 0. */
+static uint32_t
+ubond_reorder_first(struct ubond_reorder_flow *f)
+{
+  uint32_t w = (f->min_seqn & UBOND_REORDER_MASK) / 64;
+  uint64_t bits = f->present[w] & (~0ULL << (f->min_seqn % 64));
+
+  while (!bits) {
+    w = (w + 1) % UBOND_REORDER_WORDS;
+    bits = f->present[w];
+  }
+  return w * 64 + __builtin_ctzll(bits);
+}
+
+static ubond_pkt_t *
+ubond_reorder_take(struct ubond_reorder_flow *f, uint32_t slot)
+{
+  ubond_pkt_t *l = f->slots[slot];
+  f->present[slot / 64] &= ~(1ULL << (slot % 64));
+  f->slots[slot] = NULL;
+  f->list_size--;
+  reorder_buffer->list_size--;
+  return l;
+}
+
+/* Hand the oldest packet held to the tuntap device, giving up on the
+ * ones missing before it. Returns 1 if it was the next one expected. */
+static int
+ubond_reorder_deliver_first(struct ubond_reorder_flow *f)
+{
+  struct ubond_reorder_buffer *b=reorder_buffer;
+  ubond_pkt_t *l = ubond_reorder_take(f, ubond_reorder_first(f));
+  double held = (ev_now(EV_DEFAULT_UC) - l->timestamp) * 1000.0;
+  int bucket = 0;
+
+  /* bucket 0 is under 1ms, then one per power of two */
+  while (held >= 1 && bucket < UBOND_REORDER_HOLD_BUCKETS - 1) {
+    held /= 2;
+    bucket++;
+  }
+  b->hold_histogram[bucket]++;
+
+  if (l->p.data_seq == f->min_seqn) {  // normal delivery
+    ubond_rtun_inject_tuntap(l);
+    b->delivered++;
+    log_debug("reorder","Delivered data seq %lu (tun seq %lu)", l->p.data_seq, l->p.tun_seq);
+    f->min_seqn=l->p.data_seq+1;
+    return 1;
+  } else if (aolderb(f->min_seqn, l->p.data_seq)) { // cut off time reached
+    ubond_rtun_inject_tuntap(l);
+    b->delivered++;
+    b->loss+=l->p.data_seq - f->min_seqn;
+    log_debug("loss","Lost %d from %lu, Delivered %lu (tun seq %lu)", (int)(l->p.data_seq - f->min_seqn), f->min_seqn,  l->p.data_seq, l->p.tun_seq);
+    f->min_seqn=l->p.data_seq+1;
+  } else {
+    ubond_pkt_release(l);
+    b->loss++;
+    log_debug("loss","Lost %lu, (trying to deliver %lu) (tun seq %lu)", l->p.data_seq, f->min_seqn, l->p.tun_seq);
+  }
+  return 0;
+}
+
+static void
+ubond_reorder_flush(struct ubond_reorder_flow *f)
+{
+  uint32_t w;
+  int bit;
+
+  for (w = 0; f->list_size && w < UBOND_REORDER_WORDS; w++) {
+    while (f->present[w]) {
+      bit = __builtin_ctzll(f->present[w]);
+      ubond_pkt_release(ubond_reorder_take(f, w * 64 + bit));
+    }
+  }
+  if (ev_is_active(&f->reorder_release_timer)) {
+    ev_timer_stop(EV_A_ &f->reorder_release_timer);
+  }
+  memset(f->copied, 0, sizeof(f->copied));
+  f->release_at=0;
+  f->hole_seqn=0;
+  f->hole_lost_at=0;
+}
+
+static struct ubond_reorder_flow *
+ubond_reorder_flow(struct ubond_reorder_buffer *b, uint64_t data_seq)
+{
+  uint64_t i = UBOND_REORDER_FLOW(data_seq);
+  struct ubond_reorder_flow *f;
+
+  if (i >= UBOND_REORDER_FLOWS_MAX)
+    return NULL;
+  if ((f = b->flows[i]))
+    return f;
+  if (!(f = calloc(1, sizeof(struct ubond_reorder_flow)))) {
+    log_warn("reorder", "flow %d: calloc failed", (int)i);
+    return NULL;
+  }
+  ev_init(&f->reorder_release_timer, ubond_reorder_release_timeout);
+  f->reorder_release_timer.data = f;
+  b->flows[i] = f;
+  return f;
+}
+
 // Called once from main.
 void ubond_reorder_init()
 {
-  reorder_buffer=malloc(sizeof(struct ubond_reorder_buffer));
-  UBOND_TAILQ_INIT(&reorder_buffer->list);
+  reorder_buffer=calloc(1, sizeof(struct ubond_reorder_buffer));
+  if (!reorder_buffer)
+    fatal("reorder", "calloc failed");
   reorder_buffer->enabled=0;
   ubond_reorder_reset();
 
-  ev_check_init(&reorder_buffer->reorder_drain_check, ubond_reorder_drain_check);
-
   ev_timer_init(&reorder_timeout_tick, &ubond_reorder_tick, 0., 0.25);
   ev_timer_start(EV_A_ &reorder_timeout_tick);
 }
@@ -207,18 +353,19 @@ ubond_reorder_reset()
 {
   log_warnx("reorder", "Reset");
   struct ubond_reorder_buffer *b=reorder_buffer;
-  while (!UBOND_TAILQ_EMPTY(&b->list))
-  {
-    ubond_pkt_release(UBOND_TAILQ_POP_LAST(&b->list));
+  int i;
+  for (i = 0; i < UBOND_REORDER_FLOWS_MAX; i++) {
+    if (b->flows[i]) {
+      ubond_reorder_flush(b->flows[i]);
+      b->flows[i]->is_initialized=0;
+    }
   }
   b->list_size=0;
   b->list_size_max=0;
-  b->is_initialized=0;
   b->last_tick=0;
   b->pkts_arrived=0;
   b->pkts_per_sec=1;
-  b->pkts_sent=0;
-  b->max_srtt=0.1;
+  b->hold=0.1;
   b->target_len=1000;
 }
 
@@ -230,17 +377,12 @@ void ubond_reorder_enable()
 void ubond_reorder_insert(ubond_tunnel_t *tun, ubond_pkt_t *pkt)
 {
   struct ubond_reorder_buffer *b=reorder_buffer;
-  b->pkts_arrived++;
-
-  if ( pkt->p.reorder &&
-       (!b->is_initialized  ||
-        ((int64_t)(b->min_seqn - pkt->p.data_seq) > 1000 && pkt->p.data_seq < 1000)))
-  {
-    b->min_seqn = pkt->p.data_seq;
-    b->is_initialized = 1;
-    log_warnx("reorder", "initial sequence: %"PRIu64"", pkt->p.data_seq);
-  }
+  struct ubond_reorder_flow *f=NULL;
+  uint32_t slot;
 
+  /* copies neither add to the rate nor stand for a resend */
+  if (pkt->p.type != UBOND_PKT_DATA_COPY)
+    b->pkts_arrived++;
 
   if (pkt->p.type == UBOND_PKT_DATA_RESEND) {
 // we could count in each tunnel the number of non resends, if you get to
@@ -248,7 +390,8 @@ void ubond_reorder_insert(ubond_tunnel_t *tun, ubond_pkt_t *pkt)
     if (out_resends>0) out_resends--;
   }
 
-  if (!b->enabled || !pkt->p.reorder || !pkt->p.data_seq/* || pkt->p.data_seq==b->min_seqn*/)
+  if (!b->enabled || !pkt->p.reorder || !pkt->p.data_seq/* || pkt->p.data_seq==b->min_seqn*/
+      || !(f = ubond_reorder_flow(b, pkt->p.data_seq)))
   {
     ubond_rtun_inject_tuntap(pkt); // this will deliver and free the packet
     // Deliver non reordable packets ASAP, as that shoudn't effect a tcp algorithm
@@ -256,9 +399,22 @@ void ubond_reorder_insert(ubond_tunnel_t *tun, ubond_pkt_t *pkt)
     return;
   }
 
+  if (!f->is_initialized  ||
+      ((int64_t)(f->min_seqn - pkt->p.data_seq) > 1000 &&
+       (pkt->p.data_seq & UBOND_REORDER_FLOW_SEQ_MASK) < 1000))
+  {
+    /* what is held belongs to the previous sequence */
+    ubond_reorder_flush(f);
+    f->min_seqn = pkt->p.data_seq;
+    f->is_initialized = 1;
+    log_warnx("reorder", "flow %d initial sequence: %"PRIu64"",
+              (int)UBOND_REORDER_FLOW(pkt->p.data_seq),
+              pkt->p.data_seq & UBOND_REORDER_FLOW_SEQ_MASK);
+  }
+
   if (pkt->p.type == UBOND_PKT_DATA_RESEND/* && pkt->p.data_seq && pkt->p.reorder*/) {
 
-    if (aolderb(pkt->p.data_seq, b->min_seqn)) {
+    if (aolderb(pkt->p.data_seq, f->min_seqn)) {
       log_debug("resend","Rejecting (un-necissary ?) resend %lu",pkt->p.data_seq);
       ubond_pkt_release(pkt);
       return;
@@ -266,8 +422,18 @@ void ubond_reorder_insert(ubond_tunnel_t *tun, ubond_pkt_t *pkt)
       log_debug("resend","Injecting resent %lu",pkt->p.data_seq);
     }
   } 
-  if (aolderb(pkt->p.data_seq, b->min_seqn)) {
-    log_debug("loss", "got old insert %d behind (probably agressive pruning) on %s",(int)(b->min_seqn - pkt->p.data_seq), tun->name);
+  slot = pkt->p.data_seq & UBOND_REORDER_MASK;
+  /* the second of a packet and its copy, the first one went out already */
+  if (aolderb(pkt->p.data_seq, f->min_seqn) &&
+      (pkt->p.type == UBOND_PKT_DATA_COPY ||
+       (f->min_seqn - pkt->p.data_seq <= UBOND_REORDER_SLOTS &&
+        (f->copied[slot / 64] & (1ULL << (slot % 64)))))) {
+    f->copied[slot / 64] &= ~(1ULL << (slot % 64));
+    ubond_pkt_release(pkt);
+    return;
+  }
+  if (aolderb(pkt->p.data_seq, f->min_seqn)) {
+    log_debug("loss", "got old insert %d behind (probably agressive pruning) on %s",(int)(f->min_seqn - pkt->p.data_seq), tun->name);
     b->loss++;
     ubond_pkt_release(pkt);
     return;
@@ -275,70 +441,77 @@ void ubond_reorder_insert(ubond_tunnel_t *tun, ubond_pkt_t *pkt)
 
   pkt->timestamp = ev_now(EV_DEFAULT_UC);
 
-    /*
-     * calculate the offset from the head pointer we need to go.
-     * The subtraction takes care of the sequence number wrapping.
-     * For example (using 16-bit for brevity):
-     *  min_seqn  = 0xFFFD
-     *  pkt_seq   = 0x0010
-     *  offset    = 0x0010 - 0xFFFD = 0x13
-     * Then we cast to a signed int, if the subtraction ends up in a large
-     * number, that will be seen as negative when casted....
-     */
-  ubond_pkt_t *l;
-  // we could search from the other end if it's closer?
-  UBOND_TAILQ_FOREACH(l, &b->list) {
-    if (pkt->p.data_seq == l->p.data_seq) { // replicated packet!
-      log_debug("resend","Un-necissary resend %lu",pkt->p.data_seq);
-      ubond_pkt_release(pkt);
-      return;
+  /* too far ahead for the window: whatever is held before it will not
+   * be waited for */
+  while (pkt->p.data_seq - f->min_seqn >= UBOND_REORDER_SLOTS) {
+    if (f->list_size) {
+      ubond_reorder_deliver_first(f);
+    } else {
+      b->loss += pkt->p.data_seq - f->min_seqn - UBOND_REORDER_SLOTS + 1;
+      f->min_seqn = pkt->p.data_seq - UBOND_REORDER_SLOTS + 1;
     }
-    if (aolderb(l->p.data_seq, pkt->p.data_seq)) break;
-  }
-  if (l) {
-    UBOND_TAILQ_INSERT_BEFORE(&b->list, l, pkt);
-  } else {
-    UBOND_TAILQ_INSERT_TAIL(&b->list, pkt);
   }
 
+  if (f->present[slot / 64] & (1ULL << (slot % 64))) { // replicated packet!
+    log_debug("resend","Un-necissary resend %lu",pkt->p.data_seq);
+    ubond_pkt_release(pkt);
+    return;
+  }
+  f->present[slot / 64] |= 1ULL << (slot % 64);
+  if (pkt->p.type == UBOND_PKT_DATA_COPY)
+    f->copied[slot / 64] |= 1ULL << (slot % 64);
+  else
+    f->copied[slot / 64] &= ~(1ULL << (slot % 64));
+  f->slots[slot] = pkt;
+
+  f->list_size++;
   b->list_size++;
   if (b->list_size > b->list_size_max) {
     b->list_size_max = b->list_size;
   }
 
-  if (!ev_is_active(&b->reorder_drain_check)) {
-    ev_check_start(EV_A_ &b->reorder_drain_check);
-  }
-//  ubond_reorder_drain();
+  ubond_reorder_drain(f);
 }
 
-extern double srtt_min;
-void ubond_reorder_drain()
+/* Each link delivers data_seq in the order they were sent on it, so once
+ * every link carrying data has settled past the hole before seq, what is
+ * missing will only turn up as a resend. A link which has not carried data
+ * recently leaves it to the hold time. */
+static int
+ubond_reorder_hole_lost(struct ubond_reorder_flow *f, uint64_t seq)
 {
-  struct ubond_reorder_buffer *b=reorder_buffer;
-  unsigned int drain_cnt = 0;
-  // 2.2 is a good window size
-  // 3 * more when we have resends (there and back + processing time etc)
-
-  /*some NS t respod - lest say 150
-    then - lest say we wnt to be able to handle 50 errors
-    so - 50* the delay it takes to send - say 10 per?
-    then -the other end - another 150 + another 50* - so everything *2
-
-    ((150 + 50*10)*2)*2 = 2.6
-    + the SRTT
+  ubond_tunnel_t *t;
+  uint64_t settled;
+  int links=0;
 
-    thats how many we want IN THE QUEUE
-    so if we're /2, then we have to *2....*/
+  LIST_FOREACH(t, &rtuns, entries)
+  {
+    if (t->status != UBOND_AUTHOK || t->fallback_only)
+      continue;
+    settled = t->data_seq_hist->settled[UBOND_REORDER_FLOW(seq)];
+    if (!settled ||
+        aolderb(settled, seq) ||
+        settled - f->min_seqn >= UBOND_REORDER_SLOTS)
+      return 0;
+    links++;
+  }
+  return links > 0;
+}
 
+void ubond_reorder_drain(struct ubond_reorder_flow *f)
+{
+  struct ubond_reorder_buffer *b=reorder_buffer;
   ev_tstamp now=ev_now(EV_DEFAULT_UC);
-  ev_tstamp t=((/*(double)b->*/srtt_min*3/1000.0)*2.2);//+2.6; // +300ms processing time
-  
-  if (resend_at < (now - (2.2 * (/*(double)b->*/srtt_min*3/1000.0)))) {
-    // we're never going to get a resend, you may as well drop!
-  } else {
-    t+=2.6;
+
+  /* A resend takes a round trip on the fastest link once the loss is seen,
+   * and is only worth waiting for if the packets held meanwhile still fit
+   * in the buffer. */
+  ev_tstamp resend_wait=0;
+  if (out_resends &&
+      b->pkts_per_sec * (b->hold + srtt_min/1000.0) < RESENDBUFSIZE) {
+    resend_wait=srtt_min/1000.0;
   }
+  ev_tstamp t=b->hold + resend_wait;
 
   ev_tstamp cut=now -  t;
   int target_len=(b->pkts_per_sec * t);
@@ -357,57 +530,59 @@ void ubond_reorder_drain()
     Packets that are 'after' the current 'minimum' hold - till the cut-off time,
       then deliver
 
-  We would love a list that was equal to the number of things we need such
-  that (max_srtt*2 + processing, + other things in the resend queue) time can
-  pass, and we'll still be able to fill in wih resends...
-  Lets call that max_srtt*6.6 (as above)
-
   But, no point having a length greater than  we could be asking for
   (e.g. that could be found in the pkt list)
 */
 
 
-  while (!UBOND_TAILQ_EMPTY(&b->list) &&
-         ( aoldereqb(UBOND_TAILQ_LAST(&b->list)->p.data_seq, b->min_seqn)
-           || (UBOND_TAILQ_LAST(&b->list)->timestamp < cut)
-           || (b->list_size > b->target_len)
-           ))
-  {
+  /* Everything up to the first hole goes out now; the hole in front of
+   * the oldest packet held is given up on once that packet has waited
+   * t, which is when the timer is set to fire next. */
+  ubond_pkt_t *l = NULL;
+  ev_tstamp hole_deadline = 0;
+  while (f->list_size) {
+    l = f->slots[ubond_reorder_first(f)];
+    if (aoldereqb(l->p.data_seq, f->min_seqn)
+        || (l->timestamp <= cut)
+        || (f->list_size > b->target_len)) {
+      ubond_reorder_deliver_first(f);
+      l = NULL;
+      continue;
+    }
 
-//    if (!aoldereqb(UBOND_TAILQ_LAST(&b->list)->p.data_seq, b->min_seqn) ) {
-//      log_debug("loss","Clearing: list size %d target %d last %f cut %f (%fs ago now: %fs)  outstanding resends %lu", b->list_size, b->target_len, UBOND_TAILQ_LAST(&b->list)->timestamp, cut, t, now,  out_resends);
-//    }
-    ubond_pkt_t *l = UBOND_TAILQ_LAST(&b->list);
-    UBOND_TAILQ_REMOVE(&b->list, l);
-
-    b->list_size--;
-    drain_cnt++;
-
-    if (l->p.data_seq == b->min_seqn) {  // normal delivery
-      ubond_rtun_inject_tuntap(l);
-      b->delivered++;
-      log_debug("reorder","Delivered data seq %lu (tun seq %lu)", l->p.data_seq, l->p.tun_seq);
-      b->min_seqn=l->p.data_seq+1;
-      if (b->list_size < (b->target_len/2)) break;
-    } else if (aolderb(b->min_seqn, l->p.data_seq)) { // cut off time reached
-      ubond_rtun_inject_tuntap(l);
-      b->delivered++;
-      b->loss+=l->p.data_seq - b->min_seqn;
-      log_debug("loss","Lost %d from %lu, Delivered %lu (tun seq %lu)", (int)(l->p.data_seq - b->min_seqn), b->min_seqn,  l->p.data_seq, l->p.tun_seq);
-      b->min_seqn=l->p.data_seq+1;
-    } else {
-      ubond_pkt_release(l);
-      b->loss++;
-      log_debug("loss","Lost %lu, (trying to deliver %lu) (tun seq %lu)", l->p.data_seq, b->min_seqn, l->p.tun_seq);
+    /* A hole every link has gone past is lost: only a resend can still
+     * fill it, rather than the whole hold time. */
+    if (f->hole_seqn != f->min_seqn && ubond_reorder_hole_lost(f, l->p.data_seq)) {
+      f->hole_seqn = f->min_seqn;
+      f->hole_lost_at = now;
     }
+    if (f->hole_seqn != f->min_seqn)
+      break;
+    hole_deadline = f->hole_lost_at + resend_wait;
+    if (hole_deadline > now)
+      break;
+    log_debug("loss", "Hole at %lu passed on every link", f->min_seqn);
+
+    ubond_reorder_deliver_first(f);
+    l = NULL;
+    hole_deadline = 0;
   }
 
   if (out_resends > b->list_size) out_resends=b->list_size;
 
-  if (UBOND_TAILQ_EMPTY(&b->list)) {
-    if (ev_is_active(&b->reorder_drain_check)) {
-      ev_check_stop(EV_A_ &b->reorder_drain_check);
+  if (!l) {
+    if (ev_is_active(&f->reorder_release_timer)) {
+      ev_timer_stop(EV_A_ &f->reorder_release_timer);
     }
+    return;
+  }
+  ev_tstamp deadline = l->timestamp + t;
+  if (hole_deadline && hole_deadline < deadline)
+    deadline = hole_deadline;
+  if (!ev_is_active(&f->reorder_release_timer) || deadline != f->release_at) {
+    f->release_at = deadline;
+    ev_timer_stop(EV_A_ &f->reorder_release_timer);
+    ev_timer_set(&f->reorder_release_timer, deadline - now, 0.);
+    ev_timer_start(EV_A_ &f->reorder_release_timer);
   }
-
 }
@@ -77,14 +77,32 @@ void ubond_reorder_enable();
  *
  * The given pkt is to be reordered relative to other pkts in the system.
  * The pkt must contain a sequence number which is then used to place
- * the buffer in the correct position in the reorder buffer. Reordered
- * packets can later be taken from the buffer using the ubond_reorder_drain()
- * API.
+ * the buffer in the correct position in the reorder buffer. Packets in
+ * sequence are delivered straight away, the rest are held until the hole
+ * in front of them is filled or its deadline expires.
  *
  * @param pkt
  *   pkt that needs to be inserted in reorder buffer.
  */
 void ubond_reorder_insert(ubond_tunnel_t *tun, ubond_pkt_t *pkt);
 
+/* allowance on top of the measured link skew */
+#define UBOND_REORDER_HOLD_MARGIN 5 /* ms */
+/* time packets spent in the buffer: under 1ms, then powers of two up to
+ * 2048ms and more */
+#define UBOND_REORDER_HOLD_BUCKETS 13
+
+/**
+ * Current hold time in seconds, histogram gets UBOND_REORDER_HOLD_BUCKETS
+ * counters of the time the packets spent in the buffer.
+ */
+double ubond_reorder_hold(uint64_t *histogram);
+
+/**
+ * Sequence comparisons that survive wrapping: is a before (or equal to) b
+ */
+int aolderb(uint64_t a, uint64_t b);
+int aoldereqb(uint64_t a, uint64_t b);
+
 
 #endif /* UBOND_REORDER_H */
@@ -0,0 +1,247 @@
+#include "includes.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/queue.h>
+#include <ev.h>
+
+#include "log.h"
+#include "ubond.h"
+#include "reorder.h"
+#include "pkt.h"
+
+/*
+ * Reorder buffer microbenchmark: the same synthetic arrivals go through
+ * reorder.c and through the sorted list it used before the slot array,
+ * and each prints the time per packet.
+ *
+ * Two links carry every other data_seq, the second one skew packets
+ * behind the first, and loss percent of the packets never arrive. Time
+ * does not move during a run, so nothing is given up on for its age:
+ * holes go when the buffer is over its target length, as they do under
+ * load.
+ *
+ *   make reorder_bench && ./reorder_bench [packets]
+ */
+
+/* what ubond_reorder_reset() starts with */
+#define BENCH_TARGET_LEN 1000
+
+/* reorder.c's view of the rest of ubond */
+struct ev_loop *loop;
+uint64_t out_resends;
+struct rtunhead rtuns;
+double srtt_min = 40;
+
+static ubond_pkt_t *free_pkts;
+static uint64_t delivered, next_seq, misordered;
+
+void
+ubond_pkt_release(ubond_pkt_t *pkt)
+{
+    pkt->entry.tqe_next = free_pkts;
+    free_pkts = pkt;
+}
+
+static ubond_pkt_t *
+bench_pkt(uint64_t seq)
+{
+    ubond_pkt_t *pkt = free_pkts;
+
+    if (pkt)
+        free_pkts = pkt->entry.tqe_next;
+    else if (!(pkt = calloc(1, sizeof(ubond_pkt_t) - UBOND_PKT_JUMBO)))
+        fatal(NULL, "out of memory");
+    pkt->p.type = UBOND_PKT_DATA;
+    pkt->p.reorder = 1;
+    pkt->p.data_seq = seq;
+    return pkt;
+}
+
+void
+ubond_rtun_inject_tuntap(ubond_pkt_t *pkt)
+{
+    if (pkt->p.data_seq < next_seq)
+        misordered++;
+    next_seq = pkt->p.data_seq + 1;
+    delivered++;
+    ubond_pkt_release(pkt);
+}
+
+/*
+ * The sorted list, as reorder.c had it: newest first, insert walks from
+ * the newest, the oldest goes once in sequence or over the target length.
+ */
+static struct {
+    ubond_pkt_list_t list;
+    uint64_t min_seqn;
+    int list_size;
+} old;
+
+static void
+old_drain()
+{
+    ubond_pkt_t *l;
+
+    while (!UBOND_TAILQ_EMPTY(&old.list) &&
+           (aoldereqb(UBOND_TAILQ_LAST(&old.list)->p.data_seq, old.min_seqn)
+            || old.list_size > BENCH_TARGET_LEN)) {
+        l = UBOND_TAILQ_LAST(&old.list);
+        UBOND_TAILQ_REMOVE(&old.list, l);
+        old.list_size--;
+        if (aoldereqb(old.min_seqn, l->p.data_seq)) {
+            old.min_seqn = l->p.data_seq + 1;
+            ubond_rtun_inject_tuntap(l);
+        } else {
+            ubond_pkt_release(l);
+        }
+    }
+}
+
+static void
+old_insert(ubond_pkt_t *pkt)
+{
+    ubond_pkt_t *l;
+
+    if (aolderb(pkt->p.data_seq, old.min_seqn)) {
+        ubond_pkt_release(pkt);
+        return;
+    }
+    UBOND_TAILQ_FOREACH(l, &old.list) {
+        if (pkt->p.data_seq == l->p.data_seq) {
+            ubond_pkt_release(pkt);
+            return;
+        }
+        if (aolderb(l->p.data_seq, pkt->p.data_seq))
+            break;
+    }
+    if (l) {
+        UBOND_TAILQ_INSERT_BEFORE(&old.list, l, pkt);
+    } else {
+        UBOND_TAILQ_INSERT_TAIL(&old.list, pkt);
+    }
+    old.list_size++;
+    old_drain();
+}
+
+static void
+old_flush()
+{
+    ubond_pkt_t *l;
+
+    while ((l = UBOND_TAILQ_POP_LAST(&old.list)))
+        ubond_pkt_release(l);
+    old.list_size = 0;
+}
+
+/* data_seq in the order they arrive, the lost ones left out */
+static uint64_t
+bench_arrivals(uint64_t *seqs, uint64_t n, int skew, double loss)
+{
+    uint64_t a = 1, b = 2 + 2 * (uint64_t)skew, count = 0, seq;
+    uint64_t rnd = 88172645463325252ULL;
+
+    /* the first link has the odd ones, the second the even ones, sent in
+     * turns and the second's arriving skew turns late */
+    while (count < n) {
+        if (a < b) {
+            seq = a;
+            a += 2;
+        } else {
+            seq = b - 2 * (uint64_t)skew;
+            b += 2;
+        }
+        rnd ^= rnd << 13;
+        rnd ^= rnd >> 7;
+        rnd ^= rnd << 17;
+        if ((rnd % 1000000) < loss * 10000)
+            continue;
+        seqs[count++] = seq;
+    }
+    return count;
+}
+
+static double
+bench_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double
+bench_run(int slots, uint64_t *seqs, uint64_t n, uint64_t *got)
+{
+    ubond_tunnel_t tun = { .name = "bench" };
+    double start;
+    uint64_t i;
+
+    delivered = misordered = next_seq = 0;
+    if (slots)
+        ubond_reorder_reset();
+    else
+        old.min_seqn = 1;
+    start = bench_now();
+    for (i = 0; i < n; i++) {
+        if (slots)
+            ubond_reorder_insert(&tun, bench_pkt(seqs[i]));
+        else
+            old_insert(bench_pkt(seqs[i]));
+    }
+    start = bench_now() - start;
+    if (slots)
+        ubond_reorder_reset();
+    else
+        old_flush();
+    if (misordered) {
+        fprintf(stderr, "%"PRIu64" packets delivered out of order\n",
+                misordered);
+        exit(1);
+    }
+    *got = delivered;
+    return start * 1e9 / n;
+}
+
+int
+main(int argc, char **argv)
+{
+    static const int skews[] = { 0, 16, 128, 900 };
+    static const double losses[] = { 0, 1, 5 };
+    uint64_t n = 1 << 20, count, got_old, got_new;
+    uint64_t *seqs;
+    double t_old, t_new;
+    size_t s, l;
+
+    if (argc > 1)
+        n = strtoull(argv[1], NULL, 10);
+    if (!n) {
+        fprintf(stderr, "usage: %s [packets]\n", argv[0]);
+        return 1;
+    }
+    if (!(seqs = calloc(n, sizeof(*seqs))))
+        fatal(NULL, "out of memory");
+    log_init(1, 0, "reorder_bench");
+    loop = ev_default_loop(0);
+    LIST_INIT(&rtuns);
+    UBOND_TAILQ_INIT(&old.list);
+    ubond_reorder_init();
+    ubond_reorder_enable();
+
+    printf("%6s %6s %12s %12s %8s %12s\n", "loss%", "skew",
+           "list ns/pkt", "slot ns/pkt", "speedup", "delivered");
+    for (l = 0; l < sizeof(losses) / sizeof(losses[0]); l++) {
+        for (s = 0; s < sizeof(skews) / sizeof(skews[0]); s++) {
+            count = bench_arrivals(seqs, n, skews[s], losses[l]);
+            t_old = bench_run(0, seqs, count, &got_old);
+            t_new = bench_run(1, seqs, count, &got_new);
+            printf("%6.1f %6d %12.1f %12.1f %7.1fx %12"PRIu64"%s\n",
+                   losses[l], skews[s], t_old, t_new, t_old / t_new, got_new,
+                   got_old == got_new ? "" : " (list delivered a different count)");
+        }
+    }
+    free(seqs);
+    return 0;
+}
@@ -17,8 +17,9 @@
 this file needs re-working in line with the linux version.
 
 int
-ubond_tuntap_read(struct tuntap_s *tuntap)
+ubond_tuntap_read(struct tuntap_s *tuntap, int q)
 {
+    int fd = tuntap->qfd[q];
     ssize_t ret;
     u_char data[DEFAULT_MTU];
     struct iovec iov[2];
@@ -28,7 +29,7 @@ ubond_tuntap_read(struct tuntap_s *tuntap)
     iov[0].iov_len = sizeof(type);
     iov[1].iov_base = &data;
     iov[1].iov_len = tuntap->maxmtu;
-    ret = readv(tuntap->fd, iov, 2);
+    ret = readv(fd, iov, 2);
     if (ret < 0) {
         if (errno != EAGAIN && errno != EWOULDBLOCK) {
             /* read error on tuntap is not recoverable. We must die. */
@@ -102,7 +103,7 @@ ubond_tuntap_alloc(struct tuntap_s *tuntap)
         snprintf(tuntap->devname, sizeof(tuntap->devname), "/dev/%s", devname);
 
         if ((fd = priv_open_tun(tuntap->type,
-                tuntap->devname, tuntap->maxmtu)) > 0 )
+                tuntap->devname, tuntap->maxmtu, 0)) > 0 )
             break;
     }
 
@@ -115,6 +116,8 @@ ubond_tuntap_alloc(struct tuntap_s *tuntap)
         return fd;
     }
     tuntap->fd = fd;
+    tuntap->queues = 1;
+    tuntap->qfd[0] = fd;
 
     /* geting the actual tun%d inside devname
      * is required for hooks to work properly */
@@ -130,7 +133,7 @@ ubond_tuntap_alloc(struct tuntap_s *tuntap)
  * Compatibility: BSD
  */
 int
-root_tuntap_open(int tuntapmode, char *devname, int mtu)
+root_tuntap_open(int tuntapmode, char *devname, int mtu, int flags)
 {
     int fd;
 
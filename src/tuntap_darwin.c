@@ -12,11 +12,12 @@
 this file needs re-working in line with the linux version.
 
 int
-ubond_tuntap_read(struct tuntap_s *tuntap)
+ubond_tuntap_read(struct tuntap_s *tuntap, int q)
 {
+    int fd = tuntap->qfd[q];
     ssize_t ret;
     u_char data[DEFAULT_MTU];
-    ret = read(tuntap->fd, &data, tuntap->maxmtu);
+    ret = read(fd, &data, tuntap->maxmtu);
     if (ret < 0) {
         if (errno != EAGAIN && errno != EWOULDBLOCK) {
             /* read error on tuntap is not recoverable. We must die. */
@@ -79,7 +80,7 @@ ubond_tuntap_alloc(struct tuntap_s *tuntap)
         snprintf(tuntap->devname, sizeof(tuntap->devname), "/dev/%s", devname);
 
         if ((fd = priv_open_tun(tuntap->type,
-                tuntap->devname, tuntap->maxmtu)) > 0 )
+                tuntap->devname, tuntap->maxmtu, 0)) > 0 )
             break;
     }
 
@@ -92,6 +93,8 @@ ubond_tuntap_alloc(struct tuntap_s *tuntap)
         return fd;
     }
     tuntap->fd = fd;
+    tuntap->queues = 1;
+    tuntap->qfd[0] = fd;
 
     strlcpy(tuntap->devname, devname, sizeof(tuntap->devname));
     return tuntap->fd;
@@ -105,7 +108,7 @@ ubond_tuntap_alloc(struct tuntap_s *tuntap)
  * Compatibility: Darwin
  */
 int
-root_tuntap_open(int tuntapmode, char *devname, int mtu)
+root_tuntap_open(int tuntapmode, char *devname, int mtu, int flags)
 {
     int fd;
 
@@ -15,24 +15,54 @@
 #include "privsep.h"
 #include "ubond.h"
 
+/* Maximum number of IFF_MULTI_QUEUE queues attached to the device */
+#define UBOND_TUN_QUEUES_MAX 16
+/* Maximum number of packets read from the device on each wakeup */
+#define UBOND_TUN_READ_BATCH_MAX 256
+
+/* flags for priv_open_tun() */
+#define UBOND_TUN_F_MULTIQUEUE 0x01 /* IFF_MULTI_QUEUE */
+#define UBOND_TUN_F_VNET_HDR   0x02 /* IFF_VNET_HDR + TSO/checksum offload */
+
 enum tuntap_type {
     UBOND_TUNTAPMODE_TUN,
     UBOND_TUNTAPMODE_TAP
 };
 
+/* Read side of a queue: only touched by whoever reads the queue, the
+ * event loop or the queue's worker thread */
+struct tuntap_queue
+{
+    ubond_pkt_t *spare;              /* packet the next read goes into */
+    ubond_pkt_list_t rbuf;           /* segments left over from a read */
+    char *tso_buf;                   /* super-packet being segmented */
+    uint64_t tso_reads;              /* super-packets read from the device */
+    uint64_t tso_segments;           /* frames cut out of them */
+    uint64_t read_wakeups;           /* read events handled */
+    uint64_t read_packets;           /* packets read during those */
+} __attribute__((aligned(64)));
+
 struct tuntap_s
 {
-    int fd;
+    int fd;                          /* queue 0, also used for writes */
+    int queues;                      /* number of queues (1: single queue) */
+    int workers;                     /* threads reading them, see worker.c */
+    int qfd[UBOND_TUN_QUEUES_MAX];
     int maxmtu;
     char devname[UBOND_IFNAMSIZ];
     enum tuntap_type type;
-  ubond_pkt_list_t sbuf; // no longer used
-    ev_io io_read;
+    ubond_pkt_ring_t sbuf;           /* packets to write to the device */
+    int offload;                     /* virtio_net_hdr on every frame */
+    uint64_t gro_writes;             /* super-packets written to the device */
+    uint64_t gro_segments;           /* frames merged into them */
+    int read_batch;                  /* packets read per wakeup, at most */
+    struct tuntap_queue q[UBOND_TUN_QUEUES_MAX];
+    ev_io io_read[UBOND_TUN_QUEUES_MAX];
     ev_io io_write;
 };
 
 int ubond_tuntap_alloc(struct tuntap_s *tuntap);
-ubond_pkt_t *ubond_tuntap_read(struct tuntap_s *tuntap);
+ubond_pkt_t *ubond_tuntap_read(struct tuntap_s *tuntap, int q);
 int ubond_tuntap_write(struct tuntap_s *tuntap, ubond_pkt_t *pkt);
 int ubond_tuntap_generic_read(u_char *data, uint32_t len);
 
@@ -6,18 +6,227 @@
 #include <netdb.h>
 #include <linux/if_tun.h>
 #include <linux/if.h>
+#include <linux/virtio_net.h>
+#include <sys/uio.h>
 
 #include "tuntap_generic.h"
 #include "tool.h"
 #include "pkt.h"
 
-ubond_pkt_t *spair=NULL;
-ubond_pkt_t *ubond_tuntap_read(struct tuntap_s *tuntap)
+/* Largest frame the kernel hands over once TSO is enabled */
+#define TUNTAP_TSO_BUFSIZ 65536
+
+/* super-packet being built by the write coalescing */
+static char gro_buf[TUNTAP_TSO_BUFSIZ];
+
+/* one's complement sum of buf, as big endian 16 bit words */
+static uint32_t
+tuntap_csum_add(uint32_t sum, const uint8_t *buf, size_t len)
+{
+    size_t i;
+    for (i = 0; i + 1 < len; i += 2)
+        sum += (buf[i] << 8) | buf[i + 1];
+    if (len & 1)
+        sum += buf[len - 1] << 8;
+    return sum;
+}
+
+static uint16_t
+tuntap_csum_fold(uint32_t sum)
+{
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return (uint16_t)~sum;
+}
+
+static void
+tuntap_csum_store(uint8_t *where, uint16_t csum)
+{
+    where[0] = csum >> 8;
+    where[1] = csum & 0xff;
+}
+
+/*
+ * Cut a TCP super-packet (IPv4 or IPv6, no extension headers) into
+ * segments of gso_size payload bytes. The first segment goes into first,
+ * the others into pool packets queued on tq->rbuf.
+ * Returns the number of segments, 0 if the packet had to be dropped.
+ */
+static int
+tuntap_tso_segment(struct tuntap_queue *tq, ubond_pkt_t *first,
+                   uint8_t *data, size_t len, size_t mss)
+{
+    size_t iphl, thl, hlen, payload, off, seglen;
+    uint8_t *ip, *tcp;
+    uint32_t seq, sum;
+    uint16_t id = 0;
+    int version, nseg = 0;
+    ubond_pkt_t *pkt;
+
+    if (len < 20)
+        return 0;
+    version = data[0] >> 4;
+    if (version == 4) {
+        iphl = (data[0] & 0x0f) * 4;
+        if (data[9] != IPPROTO_TCP || iphl < 20)
+            return 0;
+        id = (data[4] << 8) | data[5];
+    } else if (version == 6) {
+        iphl = 40;
+        if (data[6] != IPPROTO_TCP)
+            return 0;
+    } else {
+        return 0;
+    }
+    if (len < iphl + 20)
+        return 0;
+    thl = (data[iphl + 12] >> 4) * 4;
+    hlen = iphl + thl;
+    if (thl < 20 || len < hlen || mss == 0 ||
+            hlen + mss > first->room)
+        return 0;
+    seq = ((uint32_t)data[iphl + 4] << 24) | (data[iphl + 5] << 16) |
+          (data[iphl + 6] << 8) | data[iphl + 7];
+
+    payload = len - hlen;
+    for (off = 0; off < payload || nseg == 0; off += seglen) {
+        seglen = payload - off;
+        if (seglen > mss)
+            seglen = mss;
+        if (! (pkt = nseg ? ubond_pkt_get_size(hlen + seglen) : first))
+            break; /* out of packets, TCP resends the tail */
+        ip = (uint8_t *)pkt->p.data;
+        tcp = ip + iphl;
+        memcpy(ip, data, hlen);
+        memcpy(ip + hlen, data + hlen + off, seglen);
+
+        if (version == 4) {
+            ip[2] = (hlen + seglen) >> 8;
+            ip[3] = (hlen + seglen) & 0xff;
+            ip[4] = (uint16_t)(id + nseg) >> 8;
+            ip[5] = (uint16_t)(id + nseg) & 0xff;
+            ip[10] = ip[11] = 0;
+            tuntap_csum_store(ip + 10,
+                tuntap_csum_fold(tuntap_csum_add(0, ip, iphl)));
+            /* pseudo header: addresses, protocol, TCP length */
+            sum = tuntap_csum_add(0, ip + 12, 8);
+        } else {
+            ip[4] = (thl + seglen) >> 8;
+            ip[5] = (thl + seglen) & 0xff;
+            sum = tuntap_csum_add(0, ip + 8, 32);
+        }
+        sum += IPPROTO_TCP + thl + seglen;
+
+        tcp[4] = (seq + off) >> 24;
+        tcp[5] = ((seq + off) >> 16) & 0xff;
+        tcp[6] = ((seq + off) >> 8) & 0xff;
+        tcp[7] = (seq + off) & 0xff;
+        /* CWR only on the first segment, FIN and PSH only on the last */
+        if (nseg > 0)
+            tcp[13] &= ~0x80;
+        if (off + seglen < payload)
+            tcp[13] &= ~0x09;
+        tcp[16] = tcp[17] = 0;
+        tuntap_csum_store(tcp + 16,
+            tuntap_csum_fold(tuntap_csum_add(sum, tcp, thl + seglen)));
+
+        pkt->p.len = hlen + seglen;
+        pkt->p.type = UBOND_PKT_DATA;
+        if (nseg > 0)
+            UBOND_TAILQ_INSERT_HEAD(&tq->rbuf, pkt);
+        nseg++;
+    }
+    return nseg;
+}
+
+/*
+ * Read a frame preceded by a virtio_net_hdr. Small frames land directly in
+ * the pool packet, super-packets spill into the tso_buf of the queue and
+ * are segmented.
+ * Returns the frame length in p, or -2 when the frame was dropped.
+ */
+static ssize_t
+tuntap_read_vnet(struct tuntap_s *tuntap, int q, ubond_pkt_t *p)
 {
-  if (!spair) spair=ubond_pkt_get();
-  ubond_pkt_t *p=spair;
+    struct tuntap_queue *tq = &tuntap->q[q];
+    char *tso_buf = tq->tso_buf;
+    struct virtio_net_hdr vh;
+    struct iovec iov[3];
+    uint8_t *data;
+    size_t len;
+    ssize_t ret;
+    int nseg;
+
+    iov[0].iov_base = &vh;
+    iov[0].iov_len = sizeof(vh);
+    iov[1].iov_base = p->p.data;
+    iov[1].iov_len = p->room;
+    iov[2].iov_base = tso_buf + p->room;
+    iov[2].iov_len = TUNTAP_TSO_BUFSIZ - p->room;
+    ret = readv(tuntap->qfd[q], iov, 3);
+    if (ret <= 0)
+        return ret;
+    if ((size_t)ret < sizeof(vh)) {
+        log_warnx("tuntap", "%s short read (%zd bytes)",
+                  tuntap->devname, ret);
+        return -2;
+    }
+    len = ret - sizeof(vh);
+
+    if ((vh.gso_type & ~VIRTIO_NET_HDR_GSO_ECN) == VIRTIO_NET_HDR_GSO_NONE) {
+        if (len > p->room) {
+            log_warnx("tuntap", "%s dropped oversized frame (%zu bytes)",
+                      tuntap->devname, len);
+            return -2;
+        }
+        data = (uint8_t *)p->p.data;
+        /* checksum left to us: the field holds the pseudo header sum */
+        if ((vh.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) &&
+                vh.csum_start + vh.csum_offset + 2 <= len) {
+            uint8_t *field = data + vh.csum_start + vh.csum_offset;
+            tuntap_csum_store(field, tuntap_csum_fold(tuntap_csum_add(0,
+                data + vh.csum_start, len - vh.csum_start)));
+        }
+        return len;
+    }
+
+    /* make the super-packet contiguous */
+    memcpy(tso_buf, p->p.data, p->room);
+    data = (uint8_t *)tso_buf;
+    nseg = 0;
+    if ((vh.gso_type & ~VIRTIO_NET_HDR_GSO_ECN) == VIRTIO_NET_HDR_GSO_TCPV4 ||
+            (vh.gso_type & ~VIRTIO_NET_HDR_GSO_ECN) == VIRTIO_NET_HDR_GSO_TCPV6)
+        nseg = tuntap_tso_segment(tq, p, data, len, vh.gso_size);
+    if (nseg == 0) {
+        log_warnx("tuntap", "%s dropped unsupported super-packet "
+                  "(type %d, %zu bytes)", tuntap->devname, vh.gso_type, len);
+        return -2;
+    }
+    tq->tso_reads++;
+    tq->tso_segments += nseg;
+    return p->p.len;
+}
+
+/* Read a frame from queue q, segments past the first one are left on the
+ * queue's rbuf. Only one thread may read a given queue. */
+ubond_pkt_t *ubond_tuntap_read(struct tuntap_s *tuntap, int q)
+{
+  struct tuntap_queue *tq = &tuntap->q[q];
+  if (!tq->spare && !(tq->spare=ubond_pkt_get_size(tuntap->maxmtu))) {
+    /* out of packets: drop the frame rather than spin on a readable fd */
+    if (read(tuntap->qfd[q], tq->tso_buf, TUNTAP_TSO_BUFSIZ) > 0)
+      log_debug("tuntap", "%s out of packets, frame dropped", tuntap->devname);
+    return NULL;
+  }
+  ubond_pkt_t *p=tq->spare;
   ssize_t ret;
-  ret = read(tuntap->fd, &(p->p.data), DEFAULT_MTU);
+  if (tuntap->offload) {
+    ret = tuntap_read_vnet(tuntap, q, p);
+    if (ret == -2) /* dropped, keep the spare packet */
+      return NULL;
+  } else {
+    ret = read(tuntap->qfd[q], &(p->p.data), p->room);
+  }
   
   if (ret<0 && (errno==EAGAIN || errno==EWOULDBLOCK)) {
     return NULL;
@@ -36,36 +245,215 @@ ubond_pkt_t *ubond_tuntap_read(struct tuntap_s *tuntap)
   }
   log_debug("tuntap", "%s < recv %zd bytes",
             tuntap->devname, ret);
-  spair=NULL; // we've used this one now.
+  tq->spare=NULL; // we've used this one now.
   p->p.len=ret; // data length
   p->p.type=UBOND_PKT_DATA;
 
-  return p;
+  /* most reads are ACKs, don't keep them in MTU sized packets */
+  return ubond_pkt_shrink(p);
+}
+
+/* TCP header length if pkt is a plain TCP segment we may merge, else 0 */
+static size_t
+tuntap_tcp_hlen(ubond_pkt_t *pkt, size_t *iphl)
+{
+    uint8_t *ip = (uint8_t *)pkt->p.data;
+    size_t len = pkt->p.len;
+    size_t thl;
+
+    if (len < 20)
+        return 0;
+    if ((ip[0] >> 4) == 4) {
+        *iphl = (ip[0] & 0x0f) * 4;
+        /* fragments are never merged */
+        if (ip[9] != IPPROTO_TCP || *iphl < 20 ||
+                (((ip[6] & 0x3f) << 8) | ip[7]) != 0)
+            return 0;
+    } else if ((ip[0] >> 4) == 6) {
+        *iphl = 40;
+        if (ip[6] != IPPROTO_TCP)
+            return 0;
+    } else {
+        return 0;
+    }
+    if (len < *iphl + 20)
+        return 0;
+    thl = (ip[*iphl + 12] >> 4) * 4;
+    if (thl < 20 || len < *iphl + thl)
+        return 0;
+    /* only pure ACK (+PSH) segments carry on a stream */
+    if (ip[*iphl + 13] & ~(0x10 | 0x08))
+        return 0;
+    return thl;
+}
+
+static uint32_t
+tuntap_tcp_seq(uint8_t *tcp)
+{
+    return ((uint32_t)tcp[4] << 24) | (tcp[5] << 16) | (tcp[6] << 8) | tcp[7];
+}
+
+/*
+ * Can next follow cur inside one super-packet ? Same addresses, same
+ * IP/TCP headers except sequence, checksum and PSH, and contiguous data.
+ */
+static int
+tuntap_can_merge(uint8_t *cur, size_t cur_payload, ubond_pkt_t *next,
+                 size_t iphl, size_t thl)
+{
+    uint8_t *ip = (uint8_t *)next->p.data;
+    uint8_t *tcp = ip + iphl;
+    uint8_t *ctcp = cur + iphl;
+    size_t niphl;
+
+    if (tuntap_tcp_hlen(next, &niphl) != thl || niphl != iphl)
+        return 0;
+    if ((ip[0] >> 4) == 4) {
+        if (ip[1] != cur[1] || (ip[6] & 0x40) != (cur[6] & 0x40) ||
+                ip[8] != cur[8] ||
+                memcmp(ip + 12, cur + 12, 8) != 0)
+            return 0;
+    } else {
+        if (memcmp(ip, cur, 4) != 0 || ip[7] != cur[7] ||
+                memcmp(ip + 8, cur + 8, 32) != 0)
+            return 0;
+    }
+    if (memcmp(tcp, ctcp, 4) != 0 || memcmp(tcp + 8, ctcp + 8, 5) != 0 ||
+            memcmp(tcp + 14, ctcp + 14, 2) != 0 ||
+            memcmp(tcp + 18, ctcp + 18, thl - 18) != 0)
+        return 0;
+    return tuntap_tcp_seq(tcp) == tuntap_tcp_seq(ctcp) + cur_payload;
+}
+
+/*
+ * Merge pkt with the in-order segments of the same TCP flow queued right
+ * behind it on tuntap->sbuf, and write them as one GSO frame the kernel
+ * will treat like a GRO'd packet.
+ * Returns the number of segments consumed (pkt included), 0 when pkt
+ * could not start a super-packet.
+ */
+static int
+tuntap_write_coalesced(struct tuntap_s *tuntap, ubond_pkt_t *pkt)
+{
+    struct virtio_net_hdr vh;
+    struct iovec iov[2];
+    ubond_pkt_t *next;
+    size_t iphl, thl, hlen, mss, payload, total;
+    uint8_t *buf = (uint8_t *)gro_buf;
+    uint8_t *last_tcp;
+    uint32_t sum;
+    ssize_t ret;
+    int nseg = 1;
+
+    thl = tuntap_tcp_hlen(pkt, &iphl);
+    if (!thl)
+        return 0;
+    hlen = iphl + thl;
+    mss = pkt->p.len - hlen;
+    next = ubond_pkt_ring_peek(&tuntap->sbuf);
+    if (mss == 0 || !next)
+        return 0;
+
+    memcpy(buf, pkt->p.data, pkt->p.len);
+    total = pkt->p.len;
+    payload = mss;
+    last_tcp = (uint8_t *)pkt->p.data + iphl;
+    while (next &&
+           (last_tcp[13] & 0x08) == 0 &&
+           total + mss <= 65535 &&
+           tuntap_can_merge(buf, payload, next, iphl, thl)) {
+        size_t seglen = next->p.len - hlen;
+        if (seglen == 0 || seglen > mss)
+            break;
+        memcpy(buf + total, next->p.data + hlen, seglen);
+        total += seglen;
+        payload += seglen;
+        last_tcp = (uint8_t *)next->p.data + iphl;
+        /* PSH of the last segment stays on the super-packet */
+        buf[iphl + 13] |= last_tcp[13] & 0x08;
+        ubond_pkt_release(ubond_pkt_ring_get(&tuntap->sbuf));
+        nseg++;
+        if (seglen < mss)
+            break;
+        next = ubond_pkt_ring_peek(&tuntap->sbuf);
+    }
+    if (nseg == 1)
+        return 0;
+
+    memset(&vh, 0, sizeof(vh));
+    vh.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+    vh.hdr_len = hlen;
+    vh.gso_size = mss;
+    vh.csum_start = iphl;
+    vh.csum_offset = 16;
+    if ((buf[0] >> 4) == 4) {
+        vh.gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+        buf[2] = total >> 8;
+        buf[3] = total & 0xff;
+        buf[10] = buf[11] = 0;
+        tuntap_csum_store(buf + 10,
+            tuntap_csum_fold(tuntap_csum_add(0, buf, iphl)));
+        sum = tuntap_csum_add(0, buf + 12, 8);
+    } else {
+        vh.gso_type = VIRTIO_NET_HDR_GSO_TCPV6;
+        buf[4] = (total - iphl) >> 8;
+        buf[5] = (total - iphl) & 0xff;
+        sum = tuntap_csum_add(0, buf + 8, 32);
+    }
+    /* partial checksum: the pseudo header sum, not inverted */
+    sum += IPPROTO_TCP + total - iphl;
+    tuntap_csum_store(buf + iphl + 16, ~tuntap_csum_fold(sum));
+
+    iov[0].iov_base = &vh;
+    iov[0].iov_len = sizeof(vh);
+    iov[1].iov_base = buf;
+    iov[1].iov_len = total;
+    ret = writev(tuntap->fd, iov, 2);
+    ubond_pkt_release(pkt);
+    if (ret < 0) {
+        log_warn("tuntap", "%s write error", tuntap->devname);
+    } else {
+        tuntap->gro_writes++;
+        tuntap->gro_segments += nseg;
+        log_debug("tuntap", "%s > sent %zu bytes in %d segments",
+           tuntap->devname, total, nseg);
+    }
+    return nseg;
 }
 
 int
 ubond_tuntap_write(struct tuntap_s *tuntap, ubond_pkt_t *pkt)
 {
     ssize_t ret;
-//    ubond_pkt_t *pkt;
-
-//    /* Safety checks */
-//    if (UBOND_TAILQ_EMPTY(&tuntap->sbuf)) {
-//      log_warnx("tuntap","tuntap_write called with empty buffer");
-//      return -1;
-//    }
-    
-//    pkt = UBOND_TAILQ_POP_LAST(&tuntap->sbuf);
-    ret = write(tuntap->fd, pkt->p.data, pkt->p.len);
+    size_t len = pkt->p.len;
+    struct virtio_net_hdr vh;
+    struct iovec iov[2];
+
+    if (tuntap->offload) {
+        if (tuntap_write_coalesced(tuntap, pkt) > 0)
+            return len;
+        /* nothing to offload: complete frame, checksums already valid */
+        memset(&vh, 0, sizeof(vh));
+        vh.gso_type = VIRTIO_NET_HDR_GSO_NONE;
+        iov[0].iov_base = &vh;
+        iov[0].iov_len = sizeof(vh);
+        iov[1].iov_base = pkt->p.data;
+        iov[1].iov_len = len;
+        ret = writev(tuntap->fd, iov, 2);
+        if (ret > 0)
+            ret -= sizeof(vh);
+    } else {
+        ret = write(tuntap->fd, pkt->p.data, len);
+    }
     ubond_pkt_release(pkt);
     if (ret < 0)
     {
         log_warn("tuntap", "%s write error", tuntap->devname);
     } else {
-        if (ret != pkt->p.len)
+        if (ret != len)
         {
-            log_warnx("tuntap", "%s write error: %zd/%d bytes sent",
-               tuntap->devname, ret, pkt->len);
+            log_warnx("tuntap", "%s write error: %zd/%zu bytes sent",
+               tuntap->devname, ret, len);
         } else {
             log_debug("tuntap", "%s > sent %zd bytes",
                tuntap->devname, ret);
@@ -77,13 +465,26 @@ ubond_tuntap_write(struct tuntap_s *tuntap, ubond_pkt_t *pkt)
 int
 ubond_tuntap_alloc(struct tuntap_s *tuntap)
 {
-    int fd;
+    int fd, i;
 
-    if ((fd = priv_open_tun(tuntap->type,
-                            tuntap->devname, tuntap->maxmtu)) <= 0 )
-        fatalx("failed to open /dev/net/tun read/write");
-    tuntap->fd = fd;
-    return fd;
+    if (tuntap->queues < 1)
+        tuntap->queues = 1;
+    /* every queue after the first attaches to the device created
+     * by the first call, so devname must be the one the kernel chose */
+    for (i = 0; i < tuntap->queues; i++) {
+        if ((fd = priv_open_tun(tuntap->type,
+                                tuntap->devname, tuntap->maxmtu,
+                                (tuntap->queues > 1 ?
+                                   UBOND_TUN_F_MULTIQUEUE : 0) |
+                                (tuntap->offload ?
+                                   UBOND_TUN_F_VNET_HDR : 0))) <= 0 )
+            fatalx("failed to open /dev/net/tun read/write");
+        tuntap->qfd[i] = fd;
+        if (! (tuntap->q[i].tso_buf = malloc(TUNTAP_TSO_BUFSIZ)))
+            fatal("tuntap", "malloc failed");
+    }
+    tuntap->fd = tuntap->qfd[0];
+    return tuntap->fd;
 }
 
 /* WARNING: called as root
@@ -94,7 +495,7 @@ ubond_tuntap_alloc(struct tuntap_s *tuntap)
  * Compatibility: Linux 2.4+
  */
 int
-root_tuntap_open(int tuntapmode, char *devname, int mtu)
+root_tuntap_open(int tuntapmode, char *devname, int mtu, int flags)
 {
     struct ifreq ifr;
     int fd, sockfd;
@@ -112,6 +513,16 @@ root_tuntap_open(int tuntapmode, char *devname, int mtu)
         /* We do not want kernel packet info (IFF_NO_PI) */
         ifr.ifr_flags |= IFF_NO_PI;
 
+        /* Each open of a multi-queue device with the same name adds
+         * a queue; the kernel spreads flows across them (Linux 3.8+) */
+        if (flags & UBOND_TUN_F_MULTIQUEUE)
+            ifr.ifr_flags |= IFF_MULTI_QUEUE;
+
+        /* Every frame carries a virtio_net_hdr describing
+         * the segmentation and checksum work left to us */
+        if (flags & UBOND_TUN_F_VNET_HDR)
+            ifr.ifr_flags |= IFF_VNET_HDR;
+
         /* Allocate with specified name, otherwise the kernel
          * will find a name for us. */
         if (*devname)
@@ -128,8 +539,16 @@ root_tuntap_open(int tuntapmode, char *devname, int mtu)
             return -1;
         }
 
-        int flags = fcntl(fd, F_GETFL, 0);
-        fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+        if ((flags & UBOND_TUN_F_VNET_HDR) &&
+                ioctl(fd, TUNSETOFFLOAD,
+                      TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6 | TUN_F_TSO_ECN) < 0)
+        {
+            /* frames still carry the header, just never merged */
+            warn("tun %s offload setup failed", devname);
+        }
+
+        int fl = fcntl(fd, F_GETFL, 0);
+        fcntl(fd, F_SETFL, fl | O_NONBLOCK);
 
         /* set tun MTU */
         if ((sockfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
@@ -23,6 +23,8 @@
  * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
+#include "includes.h"
+
 #include <stdint.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -45,9 +47,10 @@
 #include <netdb.h>
 #include <ev.h>
 
-#include "includes.h"
 #include "ubond.h"
 #include "tool.h"
+#include "classify.h"
+#include "linksched.h"
 #include "setproctitle.h"
 #include "crypto.h"
 #ifdef ENABLE_CONTROL
@@ -58,7 +61,16 @@
 /* Linux specific things */
 #ifdef HAVE_LINUX
 #include <sys/prctl.h>
+#include <netinet/udp.h>
 #include "systemd.h"
+#include "worker.h"
+#endif
+#ifdef HAVE_IO_URING
+#include <sys/eventfd.h>
+#include "uring.h"
+#endif
+#ifdef HAVE_AF_XDP
+#include "xdp.h"
 #endif
 
 #ifdef HAVE_FREEBSD
@@ -87,7 +99,10 @@ char *status_command = NULL;
 char *process_title = NULL;
 int logdebug = 0;
 
-static uint64_t data_seq = 1;
+static uint64_t data_seq[UBOND_REORDER_FLOWS_MAX]; /* last sent, per flow group */
+#ifdef HAVE_LINUX
+static int tuntap_paused = 0; /* send_buffer is full, the workers wait */
+#endif
 uint64_t bandwidthdata=0;
 double bandwidth=0;
 uint64_t out_resends=0;
@@ -96,25 +111,6 @@ double srtt_av;
 double srtt_min=1;
 double srtt_max=1;
 
-ubond_pkt_list_t pool;
-uint64_t pool_out=0;
-ubond_pkt_t *ubond_pkt_get()
-{
-  ubond_pkt_t *p;
-  if (!UBOND_TAILQ_EMPTY(&pool)) {
-    p = UBOND_TAILQ_FIRST(&pool);
-    UBOND_TAILQ_REMOVE(&pool, p);
-  } else {
-    p=malloc(sizeof (struct ubond_pkt_t));
-  }
-  pool_out++;
-  return p;
-};
-void ubond_pkt_release(ubond_pkt_t *p)
-{
-  pool_out--;
-  UBOND_TAILQ_INSERT_HEAD(&pool, p);
-}
 void ubond_pkt_insert(ubond_pkt_list_t *list, ubond_pkt_t *pkt) 
 {
   if (list->length >= list->max_size) {
@@ -122,10 +118,6 @@ void ubond_pkt_insert(ubond_pkt_list_t *list, ubond_pkt_t *pkt)
   }
   UBOND_TAILQ_INSERT_HEAD(list, pkt);
 }
-int ubond_pkt_list_is_full(ubond_pkt_list_t *list)
-{
-  return (list->length >= list->max_size);
-}
 void ubond_pkt_list_init(ubond_pkt_list_t *list, uint64_t size)
 {
   UBOND_TAILQ_INIT(list);
@@ -135,21 +127,95 @@ void ubond_pkt_list_init(ubond_pkt_list_t *list, uint64_t size)
   
 #define LOSS_TOLERENCE 31.0
 #define BANDWIDTHCALCTIME 0.1
+/* With kernel pacing, what is due over the next PACING_AHEAD seconds is
+ * handed to the kernel at once, which sends it at HEADROOM times the link
+ * rate so that the burst drains before the next one */
+#define UBOND_PACING_AHEAD 0.005
+#define UBOND_PACING_HEADROOM 1.1
+/* How soon a link which could not send, or left the waiting packets to
+ * another link, looks again */
+#define UBOND_PACER_RETRY 0.002
 static ev_timer bandwidth_calc_timer;
 
 
-ubond_pkt_list_t send_buffer;    /* send buffer */
-ubond_pkt_list_t hpsend_buffer;    /* send buffer */
+ubond_pkt_ring_t send_buffer;    /* send buffer */
+ubond_pkt_ring_t hpsend_buffer;    /* send buffer */
+
+#ifdef HAVE_IO_URING
+/* io_uring backend state, see ubond_uring_setup() */
+#define UBOND_URING_ENTRIES 1024
+#define UBOND_URING_RX_BUFS 512    /* tunnel socket reads (pool packets) */
+#define UBOND_URING_TUN_BUFS 256   /* TUN read buffers (pool packets) */
+#define UBOND_URING_TX_SLOTS 512   /* tunnel sends in flight */
+#define UBOND_URING_BGID_RTUN 0
+#define UBOND_URING_BGID_TUN 1
+
+/* user_data carries the operation in its top byte */
+enum {
+    UBOND_URING_NOP,
+    UBOND_URING_RTUN_RECV,
+    UBOND_URING_RTUN_SEND,
+    UBOND_URING_TUN_READ,
+    UBOND_URING_TUN_WRITE
+};
+#define UBOND_URING_DATA(op, ptr) \
+    (((uint64_t)(op) << 56) | (uint64_t)(uintptr_t)(ptr))
+#define UBOND_URING_OP(data) ((int)((data) >> 56))
+#define UBOND_URING_PTR(data) ((void *)(uintptr_t)((data) & ((1ULL << 56) - 1)))
+
+/* multishot recvmsg fills a buffer with io_uring_recvmsg_out, the source
+ * address, then the datagram: the buffer starts UBOND_PKT_HEADROOM bytes
+ * before the p member of a pool packet, the address gets what the header
+ * leaves of it */
+#define UBOND_URING_RX_NAMELEN \
+    (UBOND_PKT_HEADROOM - sizeof(struct io_uring_recvmsg_out))
+#define UBOND_URING_RX_BUF(pkt) ((char *)&(pkt)->p - UBOND_PKT_HEADROOM)
+
+struct ubond_uring_tx
+{
+    ubond_proto_t wire;
+    struct sockaddr_storage addr;
+    struct iovec iov;
+    struct msghdr msg;
+    ubond_tunnel_t *tun;
+    int type;
+    struct ubond_uring_tx *next;
+};
+
+static struct ubond_uring uring;
+static int uring_on = 0;
+static int uring_tun_read = 0;  /* TUN reads go through the ring */
+static int uring_tun_armed[UBOND_TUN_QUEUES_MAX];
+static struct ubond_uring_bufring uring_rx_br;
+static struct ubond_uring_bufring uring_tun_br;
+static ubond_pkt_t *uring_rx_pkts[UBOND_URING_RX_BUFS];
+static size_t uring_rx_room;    /* payload room of uring_rx_pkts */
+static ubond_pkt_t *uring_tun_pkts[UBOND_URING_TUN_BUFS];
+static struct ubond_uring_tx *uring_tx_slots = NULL;
+static struct ubond_uring_tx *uring_tx_free = NULL;
+static struct msghdr uring_rx_msg;
+static int uring_efd = -1;
+static ev_io uring_io;
+static ev_prepare uring_prepare;
+#endif
 
-void ubond_buffer_write(ubond_pkt_list_t *buffer, ubond_pkt_t *p)
+void ubond_buffer_write(ubond_pkt_ring_t *buffer, ubond_pkt_t *p)
 {
   if (p) {
     // record the eventual wire length needed
     bandwidthdata+=p->p.len + IP4_UDP_OVERHEAD + PKTHDRSIZ(p->p);
-    UBOND_TAILQ_INSERT_HEAD(buffer, p);
+    ubond_pkt_ring_put(buffer, p);
   }
 }
 
+static void ubond_buffer_write_n(ubond_pkt_ring_t *buffer, ubond_pkt_t **pkts, int n)
+{
+  int i;
+  for (i = 0; i < n; i++)
+    bandwidthdata+=pkts[i]->p.len + IP4_UDP_OVERHEAD + PKTHDRSIZ(pkts[i]->p);
+  ubond_pkt_ring_put_n(buffer, pkts, n);
+}
+
 struct resend_data
 {
   char r,s;
@@ -186,6 +252,11 @@ struct ubond_options_s ubond_options = {
     .cleartext_data = 1,
     .static_tunnel = 0,
     .root_allowed = 0,
+    .io_backend = UBOND_IO_BACKEND_LIBEV,
+    .pkt_pool_size = UBOND_PKT_POOL_SIZE,
+    .pkt_pool_max = UBOND_PKT_POOL_MAX,
+    .pkt_pool_flags = 0,
+    .reorder_flows = 1,
 };
 #ifdef HAVE_FILTERS
 struct ubond_filters_s ubond_filters = {
@@ -214,7 +285,6 @@ static void ubond_rtun_read(EV_P_ ev_io *w, int revents);
 static void ubond_rtun_write(EV_P_ ev_io *w, int revents);
 static void ubond_rtun_write_timeout(EV_P_ ev_timer *w, int revents);
 static void ubond_rtun_check_timeout(EV_P_ ev_timer *w, int revents);
-static void ubond_rtun_write_check(EV_P_ ev_check *w, int revents);
 static void ubond_rtun_send_keepalive(ev_tstamp now, ubond_tunnel_t *t);
 static void ubond_rtun_send_disconnect(ubond_tunnel_t *t);
 static int ubond_rtun_send(ubond_tunnel_t *tun, ubond_pkt_t *pkt);
@@ -229,7 +299,19 @@ static void ubond_update_status();
 static int ubond_rtun_bind(ubond_tunnel_t *t);
 static void update_process_title();
 static void ubond_tuntap_init();
+static void ubond_tuntap_read_start();
+static void ubond_tuntap_read_stop();
+static void ubond_tuntap_kick();
+#ifdef HAVE_IO_URING
+static ssize_t ubond_uring_rtun_send(ubond_tunnel_t *tun, ubond_pkt_t *pkt);
+static int ubond_uring_tun_write(ubond_pkt_t *pkt);
+static void ubond_uring_tun_arm(int q);
+#endif
+#ifdef HAVE_AF_XDP
+static ssize_t ubond_rtun_xdp_send(ubond_tunnel_t *tun, ubond_pkt_t *pkt);
+#endif
 static void ubond_rtun_choose(ubond_tunnel_t *rtun);
+static void ubond_hpsend_wake();
 static void ubond_rtun_check_lossy(ubond_tunnel_t *tun);
 static int
 ubond_protocol_read(ubond_tunnel_t *tun,
@@ -338,7 +420,11 @@ void ubond_rtun_tick(ubond_tunnel_t *tun) {
 /* Inject the packet to the tuntap device (real network) */
 void ubond_rtun_inject_tuntap(ubond_pkt_t *pkt)
 {
-  UBOND_TAILQ_INSERT_HEAD(&tuntap.sbuf, pkt);
+#ifdef HAVE_IO_URING
+  if (uring_on && !tuntap.offload && ubond_uring_tun_write(pkt) == 0)
+    return;
+#endif
+  ubond_pkt_ring_put(&tuntap.sbuf, pkt);
   /* Send the packet back into the LAN */
   if (!ev_is_active(&tuntap.io_write)) {
     ev_io_start(EV_A_ &tuntap.io_write);
@@ -346,15 +432,19 @@ void ubond_rtun_inject_tuntap(ubond_pkt_t *pkt)
 }
 
 
-/* Count the loss on the last 64 packets */
+/* Count the loss on the last 64 packets.
+ * data_seq is that of a data packet sent in sequence, 0 for anything else;
+ * once its tun_seq leaves the reorder window the link will not bring any
+ * data_seq before it, other than resends. */
 static void
-ubond_loss_update(ubond_tunnel_t *tun, uint64_t seq)
+ubond_loss_update(ubond_tunnel_t *tun, uint64_t seq, uint64_t data_seq)
 {
   if (seq >= tun->seq_last + 64) {
     /* consider a connection reset. */
     tun->seq_vect = (uint64_t) -1;
     tun->seq_last = seq;
     tun->loss_cnt=0;
+    memset(tun->data_seq_hist, 0, sizeof(*tun->data_seq_hist));
   } else if (seq > tun->seq_last) {
     /* new sequence number -- recent message arrive */
     int len=0;
@@ -371,6 +461,10 @@ ubond_loss_update(ubond_tunnel_t *tun, uint64_t seq)
           len=0;
         }
         start=i+1; // start again (maybe) at the next place, which MAY be a new hole.
+        uint64_t settled = tun->data_seq_hist->recv[(tun->seq_last+i-(tun->reorder_length+1)) % 64];
+        uint64_t *mark = &tun->data_seq_hist->settled[UBOND_REORDER_FLOW(settled) % UBOND_REORDER_FLOWS_MAX];
+        if (settled && aolderb(*mark, settled))
+          *mark = settled;
       }
       if (((tun->seq_vect & (1ul<<63))==0) && tun->loss_cnt>0) tun->loss_cnt--;
       tun->seq_vect<<=1;
@@ -381,7 +475,9 @@ ubond_loss_update(ubond_tunnel_t *tun, uint64_t seq)
     }
     tun->seq_vect |= 1;
     tun->seq_last = seq;
+    tun->data_seq_hist->recv[seq % 64] = data_seq;
   } else if (seq >= tun->seq_last - 63) {
+    tun->data_seq_hist->recv[seq % 64] = data_seq;
     if ((tun->seq_vect & (1 << (tun->seq_last - seq)))==0) {
       tun->seq_vect |= (1 << (tun->seq_last - seq));
     }
@@ -403,133 +499,364 @@ ubond_loss_update(ubond_tunnel_t *tun, uint64_t seq)
     tun->seq_vect = (uint64_t) -1;
     tun->seq_last = seq;
     tun->loss_cnt=0;
+    memset(tun->data_seq_hist, 0, sizeof(*tun->data_seq_hist));
   }
   if (tun->seq_vect==-1) tun->loss_cnt=0;
 }
 
 
 
-/* read from the rtunnel => write directly to the tap send buffer */
+/* The one way delay carries the offset between the two clocks, the same on
+ * every link, so only its differences between links mean something: see
+ * ubond_reorder_tick(). It is kept modulo 2^16 like the timestamps. */
 static void
-ubond_rtun_read(EV_P_ ev_io *w, int revents)
+ubond_owd_update(ubond_tunnel_t *tun, uint16_t owd)
 {
-    ubond_tunnel_t *tun = w->data;
-    ssize_t len;
-    struct sockaddr_storage clientaddr;
-    socklen_t addrlen = sizeof(clientaddr);
-    ubond_pkt_t *pkt=ubond_pkt_get();
-    len = recvfrom(tun->fd, &(pkt->p),
-                   sizeof(pkt->p),
-                   MSG_DONTWAIT, (struct sockaddr *)&clientaddr, &addrlen);
-    if (len < 0) {
-        if (errno != EAGAIN && errno != EWOULDBLOCK) {
-            log_warn("net", "%s read error", tun->name);
+    double err;
+
+    if (!tun->owd_c++) {
+        tun->owd_av = owd;
+        tun->owd_var = 0;
+        return;
+    }
+    err = (int16_t)(owd - (uint16_t)tun->owd_av);
+    tun->owd_av += err / 8.0;
+    if (tun->owd_av < 0)
+        tun->owd_av += 65536;
+    else if (tun->owd_av >= 65536)
+        tun->owd_av -= 65536;
+    tun->owd_var += (fabs(err) - tun->owd_var) / 4.0;
+}
+
+/* handle one datagram received on a rtunnel */
+static void
+ubond_rtun_handle_pkt(ubond_tunnel_t *tun, ubond_pkt_t *pkt, ssize_t len,
+                      struct sockaddr_storage *clientaddr, socklen_t addrlen)
+{
+    if (len == 0) {
+        log_info("protocol", "%s peer closed the connection", tun->name);
+        ubond_pkt_release(pkt);
+        return;
+    }
+    pkt->len=len; // stamp the wire length
+
+    /* validate the received packet */
+    if (ubond_protocol_read(tun, pkt) < 0) {
+      ubond_pkt_release(pkt);
+      return;
+    }
+
+    tun->recvbytes += len;
+    tun->recvpackets += 1;
+    tun->bm_data += pkt->p.len;
+    if (tun->quota) {
+      if (tun->permitted > (len + PKTHDRSIZ(pkt->p)+IP4_UDP_OVERHEAD)) {
+        tun->permitted -= (len + PKTHDRSIZ(pkt->p)+IP4_UDP_OVERHEAD);
+      } else {
+        tun->permitted = 0;
+      }
+    }
+
+    if (! tun->addrinfo)
+        fatalx("tun->addrinfo is NULL!");
+
+    if ((tun->addrinfo->ai_addrlen != addrlen) ||
+            (memcmp(tun->addrinfo->ai_addr, clientaddr, addrlen) != 0)) {
+        if (ubond_options.cleartext_data && tun->status >= UBOND_AUTHOK) {
+            log_warnx("protocol", "%s rejected non authenticated connection",
+                tun->name);
             ubond_rtun_status_down(tun);
+            ubond_pkt_release(pkt);
+            return;
+        }
+        char clienthost[NI_MAXHOST];
+        char clientport[NI_MAXSERV];
+        int ret;
+        if ( (ret = getnameinfo((struct sockaddr *)clientaddr, addrlen,
+                                clienthost, sizeof(clienthost),
+                                clientport, sizeof(clientport),
+                                NI_NUMERICHOST|NI_NUMERICSERV)) < 0) {
+            log_warn("protocol", "%s error in getnameinfo: %d",
+                   tun->name, ret);
+        } else {
+            log_info("protocol", "%s new connection -> %s:%s",
+               tun->name, clienthost, clientport);
+            memcpy(tun->addrinfo->ai_addr, clientaddr, addrlen);
+        }
+    }
+    log_debug("net", "< %s recv %d bytes (size=%d, type=%d, seq=%"PRIu64", reorder=%d)",
+              tun->name, (int)len, pkt->p.len, pkt->p.type, pkt->p.data_seq, pkt->p.reorder);
+
+    if (pkt->p.type == UBOND_PKT_DATA || pkt->p.type == UBOND_PKT_DATA_RESEND ||
+        pkt->p.type == UBOND_PKT_DATA_COPY) {
+        if (tun->status >= UBOND_AUTHOK) {
+          ubond_rtun_tick(tun);
+          ubond_reorder_insert( tun, pkt );
+        } else {
+            log_debug("protocol", "%s ignoring non authenticated packet",
+                tun->name);
+            ubond_pkt_release(pkt);
+        }
+    } else if (pkt->p.type == UBOND_PKT_KEEPALIVE &&
+            tun->status >= UBOND_AUTHOK) {
+        log_debug("protocol", "%s keepalive received", tun->name);
+        ubond_rtun_tick(tun);
+        tun->last_keepalive_ack = ev_now(EV_DEFAULT_UC);
+        /* Avoid flooding the network if multiple packets are queued */
+        if (tun->last_keepalive_ack_sent + UBOND_IO_TIMEOUT_DEFAULT < tun->last_keepalive_ack) {
+            tun->last_keepalive_ack_sent = tun->last_keepalive_ack;
+            ubond_rtun_send_keepalive(tun->last_keepalive_ack, tun);
+        }
+        uint64_t bw=0;
+        sscanf(pkt->p.data,"%lu", &bw);
+        if (bw>0) {
+          tun->bandwidth_out=(((double)tun->bandwidth_out * 9.0) + (double)bw)/10.0;
         }
         ubond_pkt_release(pkt);
-    } else if (len == 0) {
-        log_info("protocol", "%s peer closed the connection", tun->name);
+    } else if (pkt->p.type == UBOND_PKT_DISCONNECT &&
+            tun->status >= UBOND_AUTHOK) {
+        log_info("protocol", "%s disconnect received", tun->name);
+        ubond_rtun_status_down(tun);
         ubond_pkt_release(pkt);
+    } else if (pkt->p.type == UBOND_PKT_AUTH ||
+            pkt->p.type == UBOND_PKT_AUTH_OK) {
+      // recieve any quota info, if there is any
+      if (pkt->p.len > 2 && tun->quota) {
+        int64_t perm=0;
+        sscanf(&(pkt->p.data[2]),"%ld", &perm);
+        if (perm > tun->permitted) tun->permitted=perm;
+      }
+      ubond_rtun_send_auth(tun);
+      ubond_pkt_release(pkt);
+    } else if (pkt->p.type == UBOND_PKT_RESEND &&
+            tun->status >= UBOND_AUTHOK) {
+      ubond_rtun_resend((struct resend_data *)pkt->p.data);
+      ubond_pkt_release(pkt);
     } else {
-        pkt->len=len; // stamp the wire length
+      if (tun->status >= UBOND_AUTHOK) {
+        log_warnx("protocol", "Unknown packet type %d", pkt->p.type);
+      }
+      ubond_pkt_release(pkt);
+    }
+}
 
-        /* validate the received packet */
-        if (ubond_protocol_read(tun, pkt) < 0) {
-          ubond_pkt_release(pkt);
-          return;
-        }
+/* payload room of the largest datagram expected on tun, ciphertext included */
+#define UBOND_RTUN_ROOM(tun) \
+    ((tun)->link_mtu - IP4_UDP_OVERHEAD - UBOND_PROTO_HDRSIZ + crypto_PADSIZE)
 
-        tun->recvbytes += len;
-        tun->recvpackets += 1;
-        tun->bm_data += pkt->p.len;
-        if (tun->quota) {
-          if (tun->permitted > (len + PKTHDRSIZ(pkt->p)+IP4_UDP_OVERHEAD)) {
-            tun->permitted -= (len + PKTHDRSIZ(pkt->p)+IP4_UDP_OVERHEAD);
-          } else {
-            tun->permitted = 0;
-          }
-        }
+/* The packet pool is exhausted: drop the next datagram, leaving it queued
+ * would only wake the loop up again */
+static void
+ubond_rtun_discard(ubond_tunnel_t *tun)
+{
+    char c;
+    if (recv(tun->fd, &c, sizeof(c), MSG_DONTWAIT) >= 0)
+        log_debug("net", "%s out of packets, datagram dropped", tun->name);
+}
 
-        if (! tun->addrinfo)
-            fatalx("tun->addrinfo is NULL!");
+#ifdef HAVE_RECVMMSG
+/* read up to tun->recv_batch datagrams with a single recvmmsg(2) */
+static void
+ubond_rtun_read_batch(ubond_tunnel_t *tun)
+{
+    struct mmsghdr msgs[UBOND_BATCH_MAX];
+    struct iovec iov[UBOND_BATCH_MAX];
+    struct sockaddr_storage addrs[UBOND_BATCH_MAX];
+    ubond_pkt_t *pkts[UBOND_BATCH_MAX];
+    int disconnects = tun->disconnects;
+    int i, n;
+    int depth = tun->recv_batch;
+
+    if (depth > UBOND_BATCH_MAX)
+        depth = UBOND_BATCH_MAX;
+    memset(msgs, 0, sizeof(struct mmsghdr) * depth);
+    for (i = 0; i < depth; i++) {
+        if (! (pkts[i] = ubond_pkt_get_size(UBOND_RTUN_ROOM(tun))))
+            break;
+        iov[i].iov_base = &pkts[i]->p;
+        iov[i].iov_len = UBOND_PKT_WIRE_ROOM(pkts[i]);
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &addrs[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+    }
+    if ((depth = i) == 0) {
+        ubond_rtun_discard(tun);
+        return;
+    }
 
-        if ((tun->addrinfo->ai_addrlen != addrlen) ||
-                (memcmp(tun->addrinfo->ai_addr, &clientaddr, addrlen) != 0)) {
-            if (ubond_options.cleartext_data && tun->status >= UBOND_AUTHOK) {
-                log_warnx("protocol", "%s rejected non authenticated connection",
-                    tun->name);
-                ubond_rtun_status_down(tun);
-                ubond_pkt_release(pkt);
-                return;
-            }
-            char clienthost[NI_MAXHOST];
-            char clientport[NI_MAXSERV];
-            int ret;
-            if ( (ret = getnameinfo((struct sockaddr *)&clientaddr, addrlen,
-                                    clienthost, sizeof(clienthost),
-                                    clientport, sizeof(clientport),
-                                    NI_NUMERICHOST|NI_NUMERICSERV)) < 0) {
-                log_warn("protocol", "%s error in getnameinfo: %d",
-                       tun->name, ret);
-            } else {
-                log_info("protocol", "%s new connection -> %s:%s",
-                   tun->name, clienthost, clientport);
-                memcpy(tun->addrinfo->ai_addr, &clientaddr, addrlen);
-            }
+    n = recvmmsg(tun->fd, msgs, depth, MSG_DONTWAIT, NULL);
+    if (n < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            log_warn("net", "%s read error", tun->name);
+            ubond_rtun_status_down(tun);
+        }
+        n = 0;
+    } else if (n > 0) {
+        tun->rx_batches++;
+        tun->rx_batch_pkts += n;
+    }
+
+    for (i = 0; i < n; i++) {
+        ubond_rtun_handle_pkt(tun, pkts[i], msgs[i].msg_len,
+                              &addrs[i], msgs[i].msg_hdr.msg_namelen);
+        /* the tunnel went down: the rest of the batch is not for it */
+        if (tun->disconnects != disconnects) {
+            i++;
+            break;
         }
-        log_debug("net", "< %s recv %d bytes (size=%d, type=%d, seq=%"PRIu64", reorder=%d)",
-                  tun->name, (int)len, pkt->p.len, pkt->p.type, pkt->p.data_seq, pkt->p.reorder);
+    }
+    /* give back the buffers recvmmsg did not fill, or we did not handle */
+    for (; i < depth; i++) {
+        ubond_pkt_release(pkts[i]);
+    }
+}
 
-        if (pkt->p.type == UBOND_PKT_DATA || pkt->p.type == UBOND_PKT_DATA_RESEND) {
-            if (tun->status >= UBOND_AUTHOK) {
-              ubond_rtun_tick(tun);
-              ubond_reorder_insert( tun, pkt );
-            } else {
-                log_debug("protocol", "%s ignoring non authenticated packet",
-                    tun->name);
-                ubond_pkt_release(pkt);
-            }
-        } else if (pkt->p.type == UBOND_PKT_KEEPALIVE &&
-                tun->status >= UBOND_AUTHOK) {
-            log_debug("protocol", "%s keepalive received", tun->name);
-            ubond_rtun_tick(tun);
-            tun->last_keepalive_ack = ev_now(EV_DEFAULT_UC);
-            /* Avoid flooding the network if multiple packets are queued */
-            if (tun->last_keepalive_ack_sent + UBOND_IO_TIMEOUT_DEFAULT < tun->last_keepalive_ack) {
-                tun->last_keepalive_ack_sent = tun->last_keepalive_ack;
-                ubond_rtun_send_keepalive(tun->last_keepalive_ack, tun);
+#ifdef UDP_GRO
+/* Largest coalesced datagram the kernel hands back with UDP_GRO */
+#define UBOND_GRO_BUFSIZ 65535
+
+union ubond_rx_cmsg {
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+};
+
+/* receive buffers shared by every tunnel, grown on demand */
+static char *rx_gro_buf = NULL;
+static int rx_gro_cnt = 0;
+
+/*
+ * Read up to tun->recv_batch datagrams which the kernel may have merged
+ * with UDP_GRO, then cut them back into frames at the segment size
+ * reported in the control message.
+ */
+static void
+ubond_rtun_read_gro(ubond_tunnel_t *tun)
+{
+    struct mmsghdr msgs[UBOND_BATCH_MAX];
+    struct iovec iov[UBOND_BATCH_MAX];
+    struct sockaddr_storage addrs[UBOND_BATCH_MAX];
+    union ubond_rx_cmsg cmsgs[UBOND_BATCH_MAX];
+    struct cmsghdr *cm;
+    ubond_pkt_t *pkt;
+    char *buf;
+    size_t len, seg, off, flen;
+    int disconnects = tun->disconnects;
+    int i, n;
+    int depth = tun->recv_batch;
+
+    if (depth > UBOND_BATCH_MAX)
+        depth = UBOND_BATCH_MAX;
+    if (depth > rx_gro_cnt) {
+        buf = realloc(rx_gro_buf, (size_t)depth * UBOND_GRO_BUFSIZ);
+        if (! buf)
+            fatal("net", "memory allocation failed");
+        rx_gro_buf = buf;
+        rx_gro_cnt = depth;
+    }
+    memset(msgs, 0, sizeof(struct mmsghdr) * depth);
+    for (i = 0; i < depth; i++) {
+        iov[i].iov_base = rx_gro_buf + (size_t)i * UBOND_GRO_BUFSIZ;
+        iov[i].iov_len = UBOND_GRO_BUFSIZ;
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &addrs[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+        msgs[i].msg_hdr.msg_control = cmsgs[i].buf;
+        msgs[i].msg_hdr.msg_controllen = sizeof(cmsgs[i].buf);
+    }
+
+    n = recvmmsg(tun->fd, msgs, depth, MSG_DONTWAIT, NULL);
+    if (n < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            log_warn("net", "%s read error", tun->name);
+            ubond_rtun_status_down(tun);
+        }
+        return;
+    }
+    if (n == 0)
+        return;
+    tun->rx_batches++;
+
+    /* stop at the frame that took the tunnel down */
+    for (i = 0; i < n && tun->disconnects == disconnects; i++) {
+        len = msgs[i].msg_len;
+        seg = len;
+        for (cm = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cm;
+             cm = CMSG_NXTHDR(&msgs[i].msg_hdr, cm)) {
+            if (cm->cmsg_level == IPPROTO_UDP && cm->cmsg_type == UDP_GRO) {
+                int gso_size;
+                memcpy(&gso_size, CMSG_DATA(cm), sizeof(gso_size));
+                if (gso_size > 0)
+                    seg = gso_size;
             }
-            uint64_t bw=0;
-            sscanf(pkt->p.data,"%lu", &bw);
-            if (bw>0) {
-              tun->bandwidth_out=(((double)tun->bandwidth_out * 9.0) + (double)bw)/10.0;
+        }
+        if (seg < len) {
+            tun->gro_recvs++;
+            tun->gro_segments += (len + seg - 1) / seg;
+        }
+        /* an empty datagram still has to reach the "peer closed" logic */
+        off = 0;
+        do {
+            flen = len - off;
+            if (flen > seg)
+                flen = seg;
+            if (flen > UBOND_PROTO_HDRSIZ + UBOND_PKT_JUMBO) {
+                log_warnx("net", "%s received oversized frame (%zu bytes)",
+                    tun->name, flen);
+            } else if ((pkt = ubond_pkt_get_size(flen < UBOND_PROTO_HDRSIZ ?
+                    0 : flen - UBOND_PROTO_HDRSIZ))) {
+                memcpy(&pkt->p, (char *)iov[i].iov_base + off, flen);
+                tun->rx_batch_pkts++;
+                ubond_rtun_handle_pkt(tun, pkt, flen,
+                                      &addrs[i], msgs[i].msg_hdr.msg_namelen);
             }
-            ubond_pkt_release(pkt);
-        } else if (pkt->p.type == UBOND_PKT_DISCONNECT &&
-                tun->status >= UBOND_AUTHOK) {
-            log_info("protocol", "%s disconnect received", tun->name);
+            off += flen;
+        } while (off < len && tun->disconnects == disconnects);
+    }
+}
+#endif /* UDP_GRO */
+#endif
+
+/* read from the rtunnel => write directly to the tap send buffer */
+static void
+ubond_rtun_read(EV_P_ ev_io *w, int revents)
+{
+    ubond_tunnel_t *tun = w->data;
+    ssize_t len;
+    struct sockaddr_storage clientaddr;
+    socklen_t addrlen = sizeof(clientaddr);
+    ubond_pkt_t *pkt;
+
+#ifdef HAVE_RECVMMSG
+#ifdef UDP_GRO
+    if (tun->gro) {
+        ubond_rtun_read_gro(tun);
+        return;
+    }
+#endif
+    if (tun->recv_batch > 1) {
+        ubond_rtun_read_batch(tun);
+        return;
+    }
+#endif
+    if (! (pkt = ubond_pkt_get_size(UBOND_RTUN_ROOM(tun)))) {
+        ubond_rtun_discard(tun);
+        return;
+    }
+    len = recvfrom(tun->fd, &(pkt->p),
+                   UBOND_PKT_WIRE_ROOM(pkt),
+                   MSG_DONTWAIT, (struct sockaddr *)&clientaddr, &addrlen);
+    if (len < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            log_warn("net", "%s read error", tun->name);
             ubond_rtun_status_down(tun);
-            ubond_pkt_release(pkt);
-        } else if (pkt->p.type == UBOND_PKT_AUTH ||
-                pkt->p.type == UBOND_PKT_AUTH_OK) {
-          // recieve any quota info, if there is any
-          if (pkt->p.len > 2 && tun->quota) {
-            int64_t perm=0;
-            sscanf(&(pkt->p.data[2]),"%ld", &perm);
-            if (perm > tun->permitted) tun->permitted=perm;
-          }
-          ubond_rtun_send_auth(tun);
-          ubond_pkt_release(pkt);
-        } else if (pkt->p.type == UBOND_PKT_RESEND &&
-                tun->status >= UBOND_AUTHOK) {
-          ubond_rtun_resend((struct resend_data *)pkt->p.data);
-          ubond_pkt_release(pkt);
-        } else {
-          if (tun->status >= UBOND_AUTHOK) {
-            log_warnx("protocol", "Unknown packet type %d", pkt->p.type);
-          }
-          ubond_pkt_release(pkt);
         }
+        ubond_pkt_release(pkt);
+    } else {
+        tun->rx_batches++;
+        tun->rx_batch_pkts++;
+        ubond_rtun_handle_pkt(tun, pkt, len, &clientaddr, addrlen);
     }
 }
 
@@ -565,13 +892,13 @@ ubond_protocol_read(ubond_tunnel_t *tun, ubond_pkt_t *pkt)
 
     /* Overkill */
     /* pkt->data contains ubond_proto_t struct */
-    if (pkt->len > sizeof(*pkt) || pkt->len < (PKTHDRSIZ(pkt->p))) {
+    if (pkt->len > UBOND_PKT_WIRE_ROOM(pkt) || pkt->len < (PKTHDRSIZ(pkt->p))) {
         log_warnx("protocol", "%s received invalid packet of %d bytes",
             tun->name, pkt->len);
         goto fail;
     }
     rlen = be16toh(pkt->p.len);
-    if (/*rlen == 0 ||*/ rlen > sizeof(proto->data)) {
+    if (/*rlen == 0 ||*/ rlen > pkt->room) {
         log_warnx("protocol", "%s invalid packet size: %d", tun->name, rlen);
         goto fail;
     }
@@ -581,7 +908,7 @@ ubond_protocol_read(ubond_tunnel_t *tun, ubond_pkt_t *pkt)
     proto->flow_id = be32toh(proto->flow_id);
     /* now auth the packet using libsodium before further checks */
 #ifdef ENABLE_CRYPTO
-    if (!(ubond_options.cleartext_data && (proto->type == UBOND_PKT_DATA || proto->type == UBOND_PKT_DATA_RESEND))) {
+    if (!(ubond_options.cleartext_data && (proto->type == UBOND_PKT_DATA || proto->type == UBOND_PKT_DATA_RESEND || proto->type == UBOND_PKT_DATA_COPY))) {
         sodium_memzero(nonce, sizeof(nonce));
         memcpy(nonce, &proto->tun_seq, sizeof(proto->tun_seq));
         memcpy(nonce + sizeof(proto->tun_seq), &proto->flow_id, sizeof(proto->flow_id));
@@ -600,7 +927,9 @@ ubond_protocol_read(ubond_tunnel_t *tun, ubond_pkt_t *pkt)
                        // LE, not BE)
     if (proto->version >= 1) {
         proto->data_seq = be64toh(proto->data_seq);
-        ubond_loss_update(tun, proto->tun_seq);
+        ubond_loss_update(tun, proto->tun_seq,
+                          (proto->type == UBOND_PKT_DATA && proto->reorder) ?
+                          proto->data_seq : 0);
                          // use the TUN seq number to
                          // calculate loss
         if (proto->version >=2) {
@@ -619,6 +948,8 @@ ubond_protocol_read(ubond_tunnel_t *tun, ubond_pkt_t *pkt)
     if (proto->timestamp != (uint16_t)-1) {
         tun->saved_timestamp = proto->timestamp;
         tun->saved_timestamp_received_at = now64;
+        ubond_owd_update(tun, ubond_timestamp16_diff(ubond_timestamp16(now64),
+                                                     proto->timestamp));
     }
     if (proto->timestamp_reply != (uint16_t)-1) {
         uint16_t now16 = ubond_timestamp16(now64);
@@ -636,36 +967,69 @@ fail:
     return -1;
 }
 
-void set_reorder(ubond_pkt_t *pkt)
+/* Apply the policy table to a data packet read from the tun device.
+ * Reorderable packets are spread over the flow groups by their addresses
+ * and ports, so that one flow only ever waits for its own group: returns
+ * the group. With tun queue workers, worker only gets the groups which are
+ * worker modulo workers, at least one. */
+uint64_t
+ubond_classify_pkt(ubond_pkt_t *pkt, int worker, int workers)
 {
-    // should packet inspect, and only re-order TCP packets !
-    // 17 - UDP
-    // 6 - TCP
-    if ((pkt->p.type == UBOND_PKT_DATA || pkt->p.type == UBOND_PKT_DATA_RESEND) && pkt->p.data[9]==6) {
-      pkt->p.reorder = 1;
+    uint32_t per_worker = ubond_options.reorder_flows / workers;
+    struct ubond_pkt_info info;
+
+    if (ubond_classify_parse((const uint8_t *)pkt->p.data, pkt->p.len,
+                             &info) < 0) {
+        pkt->policy = UBOND_POLICY_BEST_EFFORT;
     } else {
-      pkt->p.reorder = 0;
+        pkt->policy = ubond_classify_policy(&info);
     }
+    pkt->p.reorder = (pkt->policy == UBOND_POLICY_REORDER);
+    if (!pkt->p.reorder || per_worker <= 1)
+        return worker;
+    return worker + workers * (ubond_classify_hash(&info) % per_worker);
 }
 
-static int
-ubond_rtun_send(ubond_tunnel_t *tun, ubond_pkt_t *pkt)
+/* Encode pkt for tun into wire: assign the sequence numbers, keep the packet
+ * for eventual resends, fill in the header, encrypt, and convert to network
+ * byte order. pkt itself is left in host order and in clear text: the
+ * payload is encrypted straight from pkt into wire.
+ * With iov, the two entries describe the datagram and a clear text payload
+ * is not copied, iov[1] points into pkt: only for a send done before pkt
+ * can be released. A batch a full socket held back is within the last
+ * UBOND_BATCH_MAX packets of tun, which ubond_rtun_reclaim() leaves alone.
+ * Without it, the whole datagram is laid out in wire. With seal too, the
+ * payload is left in clear there, seal says how to encrypt it in place.
+ * Returns the number of bytes to send, or -1 if the packet can't be sent.
+ */
+static ssize_t
+ubond_rtun_encode(ubond_tunnel_t *tun, ubond_pkt_t *pkt, ubond_proto_t *wire,
+                  struct iovec *iov, struct crypto_seal *seal)
 {
     unsigned char nonce[crypto_NONCEBYTES];
     ssize_t ret;
     size_t wlen;
+    size_t hlen = PKTHDRSIZ(pkt->p); /* bytes of the datagram in wire */
     ubond_proto_t *proto=&(pkt->p);
-    ubond_proto_t tmp_proto;
-    set_reorder(pkt);
 
-    if (pkt->p.type!=UBOND_PKT_DATA_RESEND) {
-      if (pkt->p.reorder) {
-        proto->data_seq = data_seq;
-      } else {
-        proto->data_seq = 0;
+    if (seal)
+      seal->len = 0;
+    if (pkt->p.type==UBOND_PKT_DATA) {
+      /* the tun queue workers number what they read */
+      if (!tuntap.workers) {
+        uint64_t group = ubond_classify_pkt(pkt, 0, 1);
+        // the sequence is consumed even if the write fails, as the packet
+        // is kept in old_pkts and may be resent with this data_seq
+        proto->data_seq = pkt->p.reorder ?
+          (group << UBOND_REORDER_FLOW_SHIFT) | ++data_seq[group] : 0;
       }
-    } else {
+      if (pkt->p.reorder)
+        ubond_sched_numbered(tun, pkt);
+    } else if (pkt->p.type==UBOND_PKT_DATA_RESEND) {
       resend_at= ev_now(EV_DEFAULT_UC);
+    } else if (pkt->p.type!=UBOND_PKT_DATA_COPY) {
+      pkt->p.reorder = 0;
+      proto->data_seq = 0;
     }
 
     wlen = PKTHDRSIZ(pkt->p) + pkt->p.len;
@@ -686,169 +1050,1097 @@ ubond_rtun_send(ubond_tunnel_t *tun, ubond_pkt_t *pkt)
     proto->version = UBOND_PROTOCOL_VERSION;
     proto->sent_loss=ubond_loss_pack(tun);
 
+    memcpy(wire, proto, hlen);
 #ifdef ENABLE_CRYPTO
-    if (!(ubond_options.cleartext_data && (pkt->p.type == UBOND_PKT_DATA || pkt->p.type == UBOND_PKT_DATA_RESEND))) {
-      memcpy(&tmp_proto, proto, sizeof(tmp_proto));
-        if (wlen + crypto_PADSIZE > sizeof(proto->data)) {
+    if (!(ubond_options.cleartext_data && (pkt->p.type == UBOND_PKT_DATA || pkt->p.type == UBOND_PKT_DATA_RESEND || pkt->p.type == UBOND_PKT_DATA_COPY))) {
+        if (proto->len + crypto_PADSIZE > sizeof(wire->data)) {
             log_warnx("protocol", "%s packet too long: %u/%d (packet=%d)",
                 tun->name,
-                (unsigned int)wlen + crypto_PADSIZE,
-                (unsigned int)sizeof(proto->data),
+                (unsigned int)proto->len + crypto_PADSIZE,
+                (unsigned int)sizeof(wire->data),
                 pkt->p.len);
             return -1;
         }
         sodium_memzero(nonce, sizeof(nonce));
         memcpy(nonce, &proto->tun_seq, sizeof(proto->tun_seq));
         memcpy(nonce + sizeof(proto->tun_seq), &proto->flow_id, sizeof(proto->flow_id));
-        if ((ret = crypto_encrypt((unsigned char *)&proto->data,
+        if (seal) {
+            memcpy(seal->nonce, nonce, sizeof(nonce));
+            seal->len = proto->len;
+        } else if ((ret = crypto_encrypt((unsigned char *)&wire->data,
                                   (const unsigned char *)&proto->data, proto->len,
                                   nonce)) != 0) {
             log_warnx("protocol", "%s crypto_encrypt failed: %d incorrect password?",
                 tun->name, (int)ret);
             return -1;
+        } else {
+            hlen = wlen + crypto_PADSIZE; /* the ciphertext follows the header */
+        }
+        wire->len += crypto_PADSIZE;
+        wlen += crypto_PADSIZE;
+    }
+#endif
+    if (! iov && hlen < wlen) {
+        memcpy(wire->data, proto->data, proto->len);
+        hlen = wlen;
+    }
+    if (iov) {
+        iov[0].iov_base = wire;
+        iov[0].iov_len = hlen;
+        iov[1].iov_base = proto->data;
+        iov[1].iov_len = wlen - hlen;
+    }
+
+    pkt->len=wlen;
+
+// significant time can have elapsed, so maybe better use the current time
+    // rather than... uint64_t now64 = ubond_timestamp64(ev_now(EV_DEFAULT_UC));
+    uint64_t now64 = ubond_timestamp64(ev_time());
+    /* we have a recent received timestamp */
+    if (tun->saved_timestamp != -1) {
+      if (now64 - tun->saved_timestamp_received_at < 1000 ) {
+        /* send "corrected" timestamp advanced by how long we held it */
+        /* Cast to uint16_t there intentional */
+        wire->timestamp_reply = ubond_timestamp16(tun->saved_timestamp + (now64 - tun->saved_timestamp_received_at));
+        tun->saved_timestamp = -1;
+        tun->saved_timestamp_received_at = 0;
+      } else {
+        wire->timestamp_reply = -1;
+        tun->saved_timestamp = -1;
+        tun->saved_timestamp_received_at = 0;
+        log_debug("rtt","(%s) No timestamp added, time too long! (%lu > 1000)",tun->name, tun->saved_timestamp + (now64 - tun->saved_timestamp_received_at ));
+      }
+    } else {
+      wire->timestamp_reply = -1;
+//      log_debug("rtt","(%s) No timestamp available!",tun->name);
+    }
+
+    wire->timestamp = ubond_timestamp16(now64);
+    wire->len = htobe16(wire->len);
+    wire->tun_seq = htobe64(wire->tun_seq);
+    wire->data_seq = htobe64(wire->data_seq);
+    wire->flow_id = htobe32(wire->flow_id);
+    wire->timestamp = htobe16(wire->timestamp);
+    wire->timestamp_reply = htobe16(wire->timestamp_reply);
+    return wlen;
+}
+
+/* Account for the result of the write of an encoded packet */
+static void
+ubond_rtun_sent(ubond_tunnel_t *tun, ubond_pkt_t *pkt, ssize_t ret, size_t wlen)
+{
+    if (ret < 0)
+    {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+          if (pkt->p.type!=UBOND_PKT_AUTH) {
+            log_warnx("net", "%s write error", tun->name);
+            ubond_rtun_status_down(tun);
+          } // dont report AUTH packet loss, as we know that !
+        } else {
+          // a full socket buffer is no reason to take the link down: the
+          // packet stays in old_pkts for a resend
+          log_debug("net", "%s socket buffer full, write dropped", tun->name);
+        }
+    } else {
+      // we are here when we succeed to send the packet
+//      if (pkt->p.reorder) {
+//        printf("Sending data seq %lu on %s (tun seq %lu)\n", pkt->p.data_seq, tun->name, pkt->p.tun_seq);
+//      }
+
+        tun->sentpackets++;
+        tun->sentbytes += ret;
+        if (tun->quota) {
+          if (tun->permitted > (ret + PKTHDRSIZ(pkt->p)+IP4_UDP_OVERHEAD)) {
+            tun->permitted -= (ret + PKTHDRSIZ(pkt->p)+IP4_UDP_OVERHEAD);
+          } else {
+            tun->permitted = 0;
+          }
+        }
+
+        if (wlen != ret)
+        {
+            log_warnx("net", "%s write error %d/%u",
+                tun->name, (int)ret, (unsigned int)wlen);
+        } else {
+            log_debug("net", "> %s sent %d bytes (size=%d, type=%d, seq=%"PRIu64", reorder=%d)",
+                      tun->name, (int)ret, pkt->p.len, pkt->p.type, pkt->p.data_seq, pkt->p.reorder);
+        }
+    }
+}
+
+#ifdef HAVE_LINUX
+/* Hand pkt to the worker of tun, which encrypts and sends it. Returns the
+ * wire length, -1 on error, or -2 if the worker has no free slot and the
+ * caller must send it itself. */
+static ssize_t
+ubond_worker_rtun_send(ubond_tunnel_t *tun, ubond_pkt_t *pkt)
+{
+    struct ubond_worker_tx *tx;
+    ssize_t wlen;
+
+    if (! tun->worker)
+        tun->worker = ubond_worker_pick();
+    if (! (tx = ubond_worker_tx_get(tun->worker)))
+        return -2;
+    if ((wlen = ubond_rtun_encode(tun, pkt, &tx->wire, NULL, &tx->seal)) < 0) {
+        ubond_worker_tx_abort(tun->worker, tx);
+        return -1;
+    }
+    memcpy(&tx->addr, tun->addrinfo->ai_addr, tun->addrinfo->ai_addrlen);
+    tx->addrlen = tun->addrinfo->ai_addrlen;
+    tx->fd = tun->fd;
+    tx->wlen = wlen;
+    tx->tun = tun;
+    tx->type = pkt->p.type;
+    ubond_worker_tx_put(tun->worker, tx);
+    /* accounted now, a failure shows up when the worker hands tx back */
+    ubond_rtun_sent(tun, pkt, wlen, wlen);
+    return wlen;
+}
+
+static void
+ubond_worker_rtun_failed(struct ubond_worker_tx *tx)
+{
+    /* tun is NULL once the tunnel was dropped */
+    if (tx->tun && tx->type != UBOND_PKT_AUTH) {
+        errno = tx->error;
+        log_warn("net", "%s write error", tx->tun->name);
+        ubond_rtun_status_down(tx->tun);
+    }
+}
+#endif
+
+static int
+ubond_rtun_send(ubond_tunnel_t *tun, ubond_pkt_t *pkt)
+{
+    ssize_t ret, wlen;
+    ubond_proto_t wire;
+    struct iovec iov[2];
+    struct msghdr msg;
+
+#ifdef HAVE_AF_XDP
+    if (tun->xsk && (ret = ubond_rtun_xdp_send(tun, pkt)) != -2)
+        return ret;
+#endif
+#ifdef HAVE_LINUX
+    if (tuntap.workers && (ret = ubond_worker_rtun_send(tun, pkt)) != -2)
+        return ret;
+#endif
+#ifdef HAVE_IO_URING
+    if (uring_on && (ret = ubond_uring_rtun_send(tun, pkt)) != -2)
+        return ret;
+#endif
+    if ((wlen = ubond_rtun_encode(tun, pkt, &wire, iov, NULL)) < 0)
+        return -1;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = tun->addrinfo->ai_addr;
+    msg.msg_namelen = tun->addrinfo->ai_addrlen;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    ret = sendmsg(tun->fd, &msg, MSG_DONTWAIT);
+    ubond_rtun_sent(tun, pkt, ret, wlen);
+    return ret;
+}
+
+/* Next packet to go out on tun: high priority first, then whatever the
+ * scheduler hands over from the global send buffer */
+static ubond_pkt_t *
+ubond_rtun_next_pkt(ubond_tunnel_t *tun)
+{
+    ubond_pkt_t *pkt;
+    if ((pkt = ubond_pkt_ring_get(&tun->hpsbuf)))
+      return pkt;
+    ubond_rtun_choose(tun);
+    return ubond_pkt_ring_get(&tun->sbuf);
+}
+
+#ifdef HAVE_SENDMMSG
+/* Largest payload the kernel accepts for one UDP_SEGMENT send */
+#define UBOND_GSO_MAX_BYTES 65000
+
+union ubond_tx_cmsg {
+    char buf[CMSG_SPACE(sizeof(uint16_t))];
+    struct cmsghdr align;
+};
+
+/* The last sendmmsg batch of a tunnel. The messages the kernel did not
+ * take because the socket buffer was full are sent first on the next
+ * write event, nothing new is encoded meanwhile. */
+struct ubond_tx_batch {
+    ubond_proto_t wire[UBOND_BATCH_MAX];
+    ubond_pkt_t *pkts[UBOND_BATCH_MAX];
+    size_t len[UBOND_BATCH_MAX];
+    struct iovec iov[2 * UBOND_BATCH_MAX]; /* header, payload */
+    struct mmsghdr msgs[UBOND_BATCH_MAX];
+    int msg_first[UBOND_BATCH_MAX]; /* first packet of each message */
+    int msg_cnt[UBOND_BATCH_MAX];   /* packets in each message */
+    union ubond_tx_cmsg cmsg[UBOND_BATCH_MAX];
+    int n;          /* packets encoded */
+    int sent;       /* of those, packets the kernel took */
+    int m;          /* messages */
+    int msent;      /* of those, messages the kernel took */
+};
+
+/* Build the sendmmsg vector for the encoded packets [first, n).
+ * With GSO, runs of equal sized frames (the last one may be shorter) are
+ * sent as one buffer the kernel splits with UDP_SEGMENT.
+ * Returns the number of messages.
+ */
+static int
+ubond_rtun_batch_msgs(ubond_tunnel_t *tun, int first, int n)
+{
+    struct ubond_tx_batch *b = tun->tx_batch;
+    int m = 0, i = first, cnt;
+    size_t bytes;
+
+    while (i < n) {
+        cnt = 1;
+        bytes = b->len[i];
+#ifdef UDP_SEGMENT
+        if (tun->gso) {
+            while (i + cnt < n &&
+                   b->len[i + cnt] <= b->len[i] &&
+                   bytes + b->len[i + cnt] <= UBOND_GSO_MAX_BYTES) {
+                bytes += b->len[i + cnt];
+                cnt++;
+                if (b->len[i + cnt - 1] < b->len[i])
+                    break; /* a short frame ends the run */
+            }
+        }
+#endif
+        memset(&b->msgs[m], 0, sizeof(b->msgs[m]));
+        b->msgs[m].msg_hdr.msg_iov = &b->iov[2 * i];
+        b->msgs[m].msg_hdr.msg_iovlen = 2 * cnt;
+        b->msgs[m].msg_hdr.msg_name = tun->addrinfo->ai_addr;
+        b->msgs[m].msg_hdr.msg_namelen = tun->addrinfo->ai_addrlen;
+#ifdef UDP_SEGMENT
+        if (cnt > 1) {
+            struct cmsghdr *cm;
+            b->msgs[m].msg_hdr.msg_control = b->cmsg[m].buf;
+            b->msgs[m].msg_hdr.msg_controllen = sizeof(b->cmsg[m].buf);
+            cm = CMSG_FIRSTHDR(&b->msgs[m].msg_hdr);
+            cm->cmsg_level = IPPROTO_UDP;
+            cm->cmsg_type = UDP_SEGMENT;
+            cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            *(uint16_t *)CMSG_DATA(cm) = b->len[i];
+            tun->gso_sends++;
+            tun->gso_segments += cnt;
+        }
+#endif
+        b->msg_first[m] = i;
+        b->msg_cnt[m] = cnt;
+        i += cnt;
+        m++;
+    }
+    return m;
+}
+
+/* Is part of the last batch of tun waiting for room in the socket? */
+static int
+ubond_rtun_tx_blocked(ubond_tunnel_t *tun)
+{
+    return tun->tx_batch && tun->tx_batch->msent < tun->tx_batch->m;
+}
+
+/* Give up on what is left of the last batch, the socket is closed or the
+ * tunnel went down. The packets stay in old_pkts for resends. */
+static void
+ubond_rtun_tx_discard(ubond_tunnel_t *tun)
+{
+    if (tun->tx_batch)
+        tun->tx_batch->msent = tun->tx_batch->m = 0;
+}
+
+/* Hand the messages of the last batch the kernel did not take yet to it.
+ * A full socket buffer keeps the rest for the next write event, any other
+ * error drops it.
+ * Returns the number of packets sent.
+ */
+static int
+ubond_rtun_send_msgs(ubond_tunnel_t *tun)
+{
+    struct ubond_tx_batch *b = tun->tx_batch;
+    int i, j, ret, cnt, sent = 0;
+
+    while (b->msent < b->m) {
+        ret = sendmmsg(tun->fd, &b->msgs[b->msent], b->m - b->msent,
+                       MSG_DONTWAIT);
+#ifdef UDP_SEGMENT
+        if (ret < 0 && tun->gso && (errno == EIO || errno == EINVAL)) {
+            /* the egress device can't do UDP segmentation offload,
+             * send the rest of the batch one datagram at a time */
+            log_warnx("net", "%s UDP GSO refused, disabled", tun->name);
+            tun->gso = 0;
+            b->m = ubond_rtun_batch_msgs(tun, b->sent, b->n);
+            b->msent = 0;
+            continue;
+        }
+#endif
+        if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (ret <= 0) {
+            /* the rest of the batch stays in old_pkts and will be resent
+             * if the other end asks for it */
+            b->msent = b->m = 0;
+            ubond_rtun_sent(tun, b->pkts[b->sent], -1, b->len[b->sent]);
+            break;
+        }
+        for (cnt = 0, j = b->msent; j < b->msent + ret; j++) {
+            size_t len = b->msgs[j].msg_len;
+            for (i = b->msg_first[j]; i < b->msg_first[j] + b->msg_cnt[j]; i++) {
+                size_t l = len < b->len[i] ? len : b->len[i];
+                ubond_rtun_sent(tun, b->pkts[i], l, b->len[i]);
+                tun->bytes_since_adjust += l + IP4_UDP_OVERHEAD;
+                len -= l;
+            }
+            cnt += b->msg_cnt[j];
+        }
+        b->sent += cnt;
+        b->msent += ret;
+        sent += cnt;
+    }
+    if (sent > 0) {
+        tun->tx_batches++;
+        tun->tx_batch_pkts += sent;
+    }
+    return sent;
+}
+
+/* Encode every packet the budget allows (up to send_batch) and hand them
+ * to the kernel with sendmmsg(2).
+ * Returns the number of packets sent.
+ */
+static int
+ubond_rtun_send_batch(ubond_tunnel_t *tun, double budget)
+{
+    struct ubond_tx_batch *b = tun->tx_batch;
+    ubond_pkt_t *pkt;
+    ssize_t wlen;
+    uint64_t queued = tun->bytes_since_adjust;
+    int depth = tun->send_batch;
+    int n = 0;
+
+    if (!b && !(b = tun->tx_batch = malloc(sizeof(*b))))
+        fatal(NULL, "malloc failed");
+    if (depth > UBOND_BATCH_MAX)
+        depth = UBOND_BATCH_MAX;
+    while (n < depth && queued < budget) {
+        if (!(pkt = ubond_rtun_next_pkt(tun))) {
+            /* like the single packet path, only a tunnel that had nothing
+             * to send is idle: otherwise the write event is still pending
+             * and a kick would count busy_writing twice */
+            if (n == 0)
+                tun->idle=1;
+            break;
+        }
+        if ((wlen = ubond_rtun_encode(tun, pkt, &b->wire[n], &b->iov[2 * n], NULL)) < 0)
+            continue;
+        b->pkts[n] = pkt;
+        b->len[n] = wlen;
+        queued += wlen + IP4_UDP_OVERHEAD;
+        n++;
+    }
+    b->n = n;
+    b->sent = b->msent = 0;
+    b->m = ubond_rtun_batch_msgs(tun, 0, n);
+    return ubond_rtun_send_msgs(tun);
+}
+#endif
+
+/* Same job as the sendmmsg batch, for the transports which queue every
+ * ubond_rtun_send() and hand them to the kernel at once (io_uring, AF_XDP):
+ * fill the budget one packet at a time. */
+static int
+ubond_rtun_send_budget(ubond_tunnel_t *tun, double budget)
+{
+    ubond_pkt_t *pkt;
+    int sent = 0;
+    ssize_t len;
+
+    while (sent < (int)tun->send_batch && tun->bytes_since_adjust < budget) {
+        if (! (pkt = ubond_rtun_next_pkt(tun))) {
+            if (sent == 0)
+                tun->idle = 1;
+            break;
+        }
+        len = ubond_rtun_send(tun, pkt);
+        if (len > 0) {
+            tun->bytes_since_adjust += len + IP4_UDP_OVERHEAD;
+            sent++;
+        }
+    }
+    return sent;
+}
+
+#ifdef HAVE_AF_XDP
+/* Encode straight into a free UMEM chunk. Returns -2 when the frame has
+ * to go through the kernel socket instead. */
+static ssize_t
+ubond_rtun_xdp_send(ubond_tunnel_t *tun, ubond_pkt_t *pkt)
+{
+    ubond_proto_t *wire;
+    ssize_t wlen;
+
+    /* jumbo frames don't fit a chunk */
+    if (UBOND_PROTO_HDRSIZ + pkt->p.len + crypto_PADSIZE >
+            UBOND_XDP_FRAME_SIZE - UBOND_XDP_PKT_OFF)
+        return -2;
+    wire = ubond_xsk_tx_frame(tun->xsk, tun->addrinfo->ai_addr,
+                              tun->addrinfo->ai_addrlen);
+    if (! wire)
+        return -2;
+    if ((wlen = ubond_rtun_encode(tun, pkt, wire, NULL, NULL)) < 0) {
+        ubond_xsk_tx_abort(tun->xsk, wire);
+        return -1;
+    }
+    ubond_xsk_tx_commit(tun->xsk, wire, wlen);
+    ubond_rtun_sent(tun, pkt, wlen, wlen);
+    return wlen;
+}
+
+static void
+ubond_rtun_xdp_read(EV_P_ ev_io *w, int revents)
+{
+    ubond_tunnel_t *tun = w->data;
+    struct ubond_xsk *xsk = tun->xsk;
+    unsigned char hdr[UBOND_XDP_HDRLEN];
+    struct sockaddr_in from;
+    ubond_pkt_t *pkt;
+    ssize_t len;
+    uint64_t accepted;
+    int n = 0;
+
+    while (n < UBOND_BATCH_MAX && ubond_xsk_recv(xsk, &pkt, &len, &from, hdr)) {
+        accepted = tun->recvpackets;
+        ubond_rtun_handle_pkt(tun, pkt, len,
+                              (struct sockaddr_storage *)&from, sizeof(from));
+        /* only authenticated frames of the peer may set the reply path */
+        if (tun->recvpackets != accepted &&
+                tun->addrinfo->ai_addrlen == sizeof(from) &&
+                memcmp(tun->addrinfo->ai_addr, &from, sizeof(from)) == 0)
+            ubond_xsk_learn(xsk, hdr);
+        n++;
+    }
+    ubond_xsk_refill(xsk);
+}
+
+static void
+ubond_rtun_xdp_stop(ubond_tunnel_t *t)
+{
+    if (! t->xsk)
+        return;
+    ev_io_stop(EV_A_ &t->xdp_read);
+    ubond_xsk_close(t->xsk);
+    t->xsk = NULL;
+}
+
+static void
+ubond_rtun_xdp_start(ubond_tunnel_t *t)
+{
+    struct sockaddr_in sin;
+    socklen_t slen = sizeof(sin);
+    int fd, ifindex;
+
+    if (t->addrinfo->ai_family != AF_INET) {
+        log_warnx("xdp", "%s AF_XDP transport is IPv4 only", t->name);
+        return;
+    }
+    if (getsockname(t->fd, (struct sockaddr *)&sin, &slen) < 0 ||
+            sin.sin_port == 0) {
+        /* no bindport: the port has to be known before the first send */
+        memset(&sin, 0, sizeof(sin));
+        sin.sin_family = AF_INET;
+        slen = sizeof(sin);
+        if (bind(t->fd, (struct sockaddr *)&sin, sizeof(sin)) < 0 ||
+                getsockname(t->fd, (struct sockaddr *)&sin, &slen) < 0) {
+            log_warn("xdp", "%s unable to pick a port", t->name);
+            return;
+        }
+    }
+    if ((fd = priv_open_xdp(t->xdp_interface, &ifindex)) < 0) {
+        log_warnx("xdp", "%s AF_XDP not available on %s",
+            t->name, t->xdp_interface);
+        return;
+    }
+    if (! (t->xsk = ubond_xsk_open(fd, ifindex, t->xdp_queue, sin.sin_port)))
+        return;
+    if (priv_xdp_redirect(ifindex, t->xdp_queue, fd, t->fd) < 0) {
+        log_warnx("xdp", "%s unable to redirect port %d to AF_XDP",
+            t->name, ntohs(sin.sin_port));
+        ubond_xsk_close(t->xsk);
+        t->xsk = NULL;
+        return;
+    }
+    ev_io_init(&t->xdp_read, ubond_rtun_xdp_read, fd, EV_READ);
+    t->xdp_read.data = t;
+    ev_io_start(EV_A_ &t->xdp_read);
+    log_info("xdp", "%s AF_XDP transport on %s queue %u",
+        t->name, t->xdp_interface, t->xdp_queue);
+}
+#endif
+
+/* (re)start the AF_XDP transport of t according to its configuration */
+void
+ubond_rtun_xdp_setup(ubond_tunnel_t *t)
+{
+#ifdef HAVE_AF_XDP
+    ubond_rtun_xdp_stop(t);
+    if (*t->xdp_interface && t->fd >= 0)
+        ubond_rtun_xdp_start(t);
+#else
+    if (*t->xdp_interface)
+        log_warnx("xdp", "%s AF_XDP not supported on this system", t->name);
+#endif
+}
+
+#ifdef HAVE_IO_URING
+/*
+ * io_uring backend. The ring sits next to the libev loop: completions wake
+ * the loop through an eventfd, and every sqe queued while the loop runs is
+ * handed to the kernel by a single io_uring_enter(2) from an ev_prepare
+ * watcher, right before the loop goes back to sleep.
+ */
+static void
+ubond_uring_rtun_arm(ubond_tunnel_t *t)
+{
+    struct io_uring_sqe *sqe;
+
+    /* the receive packets were sized for the links known at startup */
+    if (UBOND_RTUN_ROOM(t) > uring_rx_room) {
+        log_warnx("io_uring", "%s link_mtu above the receive ring's, using libev",
+            t->name);
+        ev_io_start(EV_A_ &t->io_read);
+        return;
+    }
+    if (! (sqe = ubond_uring_get_sqe(&uring))) {
+        log_warnx("io_uring", "%s ring full, using libev", t->name);
+        ev_io_start(EV_A_ &t->io_read);
+        return;
+    }
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = t->fd;
+    sqe->addr = (uint64_t)(uintptr_t)&uring_rx_msg;
+    sqe->len = 1;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = UBOND_URING_BGID_RTUN;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->user_data = UBOND_URING_DATA(UBOND_URING_RTUN_RECV, t);
+    t->uring_recv = 1;
+}
+
+static void
+ubond_uring_rtun_stop(ubond_tunnel_t *t)
+{
+    struct io_uring_sqe *sqe;
+
+    if (! uring_on || ! t->uring_recv)
+        return;
+    t->uring_recv = 0;
+    if ((sqe = ubond_uring_get_sqe(&uring))) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = UBOND_URING_DATA(UBOND_URING_RTUN_RECV, t);
+        sqe->user_data = UBOND_URING_DATA(UBOND_URING_NOP, NULL);
+        ubond_uring_submit(&uring);
+    }
+}
+
+static void
+ubond_uring_rtun_recv(ubond_tunnel_t *t, int res, unsigned flags)
+{
+    struct io_uring_recvmsg_out *out;
+    ubond_pkt_t *pkt;
+    uint16_t bid;
+
+    if (flags & IORING_CQE_F_BUFFER) {
+        /* the datagram is already in p of the packet: it leaves the ring
+         * and a fresh one takes over. Without one, the datagram is dropped
+         * and its packet stays. */
+        bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        pkt = uring_rx_pkts[bid];
+        out = (struct io_uring_recvmsg_out *)UBOND_URING_RX_BUF(pkt);
+        if (res < 0 || ! t->uring_recv) {
+            pkt = NULL; /* nothing to deliver */
+        } else if (out->flags & MSG_TRUNC) {
+            log_warnx("net", "%s received oversized frame", t->name);
+            pkt = NULL;
+        } else if (! (uring_rx_pkts[bid] = ubond_pkt_get_size(uring_rx_room))) {
+            uring_rx_pkts[bid] = pkt;
+            pkt = NULL;
+        }
+        ubond_uring_bufring_add(&uring_rx_br,
+            UBOND_URING_RX_BUF(uring_rx_pkts[bid]),
+            UBOND_PKT_HEADROOM + UBOND_PKT_WIRE_ROOM(uring_rx_pkts[bid]), bid);
+        /* the source address sits in the headroom of pkt, it is read
+         * before pkt goes anywhere */
+        if (pkt)
+            ubond_rtun_handle_pkt(t, pkt, out->payloadlen,
+                (struct sockaddr_storage *)(out + 1),
+                MIN(out->namelen, UBOND_URING_RX_NAMELEN));
+    }
+    if ((flags & IORING_CQE_F_MORE) || ! t->uring_recv)
+        return;
+    /* the multishot request ended, find out why */
+    if (res == -EINVAL || res == -EOPNOTSUPP) {
+        log_warnx("io_uring", "%s multishot receive not supported, using libev",
+            t->name);
+        t->uring_recv = 0;
+        ev_io_start(EV_A_ &t->io_read);
+        return;
+    }
+    if (res < 0 && res != -ENOBUFS) {
+        errno = -res;
+        log_warn("net", "%s read error", t->name);
+        ubond_rtun_status_down(t);
+    }
+    ubond_uring_rtun_arm(t);
+}
+
+/* Queue pkt for sending. Returns the wire length, -1 on error, or -2 if
+ * the ring is out of room and the caller must send it itself. */
+static ssize_t
+ubond_uring_rtun_send(ubond_tunnel_t *tun, ubond_pkt_t *pkt)
+{
+    struct ubond_uring_tx *tx = uring_tx_free;
+    struct io_uring_sqe *sqe;
+    ssize_t wlen;
+
+    if (! tx || ! (sqe = ubond_uring_get_sqe(&uring)))
+        return -2;
+    /* on error the zeroed sqe goes out as a NOP. The kernel reads the
+     * datagram after we return, by then pkt may have left old_pkts: the
+     * payload is copied into the slot rather than pointed at. */
+    if ((wlen = ubond_rtun_encode(tun, pkt, &tx->wire, NULL, NULL)) < 0)
+        return -1;
+    uring_tx_free = tx->next;
+
+    memcpy(&tx->addr, tun->addrinfo->ai_addr, tun->addrinfo->ai_addrlen);
+    memset(&tx->msg, 0, sizeof(tx->msg));
+    tx->msg.msg_name = &tx->addr;
+    tx->msg.msg_namelen = tun->addrinfo->ai_addrlen;
+    tx->iov.iov_base = &tx->wire;
+    tx->iov.iov_len = wlen;
+    tx->msg.msg_iov = &tx->iov;
+    tx->msg.msg_iovlen = 1;
+    tx->tun = tun;
+    tx->type = pkt->p.type;
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = tun->fd;
+    sqe->addr = (uint64_t)(uintptr_t)&tx->msg;
+    sqe->len = 1;
+    sqe->user_data = UBOND_URING_DATA(UBOND_URING_RTUN_SEND, tx);
+    /* accounted now, a failure shows up at completion time */
+    ubond_rtun_sent(tun, pkt, wlen, wlen);
+    return wlen;
+}
+
+static void
+ubond_uring_rtun_sent(struct ubond_uring_tx *tx, int res)
+{
+    /* tun is NULL once the tunnel was dropped */
+    if (res < 0 && tx->tun && tx->type != UBOND_PKT_AUTH) {
+        errno = -res;
+        log_warn("net", "%s write error", tx->tun->name);
+        ubond_rtun_status_down(tx->tun);
+    }
+    tx->tun = NULL;
+    tx->next = uring_tx_free;
+    uring_tx_free = tx;
+}
+
+/* t is being dropped: its sends still in the ring complete for nobody */
+static void
+ubond_uring_rtun_forget(ubond_tunnel_t *t)
+{
+    int i;
+
+    if (! uring_tx_slots)
+        return;
+    for (i = 0; i < UBOND_URING_TX_SLOTS; i++) {
+        if (uring_tx_slots[i].tun == t)
+            uring_tx_slots[i].tun = NULL;
+    }
+}
+
+static void
+ubond_uring_tun_arm(int q)
+{
+    struct io_uring_sqe *sqe = ubond_uring_get_sqe(&uring);
+    if (! sqe)
+        return; /* retried on the next ubond_tuntap_read_start() */
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = tuntap.qfd[q];
+    sqe->len = tuntap.maxmtu;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = UBOND_URING_BGID_TUN;
+    sqe->user_data = UBOND_URING_DATA(UBOND_URING_TUN_READ, (uintptr_t)q);
+    uring_tun_armed[q] = 1;
+}
+
+static void
+ubond_uring_tun_read(int q, int res, unsigned flags)
+{
+    ubond_pkt_t *pkt = NULL;
+    uint16_t bid;
+
+    uring_tun_armed[q] = 0;
+    if (flags & IORING_CQE_F_BUFFER) {
+        /* the filled pool packet leaves the ring, a fresh one takes over.
+         * Without one, the frame is dropped and its packet stays. */
+        bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        pkt = uring_tun_pkts[bid];
+        if (! (uring_tun_pkts[bid] = ubond_pkt_get_size(tuntap.maxmtu))) {
+            uring_tun_pkts[bid] = pkt;
+            pkt = NULL;
+        }
+        ubond_uring_bufring_add(&uring_tun_br, uring_tun_pkts[bid]->p.data,
+            uring_tun_pkts[bid]->room, bid);
+    }
+    if (res < 0 && res != -ENOBUFS && res != -EAGAIN && res != -ECANCELED) {
+        errno = -res;
+        /* read error on tuntap is not recoverable. We must die. */
+        fatal("tuntap", "unrecoverable read error");
+    } else if (res == 0) {
+        fatalx("tuntap device closed");
+    } else if (res > 0 && pkt) {
+        if (res > tuntap.maxmtu) {
+            log_warnx("tuntap", "cannot send packet: too big %d/%d. truncating",
+                res, tuntap.maxmtu);
+            res = tuntap.maxmtu;
+        }
+        pkt->p.len = res;
+        pkt->p.type = UBOND_PKT_DATA;
+        ubond_buffer_write(&send_buffer, ubond_pkt_shrink(pkt));
+        pkt = NULL;
+        ubond_tuntap_kick();
+    }
+    if (pkt)
+        ubond_pkt_release(pkt);
+    /* a full send_buffer pauses the queue until ubond_tuntap_read_start() */
+    if (! uring_tun_armed[q] && ! ubond_pkt_ring_is_full(&send_buffer))
+        ubond_uring_tun_arm(q);
+}
+
+/* Queue pkt for the TUN device, 0 when the ring took it */
+static int
+ubond_uring_tun_write(ubond_pkt_t *pkt)
+{
+    struct io_uring_sqe *sqe = ubond_uring_get_sqe(&uring);
+    if (! sqe)
+        return -1;
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = tuntap.fd;
+    sqe->addr = (uint64_t)(uintptr_t)pkt->p.data;
+    sqe->len = pkt->p.len;
+    sqe->user_data = UBOND_URING_DATA(UBOND_URING_TUN_WRITE, pkt);
+    return 0;
+}
+
+static void
+ubond_uring_tun_written(ubond_pkt_t *pkt, int res)
+{
+    if (res < 0) {
+        errno = -res;
+        log_warn("tuntap", "%s write error", tuntap.devname);
+    } else if (res != pkt->p.len) {
+        log_warnx("tuntap", "%s write error: %d/%d bytes sent",
+            tuntap.devname, res, pkt->p.len);
+    }
+    ubond_pkt_release(pkt);
+}
+
+static void
+ubond_uring_reap()
+{
+    struct io_uring_cqe *cqe;
+    uint64_t data;
+    unsigned flags;
+    int res;
+
+    while ((cqe = ubond_uring_peek_cqe(&uring))) {
+        data = cqe->user_data;
+        res = cqe->res;
+        flags = cqe->flags;
+        ubond_uring_cqe_seen(&uring);
+        switch (UBOND_URING_OP(data)) {
+        case UBOND_URING_RTUN_RECV:
+            ubond_uring_rtun_recv(UBOND_URING_PTR(data), res, flags);
+            break;
+        case UBOND_URING_RTUN_SEND:
+            ubond_uring_rtun_sent(UBOND_URING_PTR(data), res);
+            break;
+        case UBOND_URING_TUN_READ:
+            ubond_uring_tun_read((int)(uintptr_t)UBOND_URING_PTR(data),
+                res, flags);
+            break;
+        case UBOND_URING_TUN_WRITE:
+            ubond_uring_tun_written(UBOND_URING_PTR(data), res);
+            break;
+        default:
+            break;
         }
-        proto->len += crypto_PADSIZE;
-        wlen += crypto_PADSIZE;
-    } else
-#endif
-    {
-      memcpy(&tmp_proto,proto,PKTHDRSIZ(tmp_proto));
     }
+    ubond_uring_bufring_commit(&uring_rx_br);
+    ubond_uring_bufring_commit(&uring_tun_br);
+}
 
-    pkt->len=wlen;
+static void
+ubond_uring_event(EV_P_ ev_io *w, int revents)
+{
+    uint64_t count;
+    if (read(uring_efd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        log_warn("io_uring", "eventfd read error");
+    ev_now_update(EV_A);
+    ubond_uring_reap();
+}
 
-// significant time can have elapsed, so maybe better use the current time
-    // rather than... uint64_t now64 = ubond_timestamp64(ev_now(EV_DEFAULT_UC));
-    uint64_t now64 = ubond_timestamp64(ev_time());
-    /* we have a recent received timestamp */
-    if (tun->saved_timestamp != -1) {
-      if (now64 - tun->saved_timestamp_received_at < 1000 ) {
-        /* send "corrected" timestamp advanced by how long we held it */
-        /* Cast to uint16_t there intentional */
-        proto->timestamp_reply = ubond_timestamp16(tun->saved_timestamp + (now64 - tun->saved_timestamp_received_at));
-        tun->saved_timestamp = -1;
-        tun->saved_timestamp_received_at = 0;
-      } else {
-        proto->timestamp_reply = -1;
-        tun->saved_timestamp = -1;
-        tun->saved_timestamp_received_at = 0;
-        log_debug("rtt","(%s) No timestamp added, time too long! (%lu > 1000)",tun->name, tun->saved_timestamp + (now64 - tun->saved_timestamp_received_at ));
-      }
-    } else {
-      proto->timestamp_reply = -1;
-//      log_debug("rtt","(%s) No timestamp available!",tun->name);
+/* last thing before the loop blocks: one syscall for everything queued */
+static void
+ubond_uring_flush(EV_P_ ev_prepare *w, int revents)
+{
+    if (ubond_uring_pending(&uring) && ubond_uring_submit(&uring) < 0)
+        log_warn("io_uring", "submit failed");
+}
+
+/* Switch to the io_uring backend if configured, staying on plain libev
+ * when the kernel refuses. Called once the TUN device is open. */
+static void
+ubond_uring_setup()
+{
+    ubond_tunnel_t *t;
+    int i;
+
+    if (ubond_options.io_backend != UBOND_IO_BACKEND_URING)
+        return;
+    memset(uring_rx_pkts, 0, sizeof(uring_rx_pkts));
+    memset(uring_tun_pkts, 0, sizeof(uring_tun_pkts));
+    if (ubond_uring_init(&uring, UBOND_URING_ENTRIES) < 0) {
+        log_warn("io_uring", "setup failed, using libev");
+        return;
+    }
+    uring_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (uring_efd < 0 || ubond_uring_register_eventfd(&uring, uring_efd) < 0)
+        goto error;
+    uring_tx_slots = calloc(UBOND_URING_TX_SLOTS, sizeof(*uring_tx_slots));
+    if (! uring_tx_slots)
+        goto error;
+    if (ubond_uring_bufring_init(&uring, &uring_rx_br,
+            UBOND_URING_BGID_RTUN, UBOND_URING_RX_BUFS) < 0 ||
+        ubond_uring_bufring_init(&uring, &uring_tun_br,
+            UBOND_URING_BGID_TUN, UBOND_URING_TUN_BUFS) < 0)
+        goto error;
+    /* room for the largest datagram of any link, like ubond_rtun_read() */
+    uring_rx_room = tuntap.maxmtu + crypto_PADSIZE;
+    LIST_FOREACH(t, &rtuns, entries) {
+        if (UBOND_RTUN_ROOM(t) > uring_rx_room)
+            uring_rx_room = UBOND_RTUN_ROOM(t);
     }
+    for (i = 0; i < UBOND_URING_RX_BUFS; i++) {
+        if (! (uring_rx_pkts[i] = ubond_pkt_get_size(uring_rx_room)))
+            goto error;
+        ubond_uring_bufring_add(&uring_rx_br, UBOND_URING_RX_BUF(uring_rx_pkts[i]),
+            UBOND_PKT_HEADROOM + UBOND_PKT_WIRE_ROOM(uring_rx_pkts[i]), i);
+    }
+    for (i = 0; i < UBOND_URING_TUN_BUFS; i++) {
+        if (! (uring_tun_pkts[i] = ubond_pkt_get_size(tuntap.maxmtu)))
+            goto error;
+        ubond_uring_bufring_add(&uring_tun_br, uring_tun_pkts[i]->p.data,
+            uring_tun_pkts[i]->room, i);
+    }
+    ubond_uring_bufring_commit(&uring_rx_br);
+    ubond_uring_bufring_commit(&uring_tun_br);
+    for (i = 0; i < UBOND_URING_TX_SLOTS; i++) {
+        uring_tx_slots[i].next = uring_tx_free;
+        uring_tx_free = &uring_tx_slots[i];
+    }
+    memset(&uring_rx_msg, 0, sizeof(uring_rx_msg));
+    uring_rx_msg.msg_namelen = UBOND_URING_RX_NAMELEN;
+
+    ev_io_init(&uring_io, ubond_uring_event, uring_efd, EV_READ);
+    ev_io_start(EV_A_ &uring_io);
+    ev_prepare_init(&uring_prepare, ubond_uring_flush);
+    ev_prepare_start(EV_A_ &uring_prepare);
+    uring_on = 1;
+    /* vnet header frames need the segmentation code of the libev path,
+     * and the workers read the queues themselves */
+    uring_tun_read = ! tuntap.offload && ! tuntap.workers;
+    log_info("io_uring", "io_uring backend enabled");
+    return;
+error:
+    log_warn("io_uring", "setup failed, using libev");
+    ubond_uring_bufring_free(&uring, &uring_rx_br);
+    ubond_uring_bufring_free(&uring, &uring_tun_br);
+    for (i = 0; i < UBOND_URING_RX_BUFS; i++) {
+        if (uring_rx_pkts[i])
+            ubond_pkt_release(uring_rx_pkts[i]);
+        uring_rx_pkts[i] = NULL;
+    }
+    for (i = 0; i < UBOND_URING_TUN_BUFS; i++) {
+        if (uring_tun_pkts[i])
+            ubond_pkt_release(uring_tun_pkts[i]);
+        uring_tun_pkts[i] = NULL;
+    }
+    free(uring_tx_slots);
+    uring_tx_slots = NULL;
+    uring_tx_free = NULL;
+    if (uring_efd >= 0)
+        close(uring_efd);
+    uring_efd = -1;
+    ubond_uring_free(&uring);
+}
 
-    proto->timestamp = ubond_timestamp16(now64);
-    proto->len = htobe16(proto->len);
-    proto->tun_seq = htobe64(proto->tun_seq);
-    proto->data_seq = htobe64(proto->data_seq);
-    proto->flow_id = htobe32(proto->flow_id);
-    proto->timestamp = htobe16(proto->timestamp);
-    proto->timestamp_reply = htobe16(proto->timestamp_reply);
-    ret = sendto(tun->fd, proto, wlen, MSG_DONTWAIT,
-                 tun->addrinfo->ai_addr, tun->addrinfo->ai_addrlen);
-#ifdef ENABLE_CRYPTO
-    if (!(ubond_options.cleartext_data && (pkt->p.type == UBOND_PKT_DATA || pkt->p.type == UBOND_PKT_DATA_RESEND))) {
-      memcpy(proto,&tmp_proto,sizeof(tmp_proto));
-    } else
-#endif
-    {
-      memcpy(proto,&tmp_proto,PKTHDRSIZ(tmp_proto));
+const char *
+ubond_io_backend(double *ops_per_syscall)
+{
+    if (! uring_on) {
+        *ops_per_syscall = 0.0;
+        return "libev";
     }
+    *ops_per_syscall = uring.enters ?
+        (double)uring.completions / (double)uring.enters : 0.0;
+    return "io_uring";
+}
+#else
+const char *
+ubond_io_backend(double *ops_per_syscall)
+{
+    *ops_per_syscall = 0.0;
+    return "libev";
+}
+#endif /* HAVE_IO_URING */
 
-    if (ret < 0)
-    {
-        if (errno != EAGAIN && errno != EWOULDBLOCK) {
-          if (pkt->p.type!=UBOND_PKT_AUTH) {
-            log_warnx("net", "%s write error", tun->name);
-            ubond_rtun_status_down(tun);
-          } // dont report AUTH packet loss, as we know that !
-        } else {
-          // we should never attempt a send on a blockable tunnel, so we should
-          // nevr get here...
-          log_warnx("net", "%s lost write!", tun->name);
-          ubond_rtun_status_down(tun);
-        }
-    } else {
-      // we are here when we succeed to send the packet
-      
-      if (pkt->p.type!=UBOND_PKT_DATA_RESEND) {
-        if (pkt->p.reorder) data_seq++;
-      }
-//      if (pkt->p.reorder) {
-//        printf("Sending data seq %lu on %s (tun seq %lu)\n", pkt->p.data_seq, tun->name, pkt->p.tun_seq);
-//      }
-      
-        tun->sentpackets++;
-        tun->sentbytes += ret;
-        if (tun->quota) {
-          if (tun->permitted > (ret + PKTHDRSIZ(pkt->p)+IP4_UDP_OVERHEAD)) {
-            tun->permitted -= (ret + PKTHDRSIZ(pkt->p)+IP4_UDP_OVERHEAD);
-          } else {
-            tun->permitted = 0;
-          }
-        }
+/* Bytes tun may have sent diff seconds into the bandwidth window */
+static double
+ubond_rtun_budget(ubond_tunnel_t *tun, ev_tstamp diff)
+{
+  double b = tun->bytes_per_sec * diff;
+  if (tun->kernel_pacing && !tun->xsk && diff < BANDWIDTHCALCTIME)
+    /* front load the budget, the window still ends at bytes_per_sec * diff */
+    b += tun->bytes_per_sec * UBOND_PACING_AHEAD * (1 - diff / BANDWIDTHCALCTIME);
+  return b;
+}
 
-        if (wlen != ret)
-        {
-            log_warnx("net", "%s write error %d/%u",
-                tun->name, (int)ret, (unsigned int)wlen);
-        } else {
-            log_debug("net", "> %s sent %d bytes (size=%d, type=%d, seq=%"PRIu64", reorder=%d)",
-                      tun->name, (int)ret, be16toh(pkt->p.len), pkt->p.type, be64toh(pkt->p.data_seq), pkt->p.reorder);
-        }
-    }
+/* ubond_rtun_do_send() runs for t from the event loop, delay seconds from now */
+static void
+ubond_rtun_pacer_arm(ubond_tunnel_t *t, ev_tstamp delay)
+{
+  ev_timer_stop(EV_A_ &t->send_timer);
+  ev_timer_set(&t->send_timer, delay, 0.);
+  ev_timer_start(EV_A_ &t->send_timer);
+}
 
-    return ret;
+/* Something was queued for t. A tunnel which had nothing to send has no
+ * pacer armed. */
+void
+ubond_rtun_wake(ubond_tunnel_t *t)
+{
+  if (t->idle && !ev_is_active(&t->io_write))
+    ubond_rtun_pacer_arm(t, 0.);
 }
 
+/* Nothing was sent by tun: arm the pacer for when its budget covers the
+ * next packet, the inverse of ubond_rtun_budget(). An idle tunnel sleeps
+ * until ubond_rtun_wake() or a kick from the tun device, and the next
+ * bandwidth window wakes those still waiting. */
+static void
+ubond_rtun_pace(ubond_tunnel_t *tun, ev_tstamp now)
+{
+  double r = tun->bytes_per_sec, want, at, a;
+
+  if (tun->idle) {
+    if (tun->yielded && !ubond_pkt_ring_empty(&send_buffer))
+      ubond_rtun_pacer_arm(tun, UBOND_PACER_RETRY);
+    else
+      ev_timer_stop(EV_A_ &tun->send_timer);
+    return;
+  }
+  if (r <= 0) {
+    ev_timer_stop(EV_A_ &tun->send_timer);
+    return;
+  }
+  // with kernel pacing, wake up once per burst rather than per packet
+  want = tun->bytes_since_adjust +
+    (tun->kernel_pacing && !tun->xsk ? r * UBOND_PACING_AHEAD / 2 : 1);
+  at = want / r;
+  if (tun->kernel_pacing && !tun->xsk) {
+    a = (want / r - UBOND_PACING_AHEAD) /
+      (1 - UBOND_PACING_AHEAD / BANDWIDTHCALCTIME);
+    if (a < BANDWIDTHCALCTIME)
+      at = a;
+  }
+  at += tun->last_adjust - now;
+  // the budget was there but the write failed
+  ubond_rtun_pacer_arm(tun, at > 0 ? at : UBOND_PACER_RETRY);
+}
 
 static void
 ubond_rtun_do_send(ubond_tunnel_t *tun)
 {
   ev_tstamp now = ev_now(EV_DEFAULT_UC);
   ev_tstamp diff = now - tun->last_adjust;
-  
-  int len=0;
+
+  int sent=0, blocked=0;
   // if there is hp stuff for us - SEND IT !
-  double b=tun->bytes_per_sec * diff;
+  double b=ubond_rtun_budget(tun, diff);
 
   tun->idle=0;
-  if ( tun->bytes_since_adjust < b ) {
-    if (! UBOND_TAILQ_EMPTY(&tun->hpsbuf)) {
-      ubond_pkt_t *pkt=UBOND_TAILQ_POP_LAST(&tun->hpsbuf);
-      len = ubond_rtun_send(tun, pkt);
-    } else {
-      ubond_rtun_choose(tun);//EV_P_ ev_timer *w, int revents);
-      if (! UBOND_TAILQ_EMPTY(&tun->sbuf)) {
-        ubond_pkt_t *pkt=UBOND_TAILQ_POP_LAST(&tun->sbuf);
-        len = ubond_rtun_send(tun, pkt);
+#ifdef HAVE_SENDMMSG
+  // what a full socket buffer held back goes first, its budget is spent
+  if (ubond_rtun_tx_blocked(tun)) {
+    sent = ubond_rtun_send_msgs(tun);
+    blocked = ubond_rtun_tx_blocked(tun);
+  }
+#endif
+  if ( !blocked && tun->bytes_since_adjust < b ) {
+#ifdef HAVE_AF_XDP
+    if (tun->xsk) {
+      sent = ubond_rtun_send_budget(tun, b);
+      ubond_xsk_kick(tun->xsk);
+    } else
+#endif
+#ifdef HAVE_IO_URING
+    if (uring_on) {
+      sent = ubond_rtun_send_budget(tun, b);
+    } else
+#endif
+    if (tuntap.workers) {
+      sent = ubond_rtun_send_budget(tun, b);
+    } else
+#ifdef HAVE_SENDMMSG
+    if (tun->send_batch > 1) {
+      sent += ubond_rtun_send_batch(tun, b);
+      blocked = ubond_rtun_tx_blocked(tun);
+    } else
+#endif
+    {
+      ubond_pkt_t *pkt=ubond_rtun_next_pkt(tun);
+      if (pkt) {
+        int len = ubond_rtun_send(tun, pkt);
+        if (len>0) {
+          // len + the UDP  overhead ??
+          tun->bytes_since_adjust+=len+ IP4_UDP_OVERHEAD;
+          sent=1;
+        }
       } else {
         tun->idle=1;
       }
     }
-    if (ev_is_active(&tun->check_ev)) {
-      ev_check_stop(EV_A_ &tun->check_ev);
-    }
-  } else {
-// we're too soon, use a checker to wait for the right time
-    if (!ev_is_active(&tun->check_ev)) {
-      ev_check_start(EV_A_ &tun->check_ev);
-    }
   }
 
-  if (len>0) {
-    // len + the UDP  overhead ??
-    tun->bytes_since_adjust+=len+ IP4_UDP_OVERHEAD;
+  if (sent>0 || blocked) { // blocked: wait for room in the socket
+    tun->idle=0; // busy even if only the backlog went out: the write event comes back
     tun->busy_writing++; // semaphore that we're busy
     if (!ev_is_active(&tun->io_write)) {
       ev_io_start(EV_A_ &tun->io_write);
     }
+    ev_timer_stop(EV_A_ &tun->send_timer);
   } else { // nothing sent, so disable the write events
     if (ev_is_active(&tun->io_write)) {
       ev_io_stop(EV_A_ &tun->io_write);
     }
+    // and wait for the budget instead
+    ubond_rtun_pace(tun, now);
   }
 }
 static void
@@ -868,13 +2160,6 @@ ubond_rtun_write_timeout(EV_P_ ev_timer *w, int revents)
   if (!tun->busy_writing) ubond_rtun_do_send(tun);
 }
 
-static void
-ubond_rtun_write_check(EV_P_ ev_check *w, int revents)
-{
-  ubond_tunnel_t *tun = w->data;
-  if (!tun->busy_writing) ubond_rtun_do_send(tun);
-}
-
 ubond_tunnel_t *
 ubond_rtun_new(const char *name,
                const char *bindaddr, const char *bindport, const char *binddev, uint32_t bindfib,
@@ -904,10 +2189,11 @@ ubond_rtun_new(const char *name,
         }
     }
 
-    new = (ubond_tunnel_t *)calloc(1, sizeof(ubond_tunnel_t));
-    if (! new)
-        fatal(NULL, "calloc failed");
-    /* other values are enforced by calloc to 0/NULL */
+    /* the datapath fields are laid out on cache lines */
+    if (posix_memalign((void **)&new, 64, sizeof(ubond_tunnel_t)) != 0)
+        fatal(NULL, "posix_memalign failed");
+    memset(new, 0, sizeof(ubond_tunnel_t));
+    /* other values are enforced by memset to 0/NULL */
     new->name = strdup(name);
     new->fd = -1;
     new->server_mode = server_mode;
@@ -958,8 +2244,8 @@ ubond_rtun_new(const char *name,
         strlcpy(new->destaddr, destaddr, sizeof(new->destaddr));
     if (destport)
         strlcpy(new->destport, destport, sizeof(new->destport));
-    ubond_pkt_list_init(&new->sbuf, PKTBUFSIZE);
-    ubond_pkt_list_init(&new->hpsbuf, PKTBUFSIZE);
+    ubond_pkt_ring_init(&new->sbuf, PKTBUFSIZE);
+    ubond_pkt_ring_init(&new->hpsbuf, PKTBUFSIZE);
     ubond_rtun_tick(new);
     new->timeout = timeout;
     new->next_keepalive = 0;
@@ -972,19 +2258,38 @@ ubond_rtun_new(const char *name,
     ev_timer_init(&new->io_timeout, ubond_rtun_check_timeout,
         0., UBOND_IO_TIMEOUT_DEFAULT);
     ev_timer_start(EV_A_ &new->io_timeout);
-    new->check_ev.data = new;
-    ev_check_init(&new->check_ev, ubond_rtun_write_check);
     new->send_timer.data = new;
-    ev_timer_init(&new->send_timer, &ubond_rtun_write_timeout, 0., 0.01);
-    ev_timer_start(EV_A_ &new->send_timer);
+    ev_timer_init(&new->send_timer, &ubond_rtun_write_timeout, 0., 0.);
+    new->idle = 1; // until something is queued
 
     new->last_adjust=ev_now(EV_DEFAULT_UC);
     new->bytes_since_adjust=0;
     new->bytes_per_sec=0;
     new->busy_writing=0;
     new->lossless=0;
-
-    memset(&new->old_pkts, 0, sizeof(new->old_pkts));
+    new->recv_batch=1;
+    new->rx_batches=0;
+    new->rx_batch_pkts=0;
+    new->send_batch=1;
+    new->tx_batch=NULL;
+    new->tx_batches=0;
+    new->tx_batch_pkts=0;
+    new->gso=0;
+    new->kernel_pacing=0;
+    new->pacing_rate=0;
+    new->gso_sends=0;
+    new->gso_segments=0;
+    new->gro=0;
+    new->gro_recvs=0;
+    new->gro_segments=0;
+    new->link_mtu=DEFAULT_MTU;
+
+    new->old_pkts = calloc(1, RESENDBUFSIZE * sizeof(ubond_pkt_t *) +
+                           sizeof(struct ubond_data_seq_hist));
+    if (! new->old_pkts)
+        fatal(NULL, "calloc failed");
+    new->data_seq_hist = (struct ubond_data_seq_hist *)
+        (new->old_pkts + RESENDBUFSIZE);
     update_process_title();
     return new;
 }
@@ -997,6 +2302,19 @@ ubond_rtun_drop(ubond_tunnel_t *t)
     ubond_rtun_status_down(t);
     ev_timer_stop(EV_A_ &t->io_timeout);
     ev_io_stop(EV_A_ &t->io_read);
+    /* nothing may be sent once the resend ring is gone */
+    ev_io_stop(EV_A_ &t->io_write);
+    ev_timer_stop(EV_A_ &t->send_timer);
+#ifdef HAVE_IO_URING
+    ubond_uring_rtun_stop(t);
+    ubond_uring_rtun_forget(t);
+#endif
+#ifdef HAVE_LINUX
+    ubond_workers_forget(t);
+#endif
+#ifdef HAVE_AF_XDP
+    ubond_rtun_xdp_stop(t);
+#endif
 
     LIST_FOREACH(tmp, &rtuns, entries)
     {
@@ -1007,12 +2325,17 @@ ubond_rtun_drop(ubond_tunnel_t *t)
                 free(tmp->name);
             if (tmp->addrinfo)
                 freeaddrinfo(tmp->addrinfo);
-            while (!UBOND_TAILQ_EMPTY(&tmp->sbuf)) {
-              ubond_pkt_release(UBOND_TAILQ_POP_LAST(&tmp->sbuf));
-            }
-            while (!UBOND_TAILQ_EMPTY(&tmp->hpsbuf)) {
-              ubond_pkt_release(UBOND_TAILQ_POP_LAST(&tmp->hpsbuf));
+            ubond_pkt_ring_free(&tmp->sbuf);
+            ubond_pkt_ring_free(&tmp->hpsbuf);
+            for (int i = 0; i < RESENDBUFSIZE; i++) {
+              if (tmp->old_pkts[i])
+                ubond_pkt_release(tmp->old_pkts[i]);
             }
+            free(tmp->old_pkts);
+            tmp->old_pkts = NULL;
+            free(tmp->tx_batch);
+            tmp->tx_batch = NULL;
+            tmp->data_seq_hist = NULL;
             /* Safety */
             tmp->name = NULL;
             break;
@@ -1026,6 +2349,62 @@ ubond_rtun_drop(ubond_tunnel_t *t)
 /* Based on tunnel bandwidth, with priority compute a "weight" value
  * to balance correctly the round robin rtun_choose.
  */
+/* Cap the socket at HEADROOM times the rate of t, or lift the cap once
+ * kernel_pacing is off. The fq qdisc on the egress interface enforces it. */
+void
+ubond_rtun_set_pacing(ubond_tunnel_t *t)
+{
+#ifdef SO_MAX_PACING_RATE
+  unsigned int rate = ~0U;
+  double r = t->bytes_per_sec * UBOND_PACING_HEADROOM;
+
+  if (t->kernel_pacing) {
+    rate = r < (double)(~0U - 1) ? (unsigned int)r : ~0U - 1;
+    if (rate < 2 * DEFAULT_MTU)
+      rate = 2 * DEFAULT_MTU;
+  }
+  // changes under 1/16th are not worth a system call
+  if (t->pacing_rate && rate != ~0U && t->pacing_rate != ~0U &&
+      rate < t->pacing_rate + t->pacing_rate/16 &&
+      rate > t->pacing_rate - t->pacing_rate/16)
+    return;
+  if (rate == t->pacing_rate || t->fd < 0)
+    return;
+  if (setsockopt(t->fd, SOL_SOCKET, SO_MAX_PACING_RATE,
+                 &rate, sizeof(rate)) < 0) {
+    log_warn(NULL, "%s kernel pacing not available", t->name);
+    t->kernel_pacing = 0;
+    return;
+  }
+  t->pacing_rate = rate;
+#else
+  if (t->kernel_pacing) {
+    log_warnx(NULL, "%s kernel pacing not supported on this system", t->name);
+    t->kernel_pacing = 0;
+  }
+#endif
+}
+
+/* Probe the socket of t for UDP segmentation offload support (Linux
+ * 4.18+), gso is turned off when it is missing. A socket not opened yet is
+ * probed by ubond_rtun_start(). */
+void
+ubond_rtun_set_gso(ubond_tunnel_t *t)
+{
+#ifdef UDP_SEGMENT
+  int gso_size = 0;
+  if (t->fd < 0)
+    return;
+  if (setsockopt(t->fd, IPPROTO_UDP, UDP_SEGMENT, &gso_size, sizeof(gso_size)) < 0) {
+    log_warn(NULL, "%s UDP GSO not available", t->name);
+    t->gso = 0;
+  }
+#else
+  log_warnx(NULL, "%s UDP GSO not supported on this system", t->name);
+  t->gso = 0;
+#endif
+}
+
 static void
 ubond_rtun_recalc_weight()
 {
@@ -1096,17 +2475,12 @@ ubond_rtun_recalc_weight()
       if (t->weight>0) {
           double b = t->weight*128.0;
           t->bytes_per_sec=b;
-
-          ev_tstamp repeat = (float)(DEFAULT_MTU/10) / t->bytes_per_sec;
-
-          if (repeat > UBOND_IO_TIMEOUT_DEFAULT) repeat=UBOND_IO_TIMEOUT_DEFAULT;
-          t->send_timer.repeat = repeat;//*/((t->send_timer.repeat * 19) + repeat
-          //*)/20;
       } else {
           t->bytes_per_sec = DEFAULT_MTU*2;  //even for non-active tunnels, give
           //them enough bandwidth to do 'timeout pings' etc...
-          t->send_timer.repeat = UBOND_IO_TIMEOUT_DEFAULT;
       }
+      if (t->kernel_pacing)
+          ubond_rtun_set_pacing(t);
   }
 }
 
@@ -1247,16 +2621,50 @@ ubond_rtun_start(ubond_tunnel_t *t)
         }
     }
 
+    if (t->gso)
+        ubond_rtun_set_gso(t);
+    if (t->gro) {
+#if defined(UDP_GRO) && defined(HAVE_RECVMMSG)
+        /* let the kernel merge back to back datagrams (Linux 5.0+) */
+        int on = 1;
+        if (setsockopt(fd, IPPROTO_UDP, UDP_GRO, &on, sizeof(on)) < 0) {
+            log_warn(NULL, "%s UDP GRO not available", t->name);
+            t->gro = 0;
+        }
+#else
+        log_warnx(NULL, "%s UDP GRO not supported on this system", t->name);
+        t->gro = 0;
+#endif
+    }
+
+    t->pacing_rate = 0;
+    if (t->kernel_pacing)
+        ubond_rtun_set_pacing(t);
+
     /* set non blocking after connect... May lockup the entiere process */
     ubond_sock_set_nonblocking(fd);
     ubond_rtun_tick(t);
     ev_io_set(&t->io_read, fd, EV_READ);
     ev_io_set(&t->io_write, fd, EV_WRITE);
+#ifdef HAVE_IO_URING
+    /* merged GRO datagrams do not fit the ring buffers */
+    if (uring_on && !t->gro)
+        ubond_uring_rtun_arm(t);
+    else
+#endif
     ev_io_start(EV_A_ &t->io_read);
+    if (*t->xdp_interface)
+        ubond_rtun_xdp_setup(t);
     t->io_timeout.repeat = UBOND_IO_TIMEOUT_DEFAULT;
     return 0;
 error:
     if (t->fd > 0) {
+#ifdef HAVE_SENDMMSG
+        ubond_rtun_tx_discard(t);
+#endif
+#ifdef HAVE_LINUX
+        ubond_workers_forget(t);
+#endif
         close(t->fd);
         t->fd = -1;
     }
@@ -1372,12 +2780,9 @@ ubond_rtun_status_up(ubond_tunnel_t *t)
         ubond_rtun_tuntap_up();
     }
 
-    while (!UBOND_TAILQ_EMPTY(&t->sbuf)) {
-      ubond_pkt_release(UBOND_TAILQ_POP_LAST(&t->sbuf));
-    }
-    while (!UBOND_TAILQ_EMPTY(&t->hpsbuf)) {
-      ubond_pkt_release(UBOND_TAILQ_POP_LAST(&t->hpsbuf));
-    }
+    ubond_pkt_ring_flush(&t->sbuf);
+    ubond_pkt_ring_flush(&t->hpsbuf);
+    ubond_rtun_wake(t);
 }
 
 void
@@ -1406,15 +2811,17 @@ ubond_rtun_status_down(ubond_tunnel_t *t)
     ubond_rtun_recalc_weight();
 
     // hpsbuf has tun specific stuff in it, drop it.
-    while (!UBOND_TAILQ_EMPTY(&t->hpsbuf))
-    {
-      ubond_pkt_release(UBOND_TAILQ_POP_LAST(&t->hpsbuf));
-    }
+    ubond_pkt_ring_flush(&t->hpsbuf);
+#ifdef HAVE_SENDMMSG
+    ubond_rtun_tx_discard(t);
+#endif
+#ifdef HAVE_LINUX
+    // and so has what the tun queue workers still hold for it
+    ubond_workers_forget(t);
+#endif
     // everythign in our send buffer, we'll drop - they will bound to ask for
     // more, and better they ask for the right things
-    while (!UBOND_TAILQ_EMPTY(&t->sbuf)) {
-      ubond_pkt_release(UBOND_TAILQ_POP_LAST(&t->sbuf));
-    }
+    ubond_pkt_ring_flush(&t->sbuf);
     // for the normal buffer, lets request resends of all possible packets from
     // the last one we recieved
     ubond_rtun_request_resend(t, t->seq_last, RESENDBUFSIZE);
@@ -1476,11 +2883,11 @@ ubond_rtun_challenge_send(ubond_tunnel_t *t)
 {
     ubond_pkt_t *pkt;
 
-    if (ubond_pkt_list_is_full(&t->hpsbuf))
+    if (ubond_pkt_ring_is_full(&t->hpsbuf))
         log_warnx("net", "%s high priority buffer: overflow", t->name);
 
-    pkt = ubond_pkt_get();
-    UBOND_TAILQ_INSERT_HEAD(&t->hpsbuf, pkt);
+    if (! (pkt = ubond_pkt_get_size(UBOND_PKT_SMALL)))
+        return; /* retried by the next connection attempt */
     pkt->p.data[0] = 'A';
     pkt->p.data[1] = 'U';
     pkt->p.len = 2;
@@ -1491,6 +2898,8 @@ ubond_rtun_challenge_send(ubond_tunnel_t *t)
     }
 
     pkt->p.type = UBOND_PKT_AUTH;
+    ubond_pkt_ring_put(&t->hpsbuf, pkt);
+    ubond_rtun_wake(t);
 
     t->status = UBOND_AUTHSENT;
     log_debug("protocol", "%s ubond_rtun_challenge_send", t->name);
@@ -1509,12 +2918,11 @@ ubond_rtun_send_auth(ubond_tunnel_t *t)
             ubond_rtun_status_up(t); // mark this as up, before trying to send
                                      // somethign on it !
 
-            if (ubond_pkt_list_is_full(&t->hpsbuf)) {
+            if (ubond_pkt_ring_is_full(&t->hpsbuf)) {
                 log_warnx("net", "%s high priority buffer: overflow", t->name);
             }
-            pkt = ubond_pkt_get();
-            UBOND_TAILQ_INSERT_HEAD(&t->hpsbuf, pkt);
-
+            if (! (pkt = ubond_pkt_get_size(UBOND_PKT_SMALL)))
+                return; /* the client asks again */
             pkt->p.data[0] = 'O';
             pkt->p.data[1] = 'K';
             pkt->p.len = 2;
@@ -1525,6 +2933,8 @@ ubond_rtun_send_auth(ubond_tunnel_t *t)
             }
 
             pkt->p.type = UBOND_PKT_AUTH_OK;
+            ubond_pkt_ring_put(&t->hpsbuf, pkt);
+            ubond_rtun_wake(t);
             if (t->status < UBOND_AUTHOK)
                 t->status = UBOND_AUTHSENT;
             log_debug("protocol", "%s sending 'OK'", t->name);
@@ -1544,9 +2954,8 @@ static void
 ubond_rtun_request_resend(ubond_tunnel_t *loss_tun, uint64_t tun_seqn, int len)
 {
     ubond_pkt_t *pkt;
-    pkt = ubond_pkt_get();
-    ubond_buffer_write(&hpsend_buffer,pkt);
-
+    if (! (pkt = ubond_pkt_get_size(UBOND_PKT_SMALL)))
+        return;
     struct resend_data *d=(struct resend_data *)(pkt->p.data);
     d->r='R';
     d->s='S';
@@ -1558,10 +2967,21 @@ ubond_rtun_request_resend(ubond_tunnel_t *loss_tun, uint64_t tun_seqn, int len)
 
     pkt->p.type = UBOND_PKT_RESEND;
     out_resends+=len;
+    ubond_buffer_write(&hpsend_buffer,pkt);
+    ubond_hpsend_wake();
 
     log_debug("resend", "Request resend %lu (lost from tunnel %s)",/* t->name,*/ tun_seqn, loss_tun->name);
 }
 
+/* hpsend_buffer got packets, whichever link is free takes them */
+static void
+ubond_hpsend_wake()
+{
+  ubond_tunnel_t *t;
+  LIST_FOREACH(t, &rtuns, entries)
+    ubond_rtun_wake(t);
+}
+
 static ubond_tunnel_t *ubond_find_tun(int id)
 {
   ubond_tunnel_t *t;
@@ -1587,11 +3007,14 @@ ubond_rtun_resend(struct resend_data *d)
     uint64_t seqn=d->seqn+i;
     ubond_pkt_t *old_pkt=loss_tun->old_pkts[seqn % RESENDBUFSIZE];
     if (old_pkt && old_pkt->p.tun_seq==seqn) {
-      if (old_pkt->p.type!=UBOND_PKT_DATA || old_pkt->p.reorder /*|| old_pkt->p.data[9]==17*/) { // only send tcp, e.g. refuse UDP packets!
-        ubond_buffer_write(&hpsend_buffer,old_pkt);
+      // refuse best effort traffic (by default, all but tcp), and copies:
+      // the link of the original resends that one if it is lost
+      if (old_pkt->p.type!=UBOND_PKT_DATA_COPY &&
+          (old_pkt->p.type!=UBOND_PKT_DATA || old_pkt->policy!=UBOND_POLICY_BEST_EFFORT)) {
         loss_tun->old_pkts[seqn % RESENDBUFSIZE]=NULL; // remove this from the old list
         if (old_pkt->p.type==UBOND_PKT_DATA) old_pkt->p.type=UBOND_PKT_DATA_RESEND;
         log_debug("resend", "resend packet (tun seq: %lu data seq %lu) previously sent on %s", /*t->name,*/ seqn, old_pkt->p.data_seq, loss_tun->name);
+        ubond_buffer_write(&hpsend_buffer,old_pkt);
 
       } else {
         log_debug("resend", "Wont resent packet (tun seq: %lu data seq %lu) of type %d", seqn, old_pkt->p.data_seq, (unsigned char)old_pkt->p.data[6]);
@@ -1605,6 +3028,31 @@ ubond_rtun_resend(struct resend_data *d)
       
     }
   }
+  ubond_hpsend_wake();
+}
+
+/* The packet pool is exhausted: drop the oldest packets of every resend
+ * buffer, they are the least likely to be asked for again. The last
+ * UBOND_BATCH_MAX stay, a sendmmsg batch being built points into them. */
+#define UBOND_RECLAIM_BATCH 64
+static void
+ubond_rtun_reclaim()
+{
+    ubond_tunnel_t *t;
+    uint64_t seqn;
+    int n;
+
+    LIST_FOREACH(t, &rtuns, entries) {
+        n = 0;
+        for (seqn = t->seq; seqn < t->seq + RESENDBUFSIZE - UBOND_BATCH_MAX &&
+                 n < UBOND_RECLAIM_BATCH; seqn++) {
+            if (t->old_pkts[seqn % RESENDBUFSIZE]) {
+                ubond_pkt_release(t->old_pkts[seqn % RESENDBUFSIZE]);
+                t->old_pkts[seqn % RESENDBUFSIZE] = NULL;
+                n++;
+            }
+        }
+    }
 }
 
 static void
@@ -1755,32 +3203,40 @@ void ubond_calc_bandwidth(EV_P_ ev_timer *w, int revents)
   srtt_av=new_srtt_av/tuns; // tuns is the OK tunnels
 
   ubond_rtun_recalc_weight();
+
+  // a new window: the tunnels waiting for budget have some
+  LIST_FOREACH(t, &rtuns, entries) {
+    if (!t->idle && !ev_is_active(&t->io_write))
+      ubond_rtun_pacer_arm(t, 0.);
+  }
 }
 
 static void
 ubond_rtun_choose(ubond_tunnel_t *rtun)
 {
 
+  rtun->yielded=0;
   if (rtun->status!=UBOND_AUTHOK) return;
   if (rtun->quota && rtun->permitted < DEFAULT_MTU*2) return;
   if (ubond_status.fallback_mode!=rtun->fallback_only ) return;
 
   ubond_pkt_t *spkt=NULL;
-  if (!UBOND_TAILQ_EMPTY(&hpsend_buffer) &&
+  if (!ubond_pkt_ring_empty(&hpsend_buffer) &&
       (rtun->sent_loss <= (LOSS_TOLERENCE/4.0))) {
-    spkt = UBOND_TAILQ_POP_LAST(&hpsend_buffer);
+    spkt = ubond_pkt_ring_get(&hpsend_buffer);
   } else {
-    if (!UBOND_TAILQ_EMPTY(&send_buffer)) {
-      spkt = UBOND_TAILQ_POP_LAST(&send_buffer);
+    if ((spkt = ubond_pkt_ring_peek(&send_buffer)) &&
+        !ubond_sched_take(rtun, spkt->p.len + IP4_UDP_OVERHEAD)) {
+      rtun->yielded=1;
+      return;
     }
+    spkt = ubond_pkt_ring_get(&send_buffer);
   }
   if (!spkt) return;
   
-  if (!ev_is_active(&tuntap.io_read)) {
-    ev_io_start(EV_A_ &tuntap.io_read);
-  }
+  ubond_tuntap_read_start();
 
-  ubond_pkt_list_t *sbuf = &rtun->sbuf;
+  ubond_pkt_ring_t *sbuf = &rtun->sbuf;
   
 #ifdef HAVE_FILTERS
   u_char *data=(u_char *)(spkt->p.data);
@@ -1791,14 +3247,15 @@ ubond_rtun_choose(ubond_tunnel_t *rtun)
     /* High priority buffer, not reorderd when a filter applies */
     rtun=frtun;
     sbuf = &rtun->hpsbuf;
+    ubond_rtun_wake(rtun);
   }
 #endif
   
-  if (ubond_pkt_list_is_full(sbuf))
+  if (ubond_pkt_ring_is_full(sbuf))
     log_warnx("tuntap", "%s buffer: overflow", rtun->name);
   
   /* Ask for a free buffer */
-  UBOND_TAILQ_INSERT_HEAD(sbuf, spkt);
+  ubond_pkt_ring_put(sbuf, spkt);
 
   return;
 }
@@ -1808,14 +3265,14 @@ static void
 ubond_rtun_send_keepalive(ev_tstamp now, ubond_tunnel_t *t)
 {
     ubond_pkt_t *pkt;
-    if (ubond_pkt_list_is_full(&t->hpsbuf))
+    if (ubond_pkt_ring_is_full(&t->hpsbuf))
         log_warnx("net", "%s high priority buffer: overflow", t->name);
-    else {
+    else if ((pkt = ubond_pkt_get_size(UBOND_PKT_SMALL))) {
         log_debug("protocol", "%s sending keepalive", t->name);
-        pkt = ubond_pkt_get();
-        UBOND_TAILQ_INSERT_HEAD(&t->hpsbuf, pkt);
         pkt->p.type = UBOND_PKT_KEEPALIVE;
         pkt->p.len = sprintf(pkt->p.data,"%lu",t->bandwidth_measured) + 1;
+        ubond_pkt_ring_put(&t->hpsbuf, pkt);
+        ubond_rtun_wake(t);
     }
     t->next_keepalive = NEXT_KEEPALIVE(now, t);
 }
@@ -1824,14 +3281,14 @@ static void
 ubond_rtun_send_disconnect(ubond_tunnel_t *t)
 {
     ubond_pkt_t *pkt;
-    if (ubond_pkt_list_is_full(&t->hpsbuf))
+    if (ubond_pkt_ring_is_full(&t->hpsbuf))
         log_warnx("net", "%s high priority buffer: overflow", t->name);
-    else {
+    else if ((pkt = ubond_pkt_get_size(UBOND_PKT_SMALL))) {
         log_debug("protocol", "%s sending disconnect", t->name);
-        pkt = ubond_pkt_get();
-        UBOND_TAILQ_INSERT_HEAD(&t->hpsbuf, pkt);
         pkt->p.type = UBOND_PKT_DISCONNECT;
         pkt->p.len = 1;
+        ubond_pkt_ring_put(&t->hpsbuf, pkt);
+        ubond_rtun_wake(t);
     }
 }
 
@@ -1909,33 +3366,131 @@ ubond_rtun_check_timeout(EV_P_ ev_timer *w, int revents)
 }
 
 
+/* (re)arm the read watchers of every tun queue */
+static void
+ubond_tuntap_read_start()
+{
+    int i;
+
+#ifdef HAVE_LINUX
+    if (tuntap.workers) {
+        /* the rings filled up meanwhile, take from them again */
+        if (tuntap_paused) {
+            tuntap_paused = 0;
+            ubond_workers_notify();
+        }
+        return;
+    }
+#endif
+#ifdef HAVE_IO_URING
+    if (uring_tun_read) {
+        for (i = 0; i < tuntap.queues; i++) {
+            if (!uring_tun_armed[i])
+                ubond_uring_tun_arm(i);
+        }
+        return;
+    }
+#endif
+    for (i = 0; i < tuntap.queues; i++) {
+        if (!ev_is_active(&tuntap.io_read[i])) {
+            ev_io_start(EV_DEFAULT_UC_ &tuntap.io_read[i]);
+        }
+    }
+}
+
+/* ring reads and workers pause by themselves once send_buffer is full */
+static void
+ubond_tuntap_read_stop()
+{
+    int i;
+    for (i = 0; i < tuntap.queues; i++) {
+        if (ev_is_active(&tuntap.io_read[i])) {
+            ev_io_stop(EV_DEFAULT_UC_ &tuntap.io_read[i]);
+        }
+    }
+}
+
+/* new data in send_buffer: wake up the tunnels waiting for some */
+static void
+ubond_tuntap_kick()
+{
+    ubond_tunnel_t *t;
+    LIST_FOREACH(t, &rtuns, entries) {
+        if (t->idle) {
+            ubond_rtun_do_send(t);
+            if (ubond_pkt_ring_empty(&send_buffer)) break;
+        }
+    }
+}
+
+#ifdef HAVE_LINUX
+/* The tun queue workers read something, or are done with sends: what they
+ * read goes to send_buffer, as far as it takes it */
+static void
+ubond_tuntap_workers_event()
+{
+    ubond_pkt_t *pkts[UBOND_TUN_READ_BATCH_MAX];
+    uint32_t room;
+    int n, cnt = 0;
+
+    ubond_pkt_pool_reclaim_pending();
+    while (!(tuntap_paused = ubond_pkt_ring_is_full(&send_buffer))) {
+      room = send_buffer.max_size - ubond_pkt_ring_length(&send_buffer);
+      if (!(n = ubond_workers_read(pkts, MIN(room, UBOND_TUN_READ_BATCH_MAX))))
+        break;
+      ubond_buffer_write_n(&send_buffer, pkts, n);
+      cnt += n;
+    }
+    if (cnt) {
+      ev_now_update(EV_DEFAULT_UC);
+      ubond_tuntap_kick();
+    }
+}
+#endif
+
 static void
 tuntap_io_event(EV_P_ ev_io *w, int revents)
 {
     if (revents & EV_READ) {
-      if (!ubond_pkt_list_is_full(&send_buffer)) {
-        ubond_buffer_write(&send_buffer,ubond_tuntap_read(&tuntap));
-        ubond_tunnel_t *t;
-        ev_now_update(EV_DEFAULT_UC);
-        LIST_FOREACH(t, &rtuns, entries) {
-          if (t->idle) {
-            ubond_rtun_do_send(t);
-            if (UBOND_TAILQ_EMPTY(&send_buffer)) break;
-          }
+      if (!ubond_pkt_ring_is_full(&send_buffer)) {
+        ubond_pkt_t *pkts[UBOND_TUN_READ_BATCH_MAX];
+        uint32_t room = send_buffer.max_size - ubond_pkt_ring_length(&send_buffer);
+        int q = w - tuntap.io_read;
+        struct tuntap_queue *tq = &tuntap.q[q];
+        int n, cnt = 0;
+        /* drain up to read_batch packets, queue them at once, then a
+         * single pass over the tunnels sends them */
+        tq->read_wakeups++;
+        for (n = 0; n < tuntap.read_batch && cnt < room; n++) {
+          if (!(pkts[cnt] = ubond_tuntap_read(&tuntap, q)))
+            break;
+          tq->read_packets++;
+          cnt++;
+          if (UBOND_TAILQ_EMPTY(&tq->rbuf))
+            continue;
+          /* rest of a segmented super-packet */
+          ubond_buffer_write_n(&send_buffer, pkts, cnt);
+          cnt = 0;
+          while (!UBOND_TAILQ_EMPTY(&tq->rbuf))
+            ubond_buffer_write(&send_buffer,UBOND_TAILQ_POP_LAST(&tq->rbuf));
+          if (ubond_pkt_ring_is_full(&send_buffer))
+            break;
+          room = send_buffer.max_size - ubond_pkt_ring_length(&send_buffer);
         }
+        ubond_buffer_write_n(&send_buffer, pkts, cnt);
+        ev_now_update(EV_DEFAULT_UC);
+        ubond_tuntap_kick();
       } else {
-        if (ev_is_active(&tuntap.io_read)) {
-          ev_io_stop(EV_A_ &tuntap.io_read);
-        }
+        ubond_tuntap_read_stop();
       }
     }
     else if (revents & EV_WRITE) {
-      if (!UBOND_TAILQ_EMPTY(&tuntap.sbuf)) {
-        ubond_pkt_t *pkt=UBOND_TAILQ_POP_LAST(&tuntap.sbuf);
+      ubond_pkt_t *pkt=ubond_pkt_ring_get(&tuntap.sbuf);
+      if (pkt) {
         ubond_tuntap_write(&tuntap, pkt);
         /* Nothing else to read */
       }
-      if (UBOND_TAILQ_EMPTY(&tuntap.sbuf)) {
+      if (ubond_pkt_ring_empty(&tuntap.sbuf)) {
         ev_io_stop(EV_A_ &tuntap.io_write);
       }
     }
@@ -1945,13 +3500,19 @@ static void
 ubond_tuntap_init()
 {
     ubond_proto_t proto;
+    int i;
     memset(&tuntap, 0, sizeof(tuntap));
     snprintf(tuntap.devname, UBOND_IFNAMSIZ-1, "%s", "ubond0");
-    tuntap.maxmtu = 1500 - PKTHDRSIZ(proto) - IP4_UDP_OVERHEAD;
+    tuntap.maxmtu = DEFAULT_MTU - PKTHDRSIZ(proto) - IP4_UDP_OVERHEAD;
     log_debug(NULL, "absolute maximum mtu: %d", tuntap.maxmtu);
     tuntap.type = UBOND_TUNTAPMODE_TUN;
-    ubond_pkt_list_init(&tuntap.sbuf, PKTBUFSIZE);
-    ev_init(&tuntap.io_read, tuntap_io_event);
+    tuntap.queues = 1;
+    tuntap.read_batch = 1;
+    ubond_pkt_ring_init(&tuntap.sbuf, PKTBUFSIZE);
+    for (i = 0; i < UBOND_TUN_QUEUES_MAX; i++) {
+        ubond_pkt_list_init(&tuntap.q[i].rbuf, PKTBUFSIZE);
+        ev_init(&tuntap.io_read[i], tuntap_io_event);
+    }
     ev_init(&tuntap.io_write, tuntap_io_event);
 }
 
@@ -2001,7 +3562,16 @@ ubond_config_reload(EV_P_ ev_signal *w, int revents)
     int config_fd = priv_open_config("");
     if (config_fd > 0)
     {
-        if (ubond_config(config_fd, 0) != 0) {
+        int ret;
+#ifdef HAVE_LINUX
+        /* the workers use the policy table and the key */
+        ubond_workers_park();
+        ret = ubond_config(config_fd, 0);
+        ubond_workers_unpark();
+#else
+        ret = ubond_config(config_fd, 0);
+#endif
+        if (ret != 0) {
             log_warn("config", "reload failed");
         } else {
             if (time(&ubond_status.last_reload) == -1)
@@ -2197,26 +3767,52 @@ main(int argc, char **argv)
 
     if (ubond_config(config_fd, 1) != 0)
         fatalx("cannot open config file");
+    ubond_pkt_pool_init(ubond_options.pkt_pool_size,
+                        ubond_options.pkt_pool_max,
+                        ubond_options.pkt_pool_flags);
+    ubond_pkt_pool_set_reclaim(ubond_rtun_reclaim);
 
     {
       ubond_tunnel_t *t;
       int i=0,p=0;
+      uint32_t link_mtu = 0;
       LIST_FOREACH(t, &rtuns, entries) {i++;if (1<<p < i) p++;}
-      ubond_pkt_list_init(&send_buffer, PKTBUFSIZE);
-      ubond_pkt_list_init(&hpsend_buffer, PKTBUFSIZE);
+      ubond_pkt_ring_init(&send_buffer, PKTBUFSIZE);
+      ubond_pkt_ring_init(&hpsend_buffer, PKTBUFSIZE);
+      /* any packet read from the tun device must fit every link */
+      LIST_FOREACH(t, &rtuns, entries) {
+        if (! link_mtu || t->link_mtu < link_mtu)
+          link_mtu = t->link_mtu;
+      }
+      if (link_mtu) {
+        tuntap.maxmtu = link_mtu - UBOND_PROTO_HDRSIZ - IP4_UDP_OVERHEAD;
+        log_debug(NULL, "absolute maximum mtu: %d", tuntap.maxmtu);
+      }
     }
 
     if (ubond_tuntap_alloc(&tuntap) <= 0)
         fatalx("cannot create tunnel device");
+    else if (tuntap.queues > 1)
+        log_info(NULL, "created interface `%s' with %d queues",
+            tuntap.devname, tuntap.queues);
     else
         log_info(NULL, "created interface `%s'", tuntap.devname);
-    ubond_sock_set_nonblocking(tuntap.fd);
+    for (i = 0; i < tuntap.queues; i++)
+        ubond_sock_set_nonblocking(tuntap.qfd[i]);
 
     preset_permitted(argc, saved_argv);
 
-    ev_io_set(&tuntap.io_read, tuntap.fd, EV_READ);
+#ifdef HAVE_LINUX
+    tuntap.workers = ubond_workers_start(&tuntap, ubond_tuntap_workers_event,
+                                      ubond_worker_rtun_failed);
+#endif
+#ifdef HAVE_IO_URING
+    ubond_uring_setup();
+#endif
+    for (i = 0; i < tuntap.queues; i++)
+        ev_io_set(&tuntap.io_read[i], tuntap.qfd[i], EV_READ);
+    ubond_tuntap_read_start();
     ev_io_set(&tuntap.io_write, tuntap.fd, EV_WRITE);
-    ev_io_start(loop, &tuntap.io_read);
 
     priv_set_running_state();
 
@@ -52,6 +52,14 @@
 #define PKTBUFSIZE 1024
 #define RESENDBUFSIZE 10240
 
+/* Maximum number of datagrams moved per recvmmsg(2)/sendmmsg(2) call */
+#define UBOND_BATCH_MAX 64
+
+/* Path MTU of a tunnel link, jumbo frames included */
+#define UBOND_LINK_MTU_MIN 576
+#define UBOND_LINK_MTU_MAX \
+    (UBOND_PKT_JUMBO - crypto_PADSIZE + UBOND_PROTO_HDRSIZ + IP4_UDP_OVERHEAD)
+
 /* tuntap interface name size */
 #ifndef IFNAMSIZ
  #define IFNAMSIZ 16
@@ -82,6 +90,21 @@
  */
 #define UBOND_PROTOCOL_VERSION 2
 
+enum ubond_io_backend {
+    UBOND_IO_BACKEND_LIBEV,
+    UBOND_IO_BACKEND_URING
+};
+
+/* How the links share the packets read from the tun device, see linksched.c */
+enum ubond_scheduler {
+    UBOND_SCHED_WEIGHTED,   /* each link sends at its weight */
+    UBOND_SCHED_DRR,        /* deficit round robin, by weight */
+    UBOND_SCHED_MIN_RTT,    /* the lowest round trip with budget left */
+    UBOND_SCHED_EARLIEST,   /* the link delivering first takes the packet */
+    UBOND_SCHED_REDUNDANT,  /* every link sends every packet */
+    UBOND_SCHED_COUNT
+};
+
 struct ubond_options_s
 {
     /* use ps_status or not ? */
@@ -111,7 +134,13 @@ struct ubond_options_s
     int static_tunnel;
     int root_allowed;
     uint32_t reorder_buffer_size;
+    uint32_t reorder_flows; /* sequences the sender splits flows over */
+    enum ubond_scheduler scheduler;
     uint32_t fallback_available;
+    enum ubond_io_backend io_backend;
+    uint32_t pkt_pool_size;
+    uint32_t pkt_pool_max;
+    int pkt_pool_flags;
 };
 
 struct ubond_status_s
@@ -132,77 +161,128 @@ enum chap_status {
 
 LIST_HEAD(rtunhead, ubond_tunnel_s);
 
+/* data_seq received on a link, for the loss inference of the reorder
+ * buffer */
+struct ubond_data_seq_hist
+{
+    uint64_t settled[UBOND_REORDER_FLOWS_MAX]; /* highest data_seq of each
+                             flow group past the link's reorder window */
+    uint64_t recv[64];    /* data_seq carried by the last 64 tun_seq */
+};
+
+/*
+ * Fields are grouped by how often the datapath touches them: the first
+ * cache lines hold what every packet sent or received needs, the ones
+ * after them what the timers use, and the configuration, watchers and
+ * statistics come last. The resend ring and the data_seq history are
+ * allocated separately, in one block.
+ */
 typedef struct ubond_tunnel_s
 {
+    /* every packet sent */
     LIST_ENTRY(ubond_tunnel_s) entries;
-    char *name;           /* tunnel name */
-    char bindaddr[UBOND_MAXHNAMSTR]; /* packets source */
-    char bindport[UBOND_MAXPORTSTR]; /* packets port source (or NULL) */
-    char binddev[UBOND_IFNAMSIZ];    /* bind to specific device */
-    uint32_t bindfib;     /* FIB number to use */
-    char destaddr[UBOND_MAXHNAMSTR]; /* remote server ip (can be hostname) */
-    char destport[UBOND_MAXPORTSTR]; /* remote server port */
-    int id;               /* Unique ID which will be shared between tunnel end
-                             points (e.g. port number) */
     int fd;               /* socket file descriptor */
-    int server_mode;      /* server or client */
-    int disconnects;      /* is it stable ? */
-    int conn_attempts;    /* connection attempts */
-    int fallback_only;    /* if set, this link will be used when all others are down */
+    enum chap_status status;    /* Auth status */
+    int busy_writing;
+    int idle;
+    int yielded;          /* left the waiting packets to another link */
+    uint64_t seq;
+    ubond_pkt_t **old_pkts; /* RESENDBUFSIZE packets kept for resends */
+    int64_t permitted;  /* how many bytes we can send */
+    uint32_t quota; /* how many bytes per second we can send */
+    uint32_t flow_id;
+    uint64_t bytes_since_adjust;
+    uint64_t sentpackets; /* 64bit packets sent counter */
+    uint64_t sentbytes;   /* 64bit bytes sent counter */
+    ubond_pkt_ring_t sbuf;    /* send buffer */
+    ubond_pkt_ring_t hpsbuf;  /* high priority buffer */
+    struct addrinfo *addrinfo;
+    struct ubond_xsk *xsk; /* AF_XDP socket, NULL when not in use */
+    struct ubond_worker *worker; /* seals and sends, NULL: the event loop */
+    uint32_t send_batch;   /* datagrams written per sendmmsg (1: no batching) */
+    struct ubond_tx_batch *tx_batch; /* its last batch, what a full socket left */
+    int gso;               /* coalesce equal sized frames with UDP_SEGMENT */
+    int kernel_pacing;     /* the kernel spaces out what is sent, SO_MAX_PACING_RATE */
+    uint64_t tx_batches;   /* sendmmsg calls which sent data */
+    uint64_t tx_batch_pkts; /* datagrams sent by those calls */
     double sent_loss;   /* loss as reported by far end */
-    uint64_t loss_cnt;
-    uint64_t loss_event;
-    uint64_t pkts_cnt;
     double loss_av;    /* our average loss */
-    uint64_t seq;
     uint64_t saved_timestamp;
     uint64_t saved_timestamp_received_at;
-    uint64_t seq_last;
+
+    /* every packet received */
+    uint64_t seq_last __attribute__((aligned(64)));
     uint64_t seq_vect;
-    double srtt_av;
-    double srtt_av_d;
-    double srtt_av_c;
-    double srtt_min;
-    double weight;        /* For weight round robin */
-    uint32_t flow_id;
-    uint64_t sentpackets; /* 64bit packets sent counter */
+    uint64_t loss_cnt;
+    uint64_t loss_event;
+    uint64_t pkts_cnt;
     uint64_t recvpackets; /* 64bit packets recv counter */
-    uint64_t sentbytes;   /* 64bit bytes sent counter */
     uint64_t recvbytes;   /* 64bit bytes recv counter */
-    int64_t permitted;  /* how many bytes we can send */
-    uint32_t quota; /* how many bytes per second we can send */
-    uint32_t reorder_length_preset;  /* minimum  packets this tunnel can re-order */
+    uint64_t bm_data;
+    ev_tstamp last_activity;
+    double srtt_av_d;
+    double srtt_av_c;
     uint32_t reorder_length;  /* how many packets this tunnel can re-order */
-    uint32_t reorder_length_max;
-    uint32_t timeout;     /* configured timeout in seconds */
+    uint32_t recv_batch;   /* datagrams read per wakeup (1: no batching) */
+    int gro;               /* accept datagrams merged by UDP_GRO */
+    uint64_t rx_batches;   /* wakeups which returned data */
+    uint64_t rx_batch_pkts; /* datagrams read during those wakeups */
+    int uring_recv;        /* multishot receive armed on the io_uring */
+    uint32_t link_mtu;     /* largest datagram the link carries, IP header included */
+    int id;               /* Unique ID which will be shared between tunnel end
+                             points (e.g. port number) */
+    struct ubond_data_seq_hist *data_seq_hist; /* follows old_pkts */
+    double owd_av;         /* one way delay + clock offset, ms modulo 2^16 */
+    double owd_var;
+    uint64_t owd_c;
+
+    /* timers and scheduling */
+    double weight __attribute__((aligned(64))); /* For weight round robin */
+    double srtt_av;
+    double srtt_min;
+    double owd_skew;      /* one way delay above the fastest link, ms */
+    double sched_deficit; /* bytes owed to this link, deficit round robin */
     uint64_t bandwidth_max;   /* max bandwidth in bytes per second */
     uint64_t bandwidth;   /* current bandwidth in bytes per second */
     uint64_t bandwidth_measured;
-    uint64_t bm_data;
     uint64_t bandwidth_out;
-    ubond_pkt_list_t sbuf;    /* send buffer */
-    ubond_pkt_list_t hpsbuf;  /* high priority buffer */
-    struct addrinfo *addrinfo;
-    enum chap_status status;    /* Auth status */
-    ev_tstamp last_activity;
+    ev_tstamp last_adjust;
+    double bytes_per_sec;
+    uint32_t pacing_rate;  /* last given to the socket, 0: never */
     ev_tstamp last_connection_attempt;
     ev_tstamp next_keepalive;
     ev_tstamp last_keepalive_ack;
     ev_tstamp last_keepalive_ack_sent;
+    uint32_t reorder_length_preset;  /* minimum  packets this tunnel can re-order */
+    uint32_t reorder_length_max;
+    uint32_t timeout;     /* configured timeout in seconds */
+    int lossless;
+    int fallback_only;    /* if set, this link will be used when all others are down */
+    int server_mode;      /* server or client */
+    int disconnects;      /* is it stable ? */
+    int conn_attempts;    /* connection attempts */
+
+    /* configuration and watchers */
+    char *name;           /* tunnel name */
+    char bindaddr[UBOND_MAXHNAMSTR]; /* packets source */
+    char bindport[UBOND_MAXPORTSTR]; /* packets port source (or NULL) */
+    char binddev[UBOND_IFNAMSIZ];    /* bind to specific device */
+    uint32_t bindfib;     /* FIB number to use */
+    char destaddr[UBOND_MAXHNAMSTR]; /* remote server ip (can be hostname) */
+    char destport[UBOND_MAXPORTSTR]; /* remote server port */
+    char xdp_interface[UBOND_IFNAMSIZ]; /* AF_XDP transport on this interface */
+    uint32_t xdp_queue;    /* queue of xdp_interface to bind to */
     ev_io io_read;
     ev_io io_write;
     ev_timer io_timeout;
-    ev_check check_ev;
-
-    ev_timer send_timer;
-    ev_tstamp last_adjust;
-    uint64_t bytes_since_adjust;
-    double bytes_per_sec;
-    int lossless;
-    int busy_writing;
-    int idle;
+    ev_timer send_timer;  /* pacer, armed while waiting for budget */
+    ev_io xdp_read;
 
-    ubond_pkt_t *old_pkts[RESENDBUFSIZE];
+    /* statistics */
+    uint64_t gso_sends;    /* segmented buffers handed to the kernel */
+    uint64_t gso_segments; /* datagrams carried by those buffers */
+    uint64_t gro_recvs;    /* merged buffers read from the socket */
+    uint64_t gro_segments; /* datagrams carried by those buffers */
 } ubond_tunnel_t;
 
 #ifdef HAVE_FILTERS
@@ -227,6 +307,12 @@ ubond_tunnel_t *ubond_rtun_new(const char *name,
     uint32_t reorder_length);
 void ubond_rtun_drop(ubond_tunnel_t *t);
 void ubond_rtun_status_down(ubond_tunnel_t *t);
+void ubond_rtun_xdp_setup(ubond_tunnel_t *t);
+void ubond_rtun_set_pacing(ubond_tunnel_t *t);
+void ubond_rtun_set_gso(ubond_tunnel_t *t);
+void ubond_rtun_wake(ubond_tunnel_t *t);
+uint64_t ubond_classify_pkt(ubond_pkt_t *pkt, int worker, int workers);
+const char *ubond_io_backend(double *ops_per_syscall);
 #ifdef HAVE_FILTERS
 int ubond_filters_add(const struct bpf_program *filter, ubond_tunnel_t *tun);
 ubond_tunnel_t *ubond_filters_choose(uint32_t pktlen, const u_char *pktdata);
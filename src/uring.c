@@ -0,0 +1,242 @@
+#include "includes.h"
+
+#ifdef HAVE_IO_URING
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+/* There is no glibc wrapper for the io_uring syscalls */
+static int
+uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                        flags, NULL, 0);
+}
+
+static int
+uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+int
+ubond_uring_init(struct ubond_uring *ring, unsigned entries)
+{
+    struct io_uring_params p;
+    char *sq, *cq;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&p, 0, sizeof(p));
+    /* completions stay cheap to reap while the loop is busy elsewhere */
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = entries * 4;
+    ring->fd = uring_setup(entries, &p);
+    if (ring->fd < 0)
+        return -1;
+
+    ring->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_sz > ring->sq_ring_sz)
+            ring->sq_ring_sz = ring->cq_ring_sz;
+        ring->cq_ring_sz = ring->sq_ring_sz;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_sz, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED)
+        goto error;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_sz, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->fd,
+                             IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            ring->cq_ring = NULL;
+            goto error;
+        }
+    }
+    ring->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_sz, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        goto error;
+    }
+
+    sq = ring->sq_ring;
+    cq = ring->cq_ring;
+    ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    ring->sq_entries = p.sq_entries;
+    ring->sqe_tail = ring->sqe_submitted = *ring->sq_tail;
+    return 0;
+error:
+    ubond_uring_free(ring);
+    return -1;
+}
+
+void
+ubond_uring_free(struct ubond_uring *ring)
+{
+    if (ring->sqes)
+        munmap(ring->sqes, ring->sqes_sz);
+    if (ring->cq_ring && ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_sz);
+    if (ring->sq_ring && ring->sq_ring != MAP_FAILED)
+        munmap(ring->sq_ring, ring->sq_ring_sz);
+    if (ring->fd >= 0)
+        close(ring->fd);
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+int
+ubond_uring_register_eventfd(struct ubond_uring *ring, int efd)
+{
+    return uring_register(ring->fd, IORING_REGISTER_EVENTFD, &efd, 1);
+}
+
+/* Returns a zeroed sqe, flushing the queue to the kernel when it is full.
+ * NULL if the kernel could not take any of the queued entries. */
+struct io_uring_sqe *
+ubond_uring_get_sqe(struct ubond_uring *ring)
+{
+    struct io_uring_sqe *sqe;
+    unsigned head, idx;
+
+    head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sqe_tail - head >= ring->sq_entries) {
+        ubond_uring_submit(ring);
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        if (ring->sqe_tail - head >= ring->sq_entries)
+            return NULL;
+    }
+    idx = ring->sqe_tail & *ring->sq_mask;
+    sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[idx] = idx;
+    ring->sqe_tail++;
+    return sqe;
+}
+
+unsigned
+ubond_uring_pending(struct ubond_uring *ring)
+{
+    return ring->sqe_tail - ring->sqe_submitted;
+}
+
+/* Hand every queued sqe to the kernel in a single io_uring_enter(2) */
+int
+ubond_uring_submit(struct ubond_uring *ring)
+{
+    unsigned to_submit = ring->sqe_tail - ring->sqe_submitted;
+    int ret;
+
+    if (to_submit == 0)
+        return 0;
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+    do {
+        ret = uring_enter(ring->fd, to_submit, 0, 0);
+    } while (ret < 0 && errno == EINTR);
+    ring->enters++;
+    if (ret > 0)
+        ring->sqe_submitted += ret;
+    return ret;
+}
+
+struct io_uring_cqe *
+ubond_uring_peek_cqe(struct ubond_uring *ring)
+{
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+void
+ubond_uring_cqe_seen(struct ubond_uring *ring)
+{
+    ring->completions++;
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+int
+ubond_uring_bufring_init(struct ubond_uring *ring,
+    struct ubond_uring_bufring *br, uint16_t bgid, unsigned entries)
+{
+    struct io_uring_buf_reg reg;
+
+    memset(br, 0, sizeof(*br));
+    br->sz = entries * sizeof(struct io_uring_buf);
+    br->br = mmap(NULL, br->sz, PROT_READ | PROT_WRITE,
+                  MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (br->br == MAP_FAILED) {
+        br->br = NULL;
+        return -1;
+    }
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)br->br;
+    reg.ring_entries = entries;
+    reg.bgid = bgid;
+    if (uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        munmap(br->br, br->sz);
+        br->br = NULL;
+        return -1;
+    }
+    br->entries = entries;
+    br->bgid = bgid;
+    return 0;
+}
+
+void
+ubond_uring_bufring_free(struct ubond_uring *ring,
+    struct ubond_uring_bufring *br)
+{
+    struct io_uring_buf_reg reg;
+
+    if (! br->br)
+        return;
+    memset(&reg, 0, sizeof(reg));
+    reg.bgid = br->bgid;
+    uring_register(ring->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+    munmap(br->br, br->sz);
+    br->br = NULL;
+}
+
+/* Queue a buffer, visible to the kernel after ubond_uring_bufring_commit */
+void
+ubond_uring_bufring_add(struct ubond_uring_bufring *br,
+    void *addr, unsigned len, uint16_t bid)
+{
+    struct io_uring_buf *buf = &br->br->bufs[br->tail & (br->entries - 1)];
+    buf->addr = (uint64_t)(uintptr_t)addr;
+    buf->len = len;
+    buf->bid = bid;
+    br->tail++;
+}
+
+void
+ubond_uring_bufring_commit(struct ubond_uring_bufring *br)
+{
+    __atomic_store_n(&br->br->tail, br->tail, __ATOMIC_RELEASE);
+}
+
+#endif /* HAVE_IO_URING */
@@ -0,0 +1,60 @@
+#ifndef UBOND_URING_H
+#define UBOND_URING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+/* Minimal io_uring binding: one ring, driven from the libev loop */
+struct ubond_uring
+{
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned sq_entries;
+    unsigned sqe_tail;      /* next sqe handed out */
+    unsigned sqe_submitted; /* sqes already passed to the kernel */
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_sz;
+    size_t cq_ring_sz;
+    size_t sqes_sz;
+    uint64_t enters;        /* io_uring_enter(2) calls */
+    uint64_t completions;   /* cqes reaped */
+};
+
+/* Provided buffer ring, the kernel picks a buffer at completion time */
+struct ubond_uring_bufring
+{
+    struct io_uring_buf_ring *br;
+    size_t sz;
+    unsigned entries;
+    uint16_t bgid;
+    uint16_t tail;
+};
+
+int ubond_uring_init(struct ubond_uring *ring, unsigned entries);
+void ubond_uring_free(struct ubond_uring *ring);
+int ubond_uring_register_eventfd(struct ubond_uring *ring, int efd);
+struct io_uring_sqe *ubond_uring_get_sqe(struct ubond_uring *ring);
+int ubond_uring_submit(struct ubond_uring *ring);
+unsigned ubond_uring_pending(struct ubond_uring *ring);
+struct io_uring_cqe *ubond_uring_peek_cqe(struct ubond_uring *ring);
+void ubond_uring_cqe_seen(struct ubond_uring *ring);
+
+int ubond_uring_bufring_init(struct ubond_uring *ring,
+    struct ubond_uring_bufring *br, uint16_t bgid, unsigned entries);
+void ubond_uring_bufring_free(struct ubond_uring *ring,
+    struct ubond_uring_bufring *br);
+void ubond_uring_bufring_add(struct ubond_uring_bufring *br,
+    void *addr, unsigned len, uint16_t bid);
+void ubond_uring_bufring_commit(struct ubond_uring_bufring *br);
+
+#endif
@@ -0,0 +1,624 @@
+#include "includes.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <sys/queue.h>
+#include <ev.h>
+
+#include "worker.h"
+
+/* datagrams handed to one sendmmsg(2) */
+#define UBOND_WORKER_TX_BATCH 32
+/* sockets with a full send buffer a worker waits on, beyond that it
+ * retries every UBOND_WORKER_TX_WAIT ms */
+#define UBOND_WORKER_POLL_FDS 16
+#define UBOND_WORKER_TX_WAIT 10
+
+/* Single producer, single consumer ring of pointers. Each side only writes
+ * its own index and reads the other one with acquire semantics. */
+struct worker_ring
+{
+    void **slots;
+    uint32_t mask;
+    uint32_t head __attribute__((aligned(64)));   /* consumer */
+    uint32_t tail __attribute__((aligned(64)));   /* producer */
+};
+
+struct ubond_worker
+{
+    int id;                     /* the tun queue it reads */
+    int efd;                    /* wakes the thread up */
+    pthread_t thread;
+    struct worker_ring rx;      /* packets read, to the event loop */
+    struct worker_ring tx;      /* datagrams to send, from the event loop */
+    struct worker_ring done;    /* datagrams sent, back to the event loop */
+    int sleeping;               /* in poll(2), wants an efd write */
+    /* worker side */
+    uint64_t data_seq[UBOND_REORDER_FLOWS_MAX]; /* last numbered, per flow group */
+    uint64_t failures;          /* pool failures last seen */
+    struct ubond_worker_tx *held; /* waiting for room in a socket buffer */
+    uint32_t sending;           /* odd while sending, see ubond_workers_forget() */
+    /* event loop side */
+    int queued;                 /* tx took datagrams since the last wake up */
+    struct ubond_worker_tx *slots;
+    struct ubond_worker_tx *tx_free;
+    struct ubond_worker_tx *tx_failed;
+} __attribute__((aligned(64)));
+
+extern struct ev_loop *loop;
+
+static struct ubond_worker *workers = NULL;
+static int nworkers = 0;
+static int next_worker = 0;     /* gets the next link */
+static int next_read = 0;       /* first ring ubond_workers_read() takes from */
+static struct tuntap_s *worker_tuntap;
+static ev_async worker_async;
+static ev_prepare worker_prepare;
+static void (*worker_event)(void);
+static void (*worker_failed)(struct ubond_worker_tx *tx);
+/* see ubond_workers_park() */
+static pthread_mutex_t park_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t park_cond = PTHREAD_COND_INITIALIZER;
+static int park = 0;
+static int parked = 0;
+
+static void
+worker_ring_init(struct worker_ring *r, uint32_t size)
+{
+    memset(r, 0, sizeof(*r));
+    if (! (r->slots = calloc(size, sizeof(void *))))
+        fatal("worker", "calloc failed");
+    r->mask = size - 1;
+}
+
+/* producer side */
+static uint32_t
+worker_ring_room(struct worker_ring *r)
+{
+    return r->mask + 1 - (r->tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE));
+}
+
+static int
+worker_ring_put(struct worker_ring *r, void *p)
+{
+    if (! worker_ring_room(r))
+        return -1;
+    r->slots[r->tail & r->mask] = p;
+    __atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* consumer side */
+static int
+worker_ring_empty(struct worker_ring *r)
+{
+    return r->head == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+}
+
+static void *
+worker_ring_get(struct worker_ring *r)
+{
+    void *p;
+
+    if (worker_ring_empty(r))
+        return NULL;
+    p = r->slots[r->head & r->mask];
+    __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+    return p;
+}
+
+/* Wake w up if it sleeps. The fence orders what the caller put in or took
+ * from the rings before the look at sleeping, the worker does the reverse. */
+static void
+worker_wake(struct ubond_worker *w)
+{
+    uint64_t one = 1;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_exchange_n(&w->sleeping, 0, __ATOMIC_SEQ_CST) &&
+            write(w->efd, &one, sizeof(one)) < 0)
+        log_warn("worker", "queue %d wake up failed", w->id);
+}
+
+/* Give pkt its data_seq and hand it to the event loop. Worker w numbers
+ * the flow groups which are w modulo the number of workers. */
+static void
+worker_rx_put(struct ubond_worker *w, ubond_pkt_t *pkt)
+{
+    uint64_t group = ubond_classify_pkt(pkt, w->id, nworkers);
+
+    if (pkt->p.reorder)
+        pkt->p.data_seq = (group << UBOND_REORDER_FLOW_SHIFT) |
+            ++w->data_seq[group];
+    else
+        pkt->p.data_seq = 0;
+    worker_ring_put(&w->rx, pkt);
+}
+
+/* segments of a super-packet left on rbuf, as far as the ring takes them */
+static int
+worker_rx_segments(struct ubond_worker *w, struct tuntap_queue *tq)
+{
+    int n = 0;
+
+    while (! UBOND_TAILQ_EMPTY(&tq->rbuf) && worker_ring_room(&w->rx)) {
+        worker_rx_put(w, UBOND_TAILQ_POP_LAST(&tq->rbuf));
+        n++;
+    }
+    return n;
+}
+
+/* Read up to read_batch frames of the queue. Returns 1 when there may be
+ * more to read right away, 0 once the queue or the ring ran out. */
+static int
+worker_rx(struct ubond_worker *w)
+{
+    struct tuntap_queue *tq = &worker_tuntap->q[w->id];
+    ubond_pkt_t *pkt;
+    uint64_t failures;
+    int n = 0, put, batch = worker_tuntap->read_batch;
+
+    put = worker_rx_segments(w, tq);
+    if (UBOND_TAILQ_EMPTY(&tq->rbuf) && worker_ring_room(&w->rx)) {
+        for (n = 0; n < batch && worker_ring_room(&w->rx); n++) {
+            if (! (pkt = ubond_tuntap_read(worker_tuntap, w->id)))
+                break;
+            tq->read_packets++;
+            worker_rx_put(w, pkt);
+            put++;
+            put += worker_rx_segments(w, tq);
+            if (! UBOND_TAILQ_EMPTY(&tq->rbuf))
+                break;
+        }
+        /* only the turns which found the queue readable, like the loop's */
+        if (n)
+            tq->read_wakeups++;
+    }
+    /* out of packets: the event loop may give some back */
+    failures = __atomic_load_n(&pkt_pool_stats.failures, __ATOMIC_RELAXED);
+    if (put || failures != w->failures) {
+        w->failures = failures;
+        ubond_workers_notify();
+    }
+    return n == batch;
+}
+
+static int
+worker_send(int fd, struct mmsghdr *msgs, int n)
+{
+#ifdef HAVE_SENDMMSG
+    return sendmmsg(fd, msgs, n, MSG_DONTWAIT);
+#else
+    int ret;
+
+    for (ret = 0; ret < n; ret++) {
+        if (sendmsg(fd, &msgs[ret].msg_hdr, MSG_DONTWAIT) < 0)
+            break;
+    }
+    return ret ? ret : -1;
+#endif
+}
+
+/* Seal and send what the event loop queued, then hand it back. What a
+ * full socket buffer refuses is held, ahead of anything newer for the same
+ * socket, until the worker sees room in it.
+ * Returns the number of datagrams handed back. */
+static int
+worker_tx(struct ubond_worker *w)
+{
+    struct ubond_worker_tx *txs[UBOND_WORKER_TX_BATCH], *tx;
+    struct ubond_worker_tx *held = NULL, **tail = &held;
+    struct mmsghdr msgs[UBOND_WORKER_TX_BATCH];
+    struct iovec iov[UBOND_WORKER_TX_BATCH];
+    int full[UBOND_WORKER_TX_BATCH];
+    int i, j, n = 0, nfull = 0, done = 0, run, sent, failed = 0;
+
+    /* ubond_workers_forget() waits for the sockets to be left alone */
+    __atomic_add_fetch(&w->sending, 1, __ATOMIC_SEQ_CST);
+    while (n < UBOND_WORKER_TX_BATCH && w->held) {
+        txs[n++] = w->held;
+        w->held = w->held->next;
+    }
+    while (n < UBOND_WORKER_TX_BATCH && (txs[n] = worker_ring_get(&w->tx)))
+        n++;
+    if (! n) {
+        __atomic_add_fetch(&w->sending, 1, __ATOMIC_SEQ_CST);
+        return 0;
+    }
+    memset(msgs, 0, n * sizeof(*msgs));
+    for (i = 0; i < n; i++) {
+        tx = txs[i];
+        tx->error = 0;
+        if (__atomic_load_n(&tx->cancelled, __ATOMIC_SEQ_CST))
+            tx->error = ECANCELED;
+        else if (tx->seal.len &&
+                crypto_encrypt((unsigned char *)tx->wire.data,
+                               (const unsigned char *)tx->wire.data,
+                               tx->seal.len, tx->seal.nonce) != 0)
+            tx->error = EINVAL;
+        tx->seal.len = 0;       /* sealed once, even if held */
+        iov[i].iov_base = &tx->wire;
+        iov[i].iov_len = tx->wlen;
+        msgs[i].msg_hdr.msg_name = &tx->addr;
+        msgs[i].msg_hdr.msg_namelen = tx->addrlen;
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    /* the datagrams in a row for the same socket go in one call */
+    for (i = 0; i < n; i += sent) {
+        sent = 1;
+        if (txs[i]->error)
+            continue;
+        for (j = 0; j < nfull && full[j] != txs[i]->fd; j++)
+            ;
+        if (j < nfull) {
+            /* behind one the socket refused */
+            txs[i]->error = EAGAIN;
+            continue;
+        }
+        for (run = 1; i + run < n && ! txs[i + run]->error &&
+                 txs[i + run]->fd == txs[i]->fd; run++)
+            ;
+        if ((sent = worker_send(txs[i]->fd, &msgs[i], run)) > 0)
+            continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            full[nfull++] = txs[i]->fd;
+            txs[i]->error = EAGAIN;
+        } else {
+            txs[i]->error = errno;
+        }
+        sent = 1;
+    }
+    __atomic_add_fetch(&w->sending, 1, __ATOMIC_SEQ_CST);
+
+    for (i = 0; i < n; i++) {
+        tx = txs[i];
+        if (tx->error == EAGAIN) {
+            tx->error = 0;
+            *tail = tx;
+            tail = &tx->next;
+            continue;
+        }
+        if (tx->error == ECANCELED)
+            tx->error = 0;
+        failed |= tx->error;
+        worker_ring_put(&w->done, tx);
+        done++;
+    }
+    /* older than what is still held beyond the batch */
+    *tail = w->held;
+    w->held = held;
+    if (failed || worker_ring_room(&w->done) <= UBOND_WORKER_TX_SLOTS / 2)
+        ubond_workers_notify();
+    return done;
+}
+
+static void
+worker_park()
+{
+    pthread_mutex_lock(&park_lock);
+    parked++;
+    pthread_cond_broadcast(&park_cond);
+    while (park)
+        pthread_cond_wait(&park_cond, &park_lock);
+    parked--;
+    pthread_mutex_unlock(&park_lock);
+}
+
+static void *
+worker_main(void *arg)
+{
+    struct ubond_worker *w = arg;
+    struct pollfd pfd[2 + UBOND_WORKER_POLL_FDS];
+    struct ubond_worker_tx *tx;
+    char name[16];
+    uint64_t v;
+    int busy, i, nfds, timeout;
+
+    /* by itself: naming another thread goes through /proc, gone once
+     * chrooted */
+    snprintf(name, sizeof(name), "ubond-q%d", w->id);
+    pthread_setname_np(pthread_self(), name);
+    for (;;) {
+        if (__atomic_load_n(&park, __ATOMIC_ACQUIRE))
+            worker_park();
+        busy = worker_tx(w);
+        busy |= worker_rx(w);
+        if (busy)
+            continue;
+
+        __atomic_store_n(&w->sleeping, 1, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (! worker_ring_empty(&w->tx) ||
+                __atomic_load_n(&park, __ATOMIC_ACQUIRE)) {
+            __atomic_store_n(&w->sleeping, 0, __ATOMIC_SEQ_CST);
+            continue;
+        }
+        pfd[0].fd = w->efd;
+        pfd[0].events = POLLIN;
+        /* a full ring waits for the event loop to take from it */
+        pfd[1].fd = worker_ring_room(&w->rx) ?
+            worker_tuntap->qfd[w->id] : -1;
+        pfd[1].events = POLLIN;
+        /* and the sockets which were full, for room in them */
+        nfds = 2;
+        timeout = -1;
+        for (tx = w->held; tx; tx = tx->next) {
+            for (i = 2; i < nfds && pfd[i].fd != tx->fd; i++)
+                ;
+            if (i < nfds)
+                continue;
+            if (nfds == 2 + UBOND_WORKER_POLL_FDS) {
+                timeout = UBOND_WORKER_TX_WAIT;
+                break;
+            }
+            pfd[nfds].fd = tx->fd;
+            pfd[nfds++].events = POLLOUT;
+        }
+        if (poll(pfd, nfds, timeout) < 0 && errno != EINTR)
+            fatal("worker", "poll failed");
+        __atomic_store_n(&w->sleeping, 0, __ATOMIC_SEQ_CST);
+        if ((pfd[0].revents & POLLIN) && read(w->efd, &v, sizeof(v)) < 0 &&
+                errno != EAGAIN)
+            log_warn("worker", "queue %d eventfd read failed", w->id);
+    }
+    return NULL;
+}
+
+static void
+worker_reap(struct ubond_worker *w)
+{
+    struct ubond_worker_tx *tx;
+
+    while ((tx = worker_ring_get(&w->done))) {
+        if (tx->error) {
+            /* reported from the event callback */
+            tx->next = w->tx_failed;
+            w->tx_failed = tx;
+        } else {
+            tx->tun = NULL;
+            tx->next = w->tx_free;
+            w->tx_free = tx;
+        }
+    }
+}
+
+static void
+worker_async_cb(EV_P_ ev_async *a, int revents)
+{
+    ubond_workers_reap();
+    worker_event();
+}
+
+/* right before the loop polls: wake up the workers it gave datagrams to */
+static void
+worker_flush(EV_P_ ev_prepare *p, int revents)
+{
+    int i;
+
+    for (i = 0; i < nworkers; i++) {
+        if (workers[i].queued) {
+            workers[i].queued = 0;
+            worker_wake(&workers[i]);
+        }
+    }
+}
+
+/* Start a worker for every queue of tuntap, when it has more than one.
+ * event runs on the event loop when the workers read packets or finished
+ * sends, failed for every send which did not go out.
+ * Returns the number of workers. */
+int
+ubond_workers_start(struct tuntap_s *tuntap, void (*event)(void),
+    void (*failed)(struct ubond_worker_tx *tx))
+{
+    struct ubond_worker *w;
+    sigset_t all, old;
+    int i, j;
+
+    if (tuntap->queues <= 1)
+        return 0;
+    if (posix_memalign((void **)&workers, 64,
+                       tuntap->queues * sizeof(*workers)) != 0)
+        fatal("worker", "malloc failed");
+    memset(workers, 0, tuntap->queues * sizeof(*workers));
+    worker_tuntap = tuntap;
+    worker_event = event;
+    worker_failed = failed;
+    for (i = 0; i < tuntap->queues; i++) {
+        w = &workers[i];
+        w->id = i;
+        if ((w->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+            fatal("worker", "eventfd failed");
+        worker_ring_init(&w->rx, UBOND_WORKER_RING_SIZE);
+        worker_ring_init(&w->tx, UBOND_WORKER_TX_SLOTS);
+        worker_ring_init(&w->done, UBOND_WORKER_TX_SLOTS);
+        if (! (w->slots = calloc(UBOND_WORKER_TX_SLOTS, sizeof(*w->slots))))
+            fatal("worker", "calloc failed");
+        for (j = 0; j < UBOND_WORKER_TX_SLOTS; j++) {
+            w->slots[j].next = w->tx_free;
+            w->tx_free = &w->slots[j];
+        }
+    }
+    nworkers = tuntap->queues;
+    ev_async_init(&worker_async, worker_async_cb);
+    ev_async_start(EV_A_ &worker_async);
+    ev_prepare_init(&worker_prepare, worker_flush);
+    ev_prepare_start(EV_A_ &worker_prepare);
+
+    /* signals are for the event loop */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    for (i = 0; i < nworkers; i++) {
+        if ((errno = pthread_create(&workers[i].thread, NULL, worker_main,
+                                    &workers[i])) != 0)
+            fatal("worker", "unable to start a thread");
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    log_info("worker", "%d tun queue workers started", nworkers);
+    return nworkers;
+}
+
+/* Have the event callback run, from any thread */
+void
+ubond_workers_notify()
+{
+    ev_async_send(EV_A_ &worker_async);
+}
+
+/* Stop every worker where it holds nothing of the configuration, for a
+ * reload to change it. They wait there until ubond_workers_unpark(). */
+void
+ubond_workers_park()
+{
+    uint64_t one = 1;
+    int i;
+
+    if (! nworkers)
+        return;
+    pthread_mutex_lock(&park_lock);
+    __atomic_store_n(&park, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&park_lock);
+    for (i = 0; i < nworkers; i++) {
+        if (write(workers[i].efd, &one, sizeof(one)) < 0)
+            log_warn("worker", "queue %d wake up failed", i);
+    }
+    pthread_mutex_lock(&park_lock);
+    while (parked < nworkers)
+        pthread_cond_wait(&park_cond, &park_lock);
+    pthread_mutex_unlock(&park_lock);
+}
+
+void
+ubond_workers_unpark()
+{
+    if (! nworkers)
+        return;
+    pthread_mutex_lock(&park_lock);
+    __atomic_store_n(&park, 0, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&park_cond);
+    pthread_mutex_unlock(&park_lock);
+}
+
+/* Up to n packets the workers read, in the order each one read them */
+int
+ubond_workers_read(ubond_pkt_t **pkts, int n)
+{
+    struct ubond_worker *w;
+    int i, cnt = 0, got;
+
+    for (i = 0; i < nworkers && cnt < n; i++) {
+        w = &workers[(next_read + i) % nworkers];
+        for (got = 0; cnt < n && (pkts[cnt] = worker_ring_get(&w->rx)); got++)
+            cnt++;
+        /* there is room for it to read again */
+        if (got)
+            worker_wake(w);
+    }
+    if (nworkers)
+        next_read = (next_read + 1) % nworkers;
+    return cnt;
+}
+
+/* Take back the datagrams the workers are done with, and report the ones
+ * which could not be sent */
+void
+ubond_workers_reap()
+{
+    struct ubond_worker *w;
+    struct ubond_worker_tx *tx;
+    int i;
+
+    for (i = 0; i < nworkers; i++) {
+        w = &workers[i];
+        worker_reap(w);
+        while ((tx = w->tx_failed)) {
+            w->tx_failed = tx->next;
+            worker_failed(tx);
+            tx->tun = NULL;
+            tx->next = w->tx_free;
+            w->tx_free = tx;
+        }
+    }
+}
+
+/* The socket of t is about to be closed, or t went down: its datagrams
+ * still with a worker are not sent. Returns once no worker can be using
+ * the socket any more, its number may be reused right away. */
+void
+ubond_workers_forget(ubond_tunnel_t *t)
+{
+    struct ubond_worker *w;
+    uint32_t sending;
+    int i, j, found = 0;
+
+    for (i = 0; i < nworkers; i++) {
+        for (j = 0; j < UBOND_WORKER_TX_SLOTS; j++) {
+            if (workers[i].slots[j].tun == t) {
+                workers[i].slots[j].tun = NULL;
+                __atomic_store_n(&workers[i].slots[j].cancelled, 1,
+                                 __ATOMIC_SEQ_CST);
+                found = 1;
+            }
+        }
+    }
+    if (! found)
+        return;
+    /* a worker which did not see cancelled is still in the same send */
+    for (i = 0; i < nworkers; i++) {
+        w = &workers[i];
+        sending = __atomic_load_n(&w->sending, __ATOMIC_SEQ_CST);
+        while ((sending & 1) &&
+               __atomic_load_n(&w->sending, __ATOMIC_SEQ_CST) == sending)
+            sched_yield();
+        /* to hand back what it holds */
+        worker_wake(w);
+    }
+}
+
+/* The worker a new link sends through */
+struct ubond_worker *
+ubond_worker_pick()
+{
+    return &workers[next_worker++ % nworkers];
+}
+
+/* A free slot to fill for w, NULL when all are in flight */
+struct ubond_worker_tx *
+ubond_worker_tx_get(struct ubond_worker *w)
+{
+    struct ubond_worker_tx *tx;
+
+    if (! w->tx_free)
+        worker_reap(w);
+    if (! (tx = w->tx_free))
+        return NULL;
+    w->tx_free = tx->next;
+    tx->cancelled = 0;
+    return tx;
+}
+
+/* Hand a filled slot to w, which is woken up before the loop sleeps */
+void
+ubond_worker_tx_put(struct ubond_worker *w, struct ubond_worker_tx *tx)
+{
+    worker_ring_put(&w->tx, tx);
+    w->queued = 1;
+}
+
+/* Give back a slot which was not filled after all */
+void
+ubond_worker_tx_abort(struct ubond_worker *w, struct ubond_worker_tx *tx)
+{
+    tx->tun = NULL;
+    tx->next = w->tx_free;
+    w->tx_free = tx;
+}
@@ -0,0 +1,54 @@
+#ifndef UBOND_WORKER_H
+#define UBOND_WORKER_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "pkt.h"
+#include "crypto.h"
+#include "ubond.h"
+#include "tuntap_generic.h"
+
+/*
+ * Tun queue workers. With more than one queue, every queue gets a thread
+ * which reads it, classifies and numbers what it reads, and hands the
+ * packets to the event loop through a single producer, single consumer
+ * ring. The flow groups are split between the workers, each one numbers
+ * its own. Links are spread over the same threads for the other
+ * direction: the event loop encodes a datagram in clear and the worker of
+ * the link encrypts it in place and sends it.
+ */
+#define UBOND_WORKER_RING_SIZE 1024   /* packets read, waiting for the loop */
+#define UBOND_WORKER_TX_SLOTS 128     /* sends handed to a worker */
+
+/* A datagram for a worker to seal and send. Filled by the event loop,
+ * which gets it back once sent. */
+struct ubond_worker_tx
+{
+    ubond_proto_t wire;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    int fd;
+    size_t wlen;
+    struct crypto_seal seal;
+    ubond_tunnel_t *tun;    /* NULL once the tunnel was dropped */
+    int type;
+    int error;              /* errno of a failed send */
+    int cancelled;          /* the socket of the tunnel is gone, don't send */
+    struct ubond_worker_tx *next;
+};
+
+int ubond_workers_start(struct tuntap_s *tuntap, void (*event)(void),
+    void (*failed)(struct ubond_worker_tx *tx));
+void ubond_workers_notify();
+void ubond_workers_park();
+void ubond_workers_unpark();
+int ubond_workers_read(ubond_pkt_t **pkts, int n);
+void ubond_workers_reap();
+void ubond_workers_forget(ubond_tunnel_t *t);
+struct ubond_worker *ubond_worker_pick();
+struct ubond_worker_tx *ubond_worker_tx_get(struct ubond_worker *w);
+void ubond_worker_tx_put(struct ubond_worker *w, struct ubond_worker_tx *tx);
+void ubond_worker_tx_abort(struct ubond_worker *w, struct ubond_worker_tx *tx);
+
+#endif
@@ -0,0 +1,677 @@
+#include "includes.h"
+
+#ifdef HAVE_AF_XDP
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+
+#include "log.h"
+#include "xdp.h"
+
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+
+#define UBOND_XDP_FILL_SIZE 2048
+#define UBOND_XDP_COMP_SIZE 1024
+#define UBOND_XDP_RX_SIZE 2048
+#define UBOND_XDP_TX_SIZE 1024
+/* chunks kept out of the fill ring for transmission */
+#define UBOND_XDP_TX_RESERVE 512
+#define UBOND_XDP_CHUNK(addr) ((addr) & ~((uint64_t)UBOND_XDP_FRAME_SIZE - 1))
+#define UBOND_XDP_UMEM_SIZE ((size_t)UBOND_XDP_FRAMES * UBOND_XDP_FRAME_SIZE)
+
+/* every open socket, ubond_pkt_release() looks up UMEM owners here */
+static struct ubond_xsk *xsks = NULL;
+
+static uint16_t
+xdp_ip_csum(const unsigned char *hdr)
+{
+    uint32_t sum = 0;
+    int i;
+    for (i = 0; i < 20; i += 2)
+        sum += (hdr[i] << 8) | hdr[i + 1];
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return htons(~sum & 0xffff);
+}
+
+static int
+xsk_ring_map(int fd, struct ubond_xsk_ring *r, struct xdp_ring_offset *off,
+    uint32_t size, size_t entsz, off_t pgoff)
+{
+    r->map_sz = off->desc + size * entsz;
+    r->map = mmap(NULL, r->map_sz, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, fd, pgoff);
+    if (r->map == MAP_FAILED) {
+        r->map = NULL;
+        return -1;
+    }
+    r->producer = (uint32_t *)((char *)r->map + off->producer);
+    r->consumer = (uint32_t *)((char *)r->map + off->consumer);
+    r->flags = (uint32_t *)((char *)r->map + off->flags);
+    r->ring = (char *)r->map + off->desc;
+    r->size = size;
+    r->mask = size - 1;
+    return 0;
+}
+
+static void
+xsk_ring_unmap(struct ubond_xsk_ring *r)
+{
+    if (r->map)
+        munmap(r->map, r->map_sz);
+    r->map = NULL;
+}
+
+/* entries a producer ring can take */
+static uint32_t
+xsk_prod_free(struct ubond_xsk_ring *r)
+{
+    return r->size - (*r->producer -
+                      __atomic_load_n(r->consumer, __ATOMIC_ACQUIRE));
+}
+
+/* entries waiting in a consumer ring */
+static uint32_t
+xsk_cons_avail(struct ubond_xsk_ring *r)
+{
+    return __atomic_load_n(r->producer, __ATOMIC_ACQUIRE) - *r->consumer;
+}
+
+static void
+xsk_free_chunk(struct ubond_xsk *xsk, uint64_t addr)
+{
+    xsk->free[xsk->nfree++] = UBOND_XDP_CHUNK(addr);
+}
+
+static void
+xsk_destroy(struct ubond_xsk *xsk)
+{
+    struct ubond_xsk **p;
+    for (p = &xsks; *p; p = &(*p)->next) {
+        if (*p == xsk) {
+            *p = xsk->next;
+            break;
+        }
+    }
+    if (xsk->umem)
+        munmap(xsk->umem, UBOND_XDP_UMEM_SIZE);
+    free(xsk->free);
+    free(xsk);
+}
+
+/* Set up the UMEM and the rings of the AF_XDP socket fd (opened by the
+ * privileged process) and bind it to queue of ifindex. */
+struct ubond_xsk *
+ubond_xsk_open(int fd, int ifindex, int queue, uint16_t port)
+{
+    struct ubond_xsk *xsk;
+    struct xdp_umem_reg mr;
+    struct xdp_mmap_offsets off;
+    struct sockaddr_xdp sxdp;
+    socklen_t optlen;
+    uint32_t n;
+    unsigned i;
+
+    if (!(xsk = calloc(1, sizeof(*xsk))))
+        return NULL;
+    xsk->fd = fd;
+    xsk->ifindex = ifindex;
+    xsk->queue = queue;
+    xsk->port = port;
+    xsk->umem = mmap(NULL, UBOND_XDP_UMEM_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (xsk->umem == MAP_FAILED) {
+        xsk->umem = NULL;
+        log_warn("xdp", "UMEM allocation failed");
+        goto error;
+    }
+    if (!(xsk->free = malloc(UBOND_XDP_FRAMES * sizeof(uint64_t))))
+        goto error;
+    for (i = 0; i < UBOND_XDP_FRAMES; i++)
+        xsk->free[i] = (uint64_t)(UBOND_XDP_FRAMES - 1 - i) * UBOND_XDP_FRAME_SIZE;
+    xsk->nfree = UBOND_XDP_FRAMES;
+
+    memset(&mr, 0, sizeof(mr));
+    mr.addr = (uint64_t)(uintptr_t)xsk->umem;
+    mr.len = UBOND_XDP_UMEM_SIZE;
+    mr.chunk_size = UBOND_XDP_FRAME_SIZE;
+    mr.headroom = UBOND_XDP_HEADROOM;
+    if (setsockopt(fd, SOL_XDP, XDP_UMEM_REG, &mr, sizeof(mr)) < 0) {
+        if (errno == ENOBUFS)
+            log_warnx("xdp", "UMEM registration failed: "
+                "RLIMIT_MEMLOCK too low for %zu more bytes", UBOND_XDP_UMEM_SIZE);
+        else
+            log_warn("xdp", "UMEM registration failed");
+        goto error;
+    }
+    n = UBOND_XDP_FILL_SIZE;
+    if (setsockopt(fd, SOL_XDP, XDP_UMEM_FILL_RING, &n, sizeof(n)) < 0)
+        goto ring_error;
+    n = UBOND_XDP_COMP_SIZE;
+    if (setsockopt(fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &n, sizeof(n)) < 0)
+        goto ring_error;
+    n = UBOND_XDP_RX_SIZE;
+    if (setsockopt(fd, SOL_XDP, XDP_RX_RING, &n, sizeof(n)) < 0)
+        goto ring_error;
+    n = UBOND_XDP_TX_SIZE;
+    if (setsockopt(fd, SOL_XDP, XDP_TX_RING, &n, sizeof(n)) < 0)
+        goto ring_error;
+    optlen = sizeof(off);
+    if (getsockopt(fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) < 0)
+        goto ring_error;
+    if (xsk_ring_map(fd, &xsk->fill, &off.fr, UBOND_XDP_FILL_SIZE,
+                     sizeof(uint64_t), XDP_UMEM_PGOFF_FILL_RING) < 0 ||
+        xsk_ring_map(fd, &xsk->comp, &off.cr, UBOND_XDP_COMP_SIZE,
+                     sizeof(uint64_t), XDP_UMEM_PGOFF_COMPLETION_RING) < 0 ||
+        xsk_ring_map(fd, &xsk->rx, &off.rx, UBOND_XDP_RX_SIZE,
+                     sizeof(struct xdp_desc), XDP_PGOFF_RX_RING) < 0 ||
+        xsk_ring_map(fd, &xsk->tx, &off.tx, UBOND_XDP_TX_SIZE,
+                     sizeof(struct xdp_desc), XDP_PGOFF_TX_RING) < 0)
+        goto ring_error;
+    ubond_xsk_refill(xsk);
+
+    memset(&sxdp, 0, sizeof(sxdp));
+    sxdp.sxdp_family = AF_XDP;
+    sxdp.sxdp_ifindex = ifindex;
+    sxdp.sxdp_queue_id = queue;
+    sxdp.sxdp_flags = XDP_USE_NEED_WAKEUP | XDP_ZEROCOPY;
+    if (bind(fd, (struct sockaddr *)&sxdp, sizeof(sxdp)) < 0) {
+        /* no zero copy support in the driver (or generic XDP) */
+        sxdp.sxdp_flags = XDP_USE_NEED_WAKEUP | XDP_COPY;
+        if (bind(fd, (struct sockaddr *)&sxdp, sizeof(sxdp)) < 0) {
+            log_warn("xdp", "bind to queue %d failed", queue);
+            goto error;
+        }
+        log_info("xdp", "queue %d bound in copy mode", queue);
+    } else {
+        log_info("xdp", "queue %d bound in zero copy mode", queue);
+    }
+    xsk->next = xsks;
+    xsks = xsk;
+    return xsk;
+ring_error:
+    log_warn("xdp", "ring setup failed");
+error:
+    xsk_ring_unmap(&xsk->fill);
+    xsk_ring_unmap(&xsk->comp);
+    xsk_ring_unmap(&xsk->rx);
+    xsk_ring_unmap(&xsk->tx);
+    close(fd);
+    xsk_destroy(xsk);
+    return NULL;
+}
+
+/* The socket is closed right away (the kernel takes it out of the redirect
+ * map); the UMEM lives on until the last received packet is released. */
+void
+ubond_xsk_close(struct ubond_xsk *xsk)
+{
+    close(xsk->fd);
+    xsk->fd = -1;
+    xsk_ring_unmap(&xsk->fill);
+    xsk_ring_unmap(&xsk->comp);
+    xsk_ring_unmap(&xsk->rx);
+    xsk_ring_unmap(&xsk->tx);
+    xsk->has_route = 0;
+    if (xsk->outstanding == 0)
+        xsk_destroy(xsk);
+    else
+        xsk->closing = 1;
+}
+
+/* Called for every released packet: gives UMEM chunks back to their
+ * socket. Returns 1 if pkt belonged to an UMEM. */
+int
+ubond_xsk_release(ubond_pkt_t *pkt)
+{
+    struct ubond_xsk *xsk;
+    char *p = (char *)pkt;
+
+    for (xsk = xsks; xsk; xsk = xsk->next) {
+        if (p >= xsk->umem && p < xsk->umem + UBOND_XDP_UMEM_SIZE) {
+            xsk_free_chunk(xsk, p - xsk->umem);
+            xsk->outstanding--;
+            if (xsk->closing && xsk->outstanding == 0)
+                xsk_destroy(xsk);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* reclaim transmitted chunks */
+static void
+xsk_complete(struct ubond_xsk *xsk)
+{
+    uint32_t n = xsk_cons_avail(&xsk->comp), i;
+    uint32_t cons = *xsk->comp.consumer;
+    uint64_t *ring = xsk->comp.ring;
+
+    for (i = 0; i < n; i++)
+        xsk_free_chunk(xsk, ring[(cons + i) & xsk->comp.mask]);
+    if (n)
+        __atomic_store_n(xsk->comp.consumer, cons + n, __ATOMIC_RELEASE);
+}
+
+void
+ubond_xsk_refill(struct ubond_xsk *xsk)
+{
+    uint32_t n = xsk_prod_free(&xsk->fill), i;
+    uint32_t prod = *xsk->fill.producer;
+    uint64_t *ring = xsk->fill.ring;
+
+    if (xsk->nfree <= UBOND_XDP_TX_RESERVE)
+        return;
+    if (n > xsk->nfree - UBOND_XDP_TX_RESERVE)
+        n = xsk->nfree - UBOND_XDP_TX_RESERVE;
+    for (i = 0; i < n; i++)
+        ring[(prod + i) & xsk->fill.mask] = xsk->free[--xsk->nfree];
+    if (n)
+        __atomic_store_n(xsk->fill.producer, prod + n, __ATOMIC_RELEASE);
+    if (n && (*xsk->fill.flags & XDP_RING_NEED_WAKEUP))
+        recvfrom(xsk->fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+}
+
+/* Next received frame for our port: *pkt points to the ubond header inside
+ * the UMEM chunk (or to a pool copy when the UMEM runs low), hdr gets the
+ * link/ip/udp headers for ubond_xsk_learn().
+ * Returns 1 with a packet, 0 when the rx ring is empty. */
+int
+ubond_xsk_recv(struct ubond_xsk *xsk, ubond_pkt_t **pkt, ssize_t *len,
+    struct sockaddr_in *from, unsigned char *hdr)
+{
+    struct xdp_desc desc;
+    unsigned char *frame;
+    uint64_t chunk;
+    uint16_t iplen, udplen;
+    ubond_pkt_t *p, *c;
+
+    while (xsk_cons_avail(&xsk->rx)) {
+        desc = ((struct xdp_desc *)xsk->rx.ring)[*xsk->rx.consumer & xsk->rx.mask];
+        __atomic_store_n(xsk->rx.consumer, *xsk->rx.consumer + 1,
+                         __ATOMIC_RELEASE);
+        chunk = UBOND_XDP_CHUNK(desc.addr);
+        frame = (unsigned char *)xsk->umem + desc.addr;
+        xsk->rx_frames++;
+
+        /* the XDP program only redirects option-less IPv4/UDP */
+        if (desc.len < UBOND_XDP_HDRLEN ||
+            desc.addr - chunk + desc.len > UBOND_XDP_FRAME_SIZE)
+            goto drop;
+        iplen = (frame[16] << 8) | frame[17];
+        udplen = (frame[38] << 8) | frame[39];
+        if (iplen + 14 > desc.len || udplen + 20 > iplen || udplen < 8 ||
+            udplen - 8 > UBOND_XDP_FRAME_SIZE - UBOND_XDP_PKT_OFF ||
+            memcmp(frame + 36, &xsk->port, 2) != 0)
+            goto drop;
+        memcpy(hdr, frame, UBOND_XDP_HDRLEN);
+        memset(from, 0, sizeof(*from));
+        from->sin_family = AF_INET;
+        memcpy(&from->sin_port, frame + 34, 2);
+        memcpy(&from->sin_addr, frame + 26, 4);
+        if (desc.addr - chunk != UBOND_XDP_FRAME_OFF)
+            memmove(xsk->umem + chunk + UBOND_XDP_FRAME_OFF, frame,
+                    UBOND_XDP_HDRLEN + udplen - 8);
+        /* the fields before p overwrite the headers, copied out above */
+        p = (ubond_pkt_t *)(xsk->umem + chunk + UBOND_XDP_PKT_OFF -
+                            offsetof(ubond_pkt_t, p));
+        p->room = UBOND_XDP_FRAME_SIZE - UBOND_XDP_PKT_OFF - UBOND_PROTO_HDRSIZ;
+        p->size_class = UBOND_PKT_CLASS_FOREIGN;
+        if (xsk->nfree < UBOND_XDP_FRAMES / 4 &&
+            (c = ubond_pkt_get_size(udplen - 8 < UBOND_PROTO_HDRSIZ ?
+                                    0 : udplen - 8 - UBOND_PROTO_HDRSIZ))) {
+            /* packets held in the reorder buffer starve the fill ring */
+            memcpy(&c->p, &p->p, udplen - 8);
+            xsk_free_chunk(xsk, chunk);
+            xsk->rx_copied++;
+            p = c;
+        } else {
+            xsk->outstanding++;
+        }
+        *pkt = p;
+        *len = udplen - 8;
+        return 1;
+drop:
+        xsk_free_chunk(xsk, chunk);
+    }
+    return 0;
+}
+
+/* Reply path from an accepted frame of the peer: swap the addresses */
+void
+ubond_xsk_learn(struct ubond_xsk *xsk, const unsigned char *hdr)
+{
+    unsigned char r[UBOND_XDP_HDRLEN];
+
+    memcpy(r, hdr + 6, 6);          /* next hop */
+    memcpy(r + 6, hdr, 6);          /* our mac */
+    memcpy(r + 12, hdr + 12, 2);
+    memcpy(r + 14, hdr + 14, 12);
+    memcpy(r + 26, hdr + 30, 4);    /* our address */
+    memcpy(r + 30, hdr + 26, 4);
+    memcpy(r + 34, hdr + 36, 2);
+    memcpy(r + 36, hdr + 34, 2);
+    memset(r + 38, 0, 4);
+    memset(r + 16, 0, 4);           /* length and id, set per frame */
+    memset(r + 24, 0, 2);
+    r[15] = 0;                      /* tos */
+    r[20] = 0x40;                   /* don't fragment */
+    r[21] = 0;
+    r[22] = 64;                     /* ttl */
+    if (xsk->has_route && memcmp(r, xsk->route_hdr, sizeof(r)) == 0)
+        return;
+    memcpy(xsk->route_hdr, r, sizeof(r));
+    memset(&xsk->peer, 0, sizeof(xsk->peer));
+    xsk->peer.sin_family = AF_INET;
+    memcpy(&xsk->peer.sin_port, r + 36, 2);
+    memcpy(&xsk->peer.sin_addr, r + 30, 4);
+    xsk->has_route = 1;
+}
+
+/* Room for the next frame to peer, NULL if it must go through the kernel
+ * (unknown reply path, peer moved, rings full). */
+ubond_proto_t *
+ubond_xsk_tx_frame(struct ubond_xsk *xsk, const struct sockaddr *peer,
+    socklen_t peerlen)
+{
+    const struct sockaddr_in *sin = (const struct sockaddr_in *)peer;
+
+    if (!xsk->has_route || peer->sa_family != AF_INET ||
+        peerlen != sizeof(*sin) ||
+        sin->sin_port != xsk->peer.sin_port ||
+        sin->sin_addr.s_addr != xsk->peer.sin_addr.s_addr)
+        return NULL;
+    xsk_complete(xsk);
+    if (xsk->nfree == 0 || xsk_prod_free(&xsk->tx) == 0)
+        return NULL;
+    return (ubond_proto_t *)(xsk->umem + xsk->free[--xsk->nfree] +
+                             UBOND_XDP_PKT_OFF);
+}
+
+void
+ubond_xsk_tx_abort(struct ubond_xsk *xsk, ubond_proto_t *wire)
+{
+    xsk_free_chunk(xsk, (char *)wire - xsk->umem);
+}
+
+/* Queue the encoded frame, ubond_xsk_kick() hands it to the kernel */
+void
+ubond_xsk_tx_commit(struct ubond_xsk *xsk, ubond_proto_t *wire, size_t wlen)
+{
+    uint64_t chunk = UBOND_XDP_CHUNK((char *)wire - xsk->umem);
+    unsigned char *frame = (unsigned char *)xsk->umem + chunk + UBOND_XDP_FRAME_OFF;
+    struct xdp_desc *desc;
+    uint32_t prod = *xsk->tx.producer;
+    uint16_t v;
+
+    memcpy(frame, xsk->route_hdr, UBOND_XDP_HDRLEN);
+    v = htons(20 + 8 + wlen);
+    memcpy(frame + 16, &v, 2);
+    v = htons(xsk->ip_id++);
+    memcpy(frame + 18, &v, 2);
+    v = xdp_ip_csum(frame + 14);
+    memcpy(frame + 24, &v, 2);
+    v = htons(8 + wlen);
+    memcpy(frame + 38, &v, 2);      /* udp checksum left at 0 (IPv4) */
+
+    desc = &((struct xdp_desc *)xsk->tx.ring)[prod & xsk->tx.mask];
+    desc->addr = chunk + UBOND_XDP_FRAME_OFF;
+    desc->len = UBOND_XDP_HDRLEN + wlen;
+    desc->options = 0;
+    __atomic_store_n(xsk->tx.producer, prod + 1, __ATOMIC_RELEASE);
+    xsk->tx_queued++;
+    xsk->tx_frames++;
+}
+
+void
+ubond_xsk_kick(struct ubond_xsk *xsk)
+{
+    if (xsk->tx_queued && (*xsk->tx.flags & XDP_RING_NEED_WAKEUP)) {
+        if (sendto(xsk->fd, NULL, 0, MSG_DONTWAIT, NULL, 0) < 0 &&
+            errno != EAGAIN && errno != EBUSY && errno != ENOBUFS)
+            log_warn("xdp", "tx wakeup failed");
+    }
+    xsk->tx_queued = 0;
+    xsk_complete(xsk);
+}
+
+/*
+ * Privileged side: one redirect program per interface. It hands IPv4/UDP
+ * frames to the AF_XDP socket registered for (rx queue, destination port)
+ * and lets everything else (ARP, other ports, fragments) through.
+ */
+struct xdp_iface
+{
+    int ifindex;
+    int link_fd;
+    int ports_fd;   /* (queue << 16 | port) -> slot */
+    int xsks_fd;    /* slot -> AF_XDP socket */
+    int nslots;
+};
+static struct xdp_iface xdp_ifaces[16];
+static int xdp_nifaces = 0;
+
+#define XI(c, d, s, o, i) \
+    ((struct bpf_insn){ .code = (c), .dst_reg = (d), .src_reg = (s), \
+                        .off = (o), .imm = (i) })
+#define XDP_PASS_AT 31
+#define TO_PASS(pc) (XDP_PASS_AT - (pc) - 1)
+
+static int
+sys_bpf(int cmd, union bpf_attr *attr)
+{
+    return (int)syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+static int
+xdp_map_create(enum bpf_map_type type)
+{
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = type;
+    attr.key_size = sizeof(uint32_t);
+    attr.value_size = sizeof(uint32_t);
+    attr.max_entries = UBOND_XDP_MAX_SOCKETS;
+    return sys_bpf(BPF_MAP_CREATE, &attr);
+}
+
+static int
+xdp_prog_load(int ports_fd, int xsks_fd)
+{
+    static char vlog[4096];
+    union bpf_attr attr;
+    int fd;
+    struct bpf_insn prog[] = {
+        /* 0 */ XI(BPF_LDX | BPF_MEM | BPF_W, 6, 1, 16, 0), /* rx_queue_index */
+        /* 1 */ XI(BPF_LDX | BPF_MEM | BPF_W, 2, 1, 0, 0),  /* data */
+        /* 2 */ XI(BPF_LDX | BPF_MEM | BPF_W, 3, 1, 4, 0),  /* data_end */
+        /* 3 */ XI(BPF_ALU64 | BPF_MOV | BPF_X, 4, 2, 0, 0),
+        /* 4 */ XI(BPF_ALU64 | BPF_ADD | BPF_K, 4, 0, 0, UBOND_XDP_HDRLEN),
+        /* 5 */ XI(BPF_JMP | BPF_JGT | BPF_X, 4, 3, TO_PASS(5), 0),
+        /* 6 */ XI(BPF_LDX | BPF_MEM | BPF_H, 4, 2, 12, 0),
+        /* 7 */ XI(BPF_JMP | BPF_JNE | BPF_K, 4, 0, TO_PASS(7), htons(0x0800)),
+        /* 8 */ XI(BPF_LDX | BPF_MEM | BPF_B, 4, 2, 14, 0),
+        /* 9 */ XI(BPF_JMP | BPF_JNE | BPF_K, 4, 0, TO_PASS(9), 0x45),
+        /* 10 */ XI(BPF_LDX | BPF_MEM | BPF_B, 4, 2, 23, 0),
+        /* 11 */ XI(BPF_JMP | BPF_JNE | BPF_K, 4, 0, TO_PASS(11), IPPROTO_UDP),
+        /* 12 */ XI(BPF_LDX | BPF_MEM | BPF_H, 4, 2, 20, 0),
+        /* 13 */ XI(BPF_ALU64 | BPF_AND | BPF_K, 4, 0, 0, htons(0x3fff)),
+        /* 14 */ XI(BPF_JMP | BPF_JNE | BPF_K, 4, 0, TO_PASS(14), 0),
+        /* 15 */ XI(BPF_LDX | BPF_MEM | BPF_H, 4, 2, 36, 0),
+        /* 16 */ XI(BPF_ALU64 | BPF_LSH | BPF_K, 6, 0, 0, 16),
+        /* 17 */ XI(BPF_ALU64 | BPF_OR | BPF_X, 6, 4, 0, 0),
+        /* 18 */ XI(BPF_STX | BPF_MEM | BPF_W, 10, 6, -4, 0),
+        /* 19 */ XI(BPF_ALU64 | BPF_MOV | BPF_X, 2, 10, 0, 0),
+        /* 20 */ XI(BPF_ALU64 | BPF_ADD | BPF_K, 2, 0, 0, -4),
+        /* 21 */ XI(BPF_LD | BPF_DW | BPF_IMM, 1, BPF_PSEUDO_MAP_FD, 0, ports_fd),
+        /* 22 */ XI(0, 0, 0, 0, 0),
+        /* 23 */ XI(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem),
+        /* 24 */ XI(BPF_JMP | BPF_JEQ | BPF_K, 0, 0, TO_PASS(24), 0),
+        /* 25 */ XI(BPF_LDX | BPF_MEM | BPF_W, 2, 0, 0, 0),
+        /* 26 */ XI(BPF_LD | BPF_DW | BPF_IMM, 1, BPF_PSEUDO_MAP_FD, 0, xsks_fd),
+        /* 27 */ XI(0, 0, 0, 0, 0),
+        /* 28 */ XI(BPF_ALU64 | BPF_MOV | BPF_K, 3, 0, 0, XDP_PASS),
+        /* 29 */ XI(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map),
+        /* 30 */ XI(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+        /* 31 */ XI(BPF_ALU64 | BPF_MOV | BPF_K, 0, 0, 0, XDP_PASS),
+        /* 32 */ XI(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+    };
+
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.insns = (uint64_t)(uintptr_t)prog;
+    attr.insn_cnt = sizeof(prog) / sizeof(prog[0]);
+    attr.license = (uint64_t)(uintptr_t)"Dual BSD/GPL";
+    attr.log_buf = (uint64_t)(uintptr_t)vlog;
+    attr.log_size = sizeof(vlog);
+    attr.log_level = 1;
+    strlcpy(attr.prog_name, "ubond_redirect", sizeof(attr.prog_name));
+    vlog[0] = '\0';
+    if ((fd = sys_bpf(BPF_PROG_LOAD, &attr)) < 0)
+        log_warn("xdp", "program rejected: %s", vlog);
+    return fd;
+}
+
+static struct xdp_iface *
+xdp_iface_get(int ifindex)
+{
+    struct xdp_iface *ifc;
+    union bpf_attr attr;
+    int i, prog_fd;
+
+    for (i = 0; i < xdp_nifaces; i++) {
+        if (xdp_ifaces[i].ifindex == ifindex)
+            return &xdp_ifaces[i];
+    }
+    if (xdp_nifaces >= (int)(sizeof(xdp_ifaces) / sizeof(xdp_ifaces[0])))
+        return NULL;
+    ifc = &xdp_ifaces[xdp_nifaces];
+    memset(ifc, 0, sizeof(*ifc));
+    ifc->ifindex = ifindex;
+    ifc->ports_fd = xdp_map_create(BPF_MAP_TYPE_HASH);
+    ifc->xsks_fd = xdp_map_create(BPF_MAP_TYPE_XSKMAP);
+    if (ifc->ports_fd < 0 || ifc->xsks_fd < 0) {
+        log_warn("xdp", "map creation failed");
+        goto error;
+    }
+    if ((prog_fd = xdp_prog_load(ifc->ports_fd, ifc->xsks_fd)) < 0)
+        goto error;
+    /* native mode when the driver has it, generic (skb) mode otherwise */
+    memset(&attr, 0, sizeof(attr));
+    attr.link_create.prog_fd = prog_fd;
+    attr.link_create.target_ifindex = ifindex;
+    attr.link_create.attach_type = BPF_XDP;
+    attr.link_create.flags = XDP_FLAGS_DRV_MODE;
+    if ((ifc->link_fd = sys_bpf(BPF_LINK_CREATE, &attr)) < 0) {
+        attr.link_create.flags = XDP_FLAGS_SKB_MODE;
+        ifc->link_fd = sys_bpf(BPF_LINK_CREATE, &attr);
+        if (ifc->link_fd >= 0)
+            log_info("xdp", "interface %d: generic XDP mode", ifindex);
+    }
+    /* the link keeps the program attached */
+    close(prog_fd);
+    if (ifc->link_fd < 0) {
+        log_warn("xdp", "unable to attach to interface %d", ifindex);
+        goto error;
+    }
+    xdp_nifaces++;
+    return ifc;
+error:
+    if (ifc->ports_fd >= 0)
+        close(ifc->ports_fd);
+    if (ifc->xsks_fd >= 0)
+        close(ifc->xsks_fd);
+    return NULL;
+}
+
+/* Attach the redirect program to ifname if needed and open an AF_XDP
+ * socket for the unprivileged process. */
+int
+root_xdp_open(const char *ifname, int *ifindex)
+{
+    int fd;
+
+    if ((*ifindex = if_nametoindex(ifname)) == 0) {
+        log_warn("xdp", "unknown interface %s", ifname);
+        return -1;
+    }
+    if (!xdp_iface_get(*ifindex))
+        return -1;
+    if ((fd = socket(AF_XDP, SOCK_RAW, 0)) < 0)
+        log_warn("xdp", "AF_XDP socket creation failed");
+    return fd;
+}
+
+/* Steer the frames for the port udp_fd is bound to into xsk_fd. Asking for
+ * the port through the socket means the unprivileged process can only
+ * divert traffic it already receives. */
+int
+root_xdp_redirect(int ifindex, int queue, int xsk_fd, int udp_fd)
+{
+    struct xdp_iface *ifc = NULL;
+    struct sockaddr_in sin;
+    socklen_t slen = sizeof(sin);
+    union bpf_attr attr;
+    uint32_t key, slot;
+    int i, proto = 0;
+
+    for (i = 0; i < xdp_nifaces; i++) {
+        if (xdp_ifaces[i].ifindex == ifindex)
+            ifc = &xdp_ifaces[i];
+    }
+    if (!ifc || queue < 0 || queue > 0xffff)
+        return -1;
+    slen = sizeof(proto);
+    if (getsockopt(udp_fd, SOL_SOCKET, SO_PROTOCOL, &proto, &slen) < 0 ||
+        proto != IPPROTO_UDP)
+        return -1;
+    slen = sizeof(sin);
+    if (getsockname(udp_fd, (struct sockaddr *)&sin, &slen) < 0 ||
+        sin.sin_family != AF_INET || sin.sin_port == 0)
+        return -1;
+    key = ((uint32_t)queue << 16) | sin.sin_port;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = ifc->ports_fd;
+    attr.key = (uint64_t)(uintptr_t)&key;
+    attr.value = (uint64_t)(uintptr_t)&slot;
+    if (sys_bpf(BPF_MAP_LOOKUP_ELEM, &attr) < 0) {
+        if (ifc->nslots >= UBOND_XDP_MAX_SOCKETS)
+            return -1;
+        slot = ifc->nslots++;
+    }
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = ifc->xsks_fd;
+    attr.key = (uint64_t)(uintptr_t)&slot;
+    attr.value = (uint64_t)(uintptr_t)&xsk_fd;
+    attr.flags = BPF_ANY;
+    if (sys_bpf(BPF_MAP_UPDATE_ELEM, &attr) < 0) {
+        log_warn("xdp", "unable to register the AF_XDP socket");
+        return -1;
+    }
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = ifc->ports_fd;
+    attr.key = (uint64_t)(uintptr_t)&key;
+    attr.value = (uint64_t)(uintptr_t)&slot;
+    attr.flags = BPF_ANY;
+    if (sys_bpf(BPF_MAP_UPDATE_ELEM, &attr) < 0) {
+        log_warn("xdp", "unable to register port %u", ntohs(sin.sin_port));
+        return -1;
+    }
+    return 0;
+}
+
+#endif /* HAVE_AF_XDP */
@@ -0,0 +1,85 @@
+#ifndef UBOND_XDP_H
+#define UBOND_XDP_H
+
+#include <stdint.h>
+#include <sys/queue.h>
+#include <netinet/in.h>
+#include <linux/if_xdp.h>
+#include <linux/bpf.h>
+
+#include "pkt.h"
+
+/*
+ * AF_XDP transport. The UMEM is cut in UBOND_XDP_FRAME_SIZE chunks, each
+ * one laid out so that the ubond header of a received frame lands right
+ * where the p member of a ubond_pkt_t starts: received packets enter the
+ * normal pipeline without a copy and come back through ubond_pkt_release().
+ * Frames hold up to 4KB, jumbo packets go through the kernel socket.
+ */
+#define UBOND_XDP_FRAMES 4096
+#define UBOND_XDP_FRAME_SIZE 4096
+#define UBOND_XDP_HEADROOM 6    /* keeps ubond_pkt_t.p 8 bytes aligned */
+#define UBOND_XDP_HDRLEN 42     /* ethernet + ipv4 + udp */
+/* offset of the frame and of the ubond_pkt_t inside a chunk */
+#define UBOND_XDP_FRAME_OFF (UBOND_XDP_HEADROOM + XDP_PACKET_HEADROOM)
+#define UBOND_XDP_PKT_OFF (UBOND_XDP_FRAME_OFF + UBOND_XDP_HDRLEN)
+#define UBOND_XDP_MAX_SOCKETS 256
+
+struct ubond_xsk_ring
+{
+    uint32_t *producer;
+    uint32_t *consumer;
+    uint32_t *flags;
+    void *ring;
+    uint32_t mask;
+    uint32_t size;
+    void *map;
+    size_t map_sz;
+};
+
+struct ubond_xsk
+{
+    int fd;
+    int ifindex;
+    int queue;
+    uint16_t port;          /* bound udp port, network order */
+    char *umem;
+    struct ubond_xsk_ring fill;
+    struct ubond_xsk_ring comp;
+    struct ubond_xsk_ring rx;
+    struct ubond_xsk_ring tx;
+    uint64_t *free;         /* free chunks */
+    unsigned nfree;
+    unsigned outstanding;   /* received packets still in the pipeline */
+    unsigned tx_queued;     /* tx descriptors not kicked yet */
+    int closing;
+    uint16_t ip_id;
+    /* reply path, learned from authenticated frames of the peer */
+    int has_route;
+    unsigned char route_hdr[UBOND_XDP_HDRLEN];
+    struct sockaddr_in peer;
+    uint64_t rx_frames;
+    uint64_t rx_copied;     /* copied out to keep the fill ring fed */
+    uint64_t tx_frames;
+    struct ubond_xsk *next;
+};
+
+/* unprivileged side */
+struct ubond_xsk *ubond_xsk_open(int fd, int ifindex, int queue, uint16_t port);
+void ubond_xsk_close(struct ubond_xsk *xsk);
+int ubond_xsk_release(ubond_pkt_t *pkt);
+int ubond_xsk_recv(struct ubond_xsk *xsk, ubond_pkt_t **pkt, ssize_t *len,
+    struct sockaddr_in *from, unsigned char *hdr);
+void ubond_xsk_refill(struct ubond_xsk *xsk);
+void ubond_xsk_learn(struct ubond_xsk *xsk, const unsigned char *hdr);
+ubond_proto_t *ubond_xsk_tx_frame(struct ubond_xsk *xsk,
+    const struct sockaddr *peer, socklen_t peerlen);
+void ubond_xsk_tx_commit(struct ubond_xsk *xsk, ubond_proto_t *wire, size_t wlen);
+void ubond_xsk_tx_abort(struct ubond_xsk *xsk, ubond_proto_t *wire);
+void ubond_xsk_kick(struct ubond_xsk *xsk);
+
+/* privileged side, see privsep.c */
+int root_xdp_open(const char *ifname, int *ifindex);
+int root_xdp_redirect(int ifindex, int queue, int xsk_fd, int udp_fd);
+
+#endif